@@ -0,0 +1,342 @@
+/**
+ * @file
+ * Benchmark of darx archive saving and loading.
+ * Generates synthetic archives, varying the number of tensors, their size and element
+ * type, saves and loads each of them repeatedly, and reports, for both saving and loading,
+ * the throughput (MB/s), the median and 99th percentile latencies, and the number of
+ * read/write system calls and major page faults per run. Loads are run with a warm page
+ * cache, a cold one (the archive's pages are dropped before each load), or both.
+ * After the first load of each configuration, the archive is loaded again, untimed, and
+ * compared with the saved data: any difference makes the benchmark exit with status 1.
+ *
+ * usage: bench_darx [-r runs] [-m max_mb] [-n count] [-s size] [-C warm|cold|both]
+ *                   [-l default|mmap|lazy|parallel] [-z none|deflate|lz4] [-d dir]
+ */
+#include "darx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <vector>
+
+using namespace darx;
+
+static const unsigned long tensor_counts[] = {1, 10, 100, 1000, 10000};
+static const unsigned long tensor_sizes[] = {16, 4 << 10, 1 << 20, 64 << 20, 1UL << 30};
+
+typedef struct {
+	const char* name;
+	ElementTypeStruct* type;
+} bench_type;
+
+/** Counters sampled before and after each run. */
+typedef struct {
+	double time;
+	unsigned long syscalls;
+	unsigned long major_faults;
+} bench_sample;
+
+/** Measurements of one operation over all runs. */
+typedef struct {
+	std::vector<double> times;
+	unsigned long syscalls;
+	unsigned long major_faults;
+} bench_result;
+
+static bench_sample sample(){
+	bench_sample s;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	s.time = ts.tv_sec + ts.tv_nsec * 1e-9;
+	// read and write system calls made by the whole process, worker threads included.
+	s.syscalls = 0;
+	FILE* io = fopen("/proc/self/io", "r");
+	if(io){
+		char key[64];
+		unsigned long value;
+		while(fscanf(io, "%63[^:]: %lu\n", key, &value) == 2){
+			if(!strcmp(key, "syscr") || !strcmp(key, "syscw")){
+				s.syscalls += value;
+			}
+		}
+		fclose(io);
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	s.major_faults = usage.ru_majflt;
+	return s;
+}
+
+static void record(bench_result& result, const bench_sample& before, const bench_sample& after){
+	result.times.push_back(after.time - before.time);
+	result.syscalls += after.syscalls - before.syscalls;
+	result.major_faults += after.major_faults - before.major_faults;
+}
+
+/** Nearest-rank percentile of the run times, in milliseconds. */
+static double percentile(std::vector<double> times, double p){
+	if(times.empty()){
+		return 0;
+	}
+	std::sort(times.begin(), times.end());
+	size_t rank = (size_t)(p * times.size() + 0.999999);
+	rank = rank < 1 ? 1 : (rank > times.size() ? times.size() : rank);
+	return times[rank - 1] * 1e3;
+}
+
+static void report(const bench_result& result, size_t bytes, int runs){
+	double p50 = percentile(result.times, 0.5);
+	printf("  %9.1f %9.3f %9.3f %8lu %6lu",
+		p50 > 0 ? bytes / (p50 * 1e-3) / 1e6 : 0, p50, percentile(result.times, 0.99),
+		result.syscalls / runs, result.major_faults / runs
+	);
+}
+
+/** Fills a buffer with compressible, but not constant, data. */
+static void fill_data(uint8_t* data, size_t size, unsigned int seed){
+	uint32_t state = seed * 2654435761u + 1;
+	for(size_t i=0; i < size; i++){
+		if(!(i & 63)){
+			state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+		}
+		data[i] = (uint8_t)((state >> ((i & 3) * 8)) + (i >> 6));
+	}
+}
+
+/** Builds a synthetic archive of count tensors of (about) size bytes each. */
+static void build_archive(darx::darx& archive, unsigned long count, unsigned long size, ElementTypeStruct* type, CompressionType compression){
+	memset(&archive, 0, sizeof(darx::darx));
+	archive.valid = true;
+	archive.number_of_tensors = count;
+	archive.tensors = new datatensor[count];
+	memset(archive.tensors, 0, count * sizeof(datatensor));
+	size_t elem_size = element_size(type);
+	for(unsigned long i=0; i < count; i++){
+		datatensor& tensor = archive.tensors[i];
+		char* name = new char[32];
+		snprintf(name, 32, "tensor_%lu", i);
+		tensor.name = name;
+		tensor.rank = 1;
+		tensor.lengths = new unsigned int[1];
+		tensor.lengths[0] = size / elem_size ? size / elem_size : 1;
+		tensor.type = type;
+		tensor.compression = compression;
+		tensor.data_size = tensor.lengths[0] * elem_size;
+		tensor.data = new uint8_t[tensor.data_size];
+		tensor.owns_data = true;
+		fill_data((uint8_t*)tensor.data, tensor.data_size, i);
+	}
+}
+
+static void delete_archive(darx::darx& archive){
+	for(uint32_t i=0; i < archive.number_of_tensors; i++){
+		delete[] archive.tensors[i].name;
+		delete[] archive.tensors[i].lengths;
+		delete[] (uint8_t*)archive.tensors[i].data;
+	}
+	delete[] archive.tensors;
+}
+
+/** Drops the file's pages from the page cache, once they are on disk. */
+static void drop_cache(const char* path){
+	int fd = open(path, O_RDONLY);
+	if(fd >= 0){
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static bool bench_save(darx::darx& archive, const char* path, bench_result& result){
+	bench_sample before = sample();
+	FILE* file = fopen(path, "wb");
+	bool saved = file && save_image_to(archive, file);
+	if(file){
+		fclose(file);
+	}
+	record(result, before, sample());
+	return saved;
+}
+
+static bool bench_load(const char* path, int flags, bool cold, bench_result& result){
+	if(cold){
+		drop_cache(path);
+	}
+	bench_sample before = sample();
+	FILE* file = fopen(path, "rb");
+	darx::darx archive;
+	bool loaded = file && load_image_from(archive, file, flags) == SUCCESS;
+	if(loaded && (flags & LOAD_MMAP)){
+		// touch every page, for mapped data to actually be read.
+		volatile uint8_t sum = 0;
+		for(uint32_t i=0; i < archive.number_of_tensors; i++){
+			const uint8_t* data = (const uint8_t*)archive.tensors[i].data;
+			for(size_t b=0; data && b < archive.tensors[i].data_size; b += 4096){
+				sum += data[b];
+			}
+		}
+	}
+	if(file){
+		fclose(file);
+	}
+	record(result, before, sample());
+	if(loaded){
+		release_image(archive);
+	}
+	return loaded;
+}
+
+/** Loads the archive again, untimed, and checks that its tensors are those that were saved. */
+static bool verify_load(const char* path, int flags, darx::darx& expected){
+	FILE* file = fopen(path, "rb");
+	darx::darx archive;
+	bool verified = file && load_image_from(archive, file, flags) == SUCCESS;
+	if(verified){
+		verified = archive.number_of_tensors == expected.number_of_tensors;
+		for(uint32_t i=0; verified && i < archive.number_of_tensors; i++){
+			datatensor& tensor = archive.tensors[i];
+			datatensor& saved = expected.tensors[i];
+			// lazy loads defer the data until it is asked for.
+			verified = load_tensor(archive, i) == SUCCESS && tensor.name && !strcmp(tensor.name, saved.name) &&
+				tensor.rank == saved.rank && tensor.lengths[0] == saved.lengths[0] &&
+				element_size(tensor.type) == element_size(saved.type) &&
+				tensor.data_size == saved.data_size && !memcmp(tensor.data, saved.data, saved.data_size);
+		}
+		release_image(archive);
+	}
+	if(file){
+		fclose(file);
+	}
+	return verified;
+}
+
+static void usage(const char* program){
+	fprintf(stderr,
+		"usage: %s [-r runs] [-m max_mb] [-n count] [-s size] [-C warm|cold|both]\n"
+		"       [-l default|mmap|lazy|parallel] [-z none|deflate|lz4] [-d dir]\n"
+		"  -r runs   : saves and loads per configuration (default 10)\n"
+		"  -m max_mb : largest archive generated, in MB (default 256)\n"
+		"  -n count  : only archives with this number of tensors\n"
+		"  -s size   : only tensors of this size, in bytes\n"
+		"  -C cache  : page cache state for loads (default both)\n"
+		"  -l flags  : load flags (default default)\n"
+		"  -z codec  : tensor compression (default none)\n"
+		"  -d dir    : directory for the archives (default /tmp)\n",
+		program
+	);
+}
+
+int main(int argc, char* argv[]){
+	int runs = 10;
+	unsigned long max_bytes = 256UL << 20;
+	unsigned long only_count = 0, only_size = 0;
+	bool warm = true, cold = true;
+	int load_flags = LOAD_DEFAULT;
+	CompressionType compression = UNCOMPRESSED;
+	const char* dir = "/tmp";
+	int opt;
+	while((opt = getopt(argc, argv, "r:m:n:s:C:l:z:d:h")) != -1){
+		switch(opt){
+			case 'r': runs = atoi(optarg); break;
+			case 'm': max_bytes = strtoul(optarg, 0, 10) << 20; break;
+			case 'n': only_count = strtoul(optarg, 0, 10); break;
+			case 's': only_size = strtoul(optarg, 0, 10); break;
+			case 'C':
+				warm = strcmp(optarg, "cold") != 0;
+				cold = strcmp(optarg, "warm") != 0;
+			break;
+			case 'l':
+				load_flags = !strcmp(optarg, "mmap") ? LOAD_MMAP : !strcmp(optarg, "lazy") ? LOAD_LAZY :
+					!strcmp(optarg, "parallel") ? LOAD_PARALLEL : LOAD_DEFAULT;
+			break;
+			case 'z':
+				compression = !strcmp(optarg, "deflate") ? DEFLATE_COMPRESSED :
+					!strcmp(optarg, "lz4") ? LZ4_COMPRESSED : UNCOMPRESSED;
+			break;
+			case 'd': dir = optarg; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(runs < 1 || !is_compression_supported(compression)){
+		usage(argv[0]);
+		return 1;
+	}
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/bench_darx.%d.darx", dir, (int)getpid());
+
+	// element types: plain values, a nested mixed type, and a custom one.
+	ElementTypeStruct float_type(TYPE_FLOAT, 1, 32);
+	ElementTypeStruct byte_type(TYPE_UINT, 1, 8);
+	ElementTypeStruct position_type(TYPE_FLOAT, 3, 32);
+	ElementTypeStruct label_type(TYPE_UINT, 1, 16);
+	ElementTypeStruct flag_type(TYPE_INT, 1, 8);
+	MixedElementTypeStruct attributes_type(TYPE_MIXED, 2, 0);
+	attributes_type.subtypes[0] = &label_type;
+	attributes_type.subtypes[1] = &flag_type;
+	MixedElementTypeStruct point_type(TYPE_MIXED, 2, 0);
+	point_type.subtypes[0] = &position_type;
+	point_type.subtypes[1] = &attributes_type;
+	CustomElementTypeStruct custom_type(TYPE_CUSTOM, 1, 16, "rgb565");
+	bench_type types[] = {
+		{"float32", &float_type}, {"uint8", &byte_type}, {"mixed", &point_type}, {"custom", &custom_type}
+	};
+
+	printf("# %d runs per configuration, %s loads, compression %d\n", runs,
+		load_flags == LOAD_MMAP ? "mapped" : load_flags == LOAD_LAZY ? "lazy" : load_flags == LOAD_PARALLEL ? "parallel" : "default",
+		(int)compression);
+	printf("#%7s %10s %-8s %-5s  %9s %9s %9s %8s %6s  %9s %9s %9s %8s %6s\n",
+		"tensors", "size", "type", "cache",
+		"save MB/s", "p50 ms", "p99 ms", "syscalls", "faults",
+		"load MB/s", "p50 ms", "p99 ms", "syscalls", "faults");
+	bool failed = false;
+	for(size_t c=0; c < sizeof(tensor_counts) / sizeof(tensor_counts[0]); c++){
+		unsigned long count = tensor_counts[c];
+		if(only_count && count != only_count){ continue; }
+		for(size_t s=0; s < sizeof(tensor_sizes) / sizeof(tensor_sizes[0]); s++){
+			unsigned long size = tensor_sizes[s];
+			if((only_size && size != only_size) || count * size > max_bytes){ continue; }
+			for(size_t t=0; t < sizeof(types) / sizeof(types[0]); t++){
+				darx::darx archive;
+				build_archive(archive, count, size, types[t].type, compression);
+				size_t bytes = 0;
+				for(uint32_t i=0; i < archive.number_of_tensors; i++){
+					bytes += archive.tensors[i].data_size;
+				}
+				bench_result save_result;
+				save_result.syscalls = save_result.major_faults = 0;
+				for(int run=0; run < runs; run++){
+					failed = !bench_save(archive, path, save_result) || failed;
+				}
+				for(int cache=0; cache < 2; cache++){
+					if(!(cache ? cold : warm)){ continue; }
+					bench_result load_result;
+					load_result.syscalls = load_result.major_faults = 0;
+					for(int run=0; run < runs; run++){
+						failed = !bench_load(path, load_flags, cache, load_result) || failed;
+						if(!run && !verify_load(path, load_flags, archive)){
+							fprintf(stderr, "%lu tensors of %lu bytes (%s): loaded data differs from the saved data.\n",
+								count, size, types[t].name);
+							failed = true;
+						}
+					}
+					printf(" %7lu %10lu %-8s %-5s", count, size, types[t].name, cache ? "cold" : "warm");
+					report(save_result, bytes, runs);
+					report(load_result, bytes, runs);
+					printf("\n");
+					fflush(stdout);
+				}
+				delete_archive(archive);
+			}
+		}
+	}
+	unlink(path);
+	if(failed){
+		fprintf(stderr, "some archives could not be saved, loaded or verified.\n");
+	}
+	return failed ? 1 : 0;
+}
@@ -1,15 +1,23 @@
 #include "darx.h"
+#include "darx_private.h"
+#include "darx_parallel.h"
 #include <iostream>
+#include <algorithm>
 #include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-// magic number for darx files
-#define DARX_MAGIC "DARX"
-#define DARX_MAGIC_LEN 4
-// endianness test "LIVE" is big endian, "EVIL" is little endian
-#define DARX_MAGIC_BE 0x4c495645
 
 namespace darx{
 	int VERBOSE;
+	int THREADS;
+	int FORMAT_VERSION = 1;
+	unsigned int PAYLOAD_ALIGNMENT = 64;
 	CustomElementTypeStruct UNKNOWN_TYPE(TYPE_CUSTOM, 1, 8, "unknown");
 	
 	const char* errors[]={
@@ -37,24 +45,216 @@ namespace darx{
 		int len=strlen(_type_name);
 		type_name=new char[len+1];
 		for(int i=0; i<len; i++){type_name[i] = _type_name[i];}
+		type_name[len]=0;
 	}
 	
+	bool system_is_big_endian(){
+		int endianness_i = 0x00010203;
+		return ((char*)&endianness_i)[0] == 0x00;
+	}
+	
+	bool needs_swap(darx& darx){
+		return darx.isBigEndian != system_is_big_endian();
+	}
+	
+	bool native_format(data_type_info& format, int version, unsigned int payload_alignment){
+		format.swapEndian = false;
+		format.version = version;
+		if(version == 1){
+			format.int_size = sizeof(unsigned int);
+			format.long_size = sizeof(long int);
+			format.count_size = sizeof(uint16_t);
+			format.payload_alignment = 1;
+			return true;
+		}
+		// version 2: fixed 64-bit fields.
+		format.int_size = sizeof(uint64_t);
+		format.long_size = sizeof(uint64_t);
+		format.count_size = sizeof(uint64_t);
+		format.payload_alignment = payload_alignment;
+		return version == 2 && payload_alignment && payload_alignment <= DARX_MAX_PAYLOAD_ALIGNMENT &&
+			!(payload_alignment & (payload_alignment - 1));
+	}
+	
+	bool archive_format(data_type_info& format, darx& darx){
+		return !needs_swap(darx) && native_format(format, darx.format_version, darx.payload_alignment);
+	}
+	
+	/** Encodes an unsigned integer in its size bytes, with the system's endianness.
+	 *  Returns false if the value does not fit.
+	 */
+	static bool encode_uint(uint8_t* bytes, uint64_t value, uint8_t size){
+		if(size < 8 && (value >> (8 * size))){
+			return false;
+		}
+		for(int i=0; i < size; i++){
+			bytes[system_is_big_endian() ? size - 1 - i : i] = (uint8_t)(value >> (8 * i));
+		}
+		return true;
+	}
+	
+	bool write_uint(FILE* file, uint64_t value, uint8_t size){
+		uint8_t bytes[8];
+		return encode_uint(bytes, value, size) && write_file(bytes, 1, size, file) == size;
+	}
+	
+	/** write_uint() to a descriptor serialized in memory, which is not counted as a file write. */
+	static bool put_uint(FILE* mem, uint64_t value, uint8_t size){
+		uint8_t bytes[8];
+		return encode_uint(bytes, value, size) && fwrite(bytes, 1, size, mem) == size;
+	}
+	
+	bool write_index(FILE* file, const long int* positions, size_t count, const data_type_info& format){
+		if(format.long_size == sizeof(long int)){
+			return write_file(positions, sizeof(long int), count, file) == count;
+		}
+		uint8_t* index = new uint8_t[count * format.long_size];
+		bool big_endian = system_is_big_endian();
+		for(size_t i=0; i < count; i++){
+			uint64_t position = positions[i];
+			for(int b=0; b < format.long_size; b++){
+				index[i * format.long_size + (big_endian ? format.long_size - 1 - b : b)] = (uint8_t)(position >> (8 * b));
+			}
+		}
+		bool written = write_file(index, format.long_size, count, file) == count;
+		delete[] index;
+		return written;
+	}
+	
+	// size of the window through which an archive's header and descriptors are read.
+	#define DESCRIPTOR_WINDOW_SIZE (64 << 10)
+
+	/** Reads an archive's header and descriptors through a window of the file, so that
+	 *  they are decoded from memory rather than field by field from the file.
+	 *  The window is refilled with a single read whenever a field falls out of it,
+	 *  or spans the whole file mapping, if there is one.
+	 */
 	typedef struct {
-		bool swapEndian;
-		uint8_t int_size;
-		uint8_t long_size;
-	} data_type_info;
+		FILE* file;
+		const uint8_t* window;
+		long int window_pos;
+		size_t window_len;
+		uint8_t* buffer;
+		size_t capacity;
+		long int pos;
+		bool failed;
+		unsigned int reads;
+	} descriptor_reader;
+
+	static void init_reader(descriptor_reader& reader, darx& darx, FILE* file, long int pos){
+		reader.file = file;
+		reader.window = (const uint8_t*)darx.mapping;
+		reader.window_pos = 0;
+		reader.window_len = darx.mapping ? darx.mapping_size : 0;
+		reader.buffer = 0;
+		reader.capacity = 0;
+		reader.pos = pos;
+		reader.failed = false;
+		reader.reads = 0;
+	}
+
+	static void release_reader(descriptor_reader& reader){
+		delete[] reader.buffer;
+		reader.buffer = 0;
+	}
+
+	/** Reads up to len bytes at the given file offset, returns the number of bytes read. */
+	static size_t read_at(FILE* file, uint8_t* buffer, size_t len, long int pos){
+		int fd = fileno(file);
+		if(fd < 0){
+			return seek_file(file, pos, SEEK_SET) ? 0 : read_file(buffer, 1, len, file);
+		}
+		size_t done = 0;
+		while(done < len){
+			ssize_t count = pread(fd, buffer + done, len - done, pos + done);
+			count_stat(&io_stats::read_calls, 1);
+			if(count <= 0){
+				if(count < 0 && errno == EINTR){ continue; }
+				break;
+			}
+			count_stat(&io_stats::bytes_read, count);
+			done += count;
+		}
+		return done;
+	}
+
+	/** Returns a pointer to the next len bytes, refilling the window from the
+	 *  current position if needed, or 0 (and fails the reader) if they are out of the file.
+	 */
+	static const uint8_t* reader_bytes(descriptor_reader& reader, size_t len){
+		if(reader.failed || reader.pos < 0){
+			reader.failed = true;
+			return 0;
+		}
+		size_t window_offset = reader.pos - reader.window_pos;
+		if(reader.pos < reader.window_pos || window_offset + len > reader.window_len){
+			if(!reader.buffer && reader.window){
+				// the window is the whole file mapping.
+				reader.failed = true;
+				return 0;
+			}
+			if(len > reader.capacity){
+				size_t capacity = len > DESCRIPTOR_WINDOW_SIZE ? len : DESCRIPTOR_WINDOW_SIZE;
+				delete[] reader.buffer;
+				reader.buffer = new uint8_t[capacity];
+				reader.capacity = capacity;
+			}
+			reader.window = reader.buffer;
+			reader.window_pos = reader.pos;
+			reader.window_len = read_at(reader.file, reader.buffer, reader.capacity, reader.pos);
+			reader.reads++;
+			window_offset = 0;
+			if(len > reader.window_len){
+				reader.failed = true;
+				return 0;
+			}
+		}
+		reader.pos += len;
+		return reader.window + window_offset;
+	}
+
+	/** Copies the next len bytes into the given buffer. */
+	static bool reader_read(descriptor_reader& reader, void* buffer, size_t len){
+		const uint8_t* bytes = reader_bytes(reader, len);
+		if(bytes && len > 0){
+			memcpy(buffer, bytes, len);
+		}
+		return bytes != 0;
+	}
+
+	static uint8_t read_uint8(descriptor_reader& reader){
+		const uint8_t* bytes = reader_bytes(reader, 1);
+		return bytes ? bytes[0] : 0;
+	}
+
+	/** Reads an unsigned integer of the given size (in bytes),
+	 *  swapping its bytes if it was stored with the other endianness.
+	 */
+	static uint64_t read_uint(descriptor_reader& reader, uint8_t size, bool swap){
+		const uint8_t* bytes = size <= 8 ? reader_bytes(reader, size) : 0;
+		if(!bytes){
+			reader.failed = true;
+			return 0;
+		}
+		// the stored bytes, least significant first
+		bool stored_big_endian = system_is_big_endian() != swap;
+		uint64_t value = 0;
+		for(int i=0; i < size; i++){
+			value |= ((uint64_t)bytes[stored_big_endian ? size - 1 - i : i]) << (8 * i);
+		}
+		return value;
+	}
 	
 	bool write_tensor_type(ElementTypeStruct* tensor_type, FILE* file){
 		if(!tensor_type){
 			return false;
 		}
 		uint8_t ttt = (uint8_t)tensor_type->type;
-if(VERBOSE){ std::cout << "#    element type : " << ((int)ttt) << std::endl; }
+DARX_TRACE("#    element type : " << ((int)ttt));
 		fwrite(&ttt, sizeof(uint8_t), 1, file);
-if(VERBOSE){ std::cout << "#       comps : " << ((int)tensor_type->components) << std::endl; }
+DARX_TRACE("#       comps : " << ((int)tensor_type->components));
 		fwrite(&(tensor_type->components), sizeof(uint8_t), 1, file);
-if(VERBOSE){ std::cout << "#       bitwidth : " << ((int)tensor_type->bit_width) << std::endl; }
+DARX_TRACE("#       bitwidth : " << ((int)tensor_type->bit_width));
 		fwrite(&(tensor_type->bit_width ), sizeof(uint8_t), 1, file);
 		switch(tensor_type->type){
 			case TYPE_INT: case TYPE_UINT: case TYPE_FLOAT: case TYPE_CHAR:
@@ -79,177 +279,505 @@ if(VERBOSE){ std::cout << "#       bitwidth : " << ((int)tensor_type->bit_width)
 		return true;
 	}
 	
-	ElementTypeStruct* read_tensor_type(darx& darx, FILE* file, data_type_info& dtinfo){
-		uint8_t tensor_type_tag, components, bit_width;
-		fread(&tensor_type_tag, sizeof(uint8_t), 1, file);
-if(VERBOSE){ std::cout << "#    element type : " << ((int)tensor_type_tag) << std::endl; }
-		fread(&(components), sizeof(uint8_t), 1, file);
-if(VERBOSE){ std::cout << "#       comps : " << ((int)components) << std::endl; }
-		fread(&(bit_width ), sizeof(uint8_t), 1, file);
-if(VERBOSE){ std::cout << "#       bitwidth : " << ((int)bit_width) << std::endl; }
+	/** Allocates an array of count T from the archive's arena. */
+	template<typename T> static inline T* arena_new(darx& darx, size_t count){
+		return (T*)arena_alloc(darx.arena, count * sizeof(T));
+	}
+	
+	/** Reads an element type's encoding into the key, as it is stored. */
+	static bool read_tensor_type_key(descriptor_reader& reader, std::string& key){
+		uint8_t tensor_type_tag = read_uint8(reader);
+DARX_TRACE("#    element type : " << ((int)tensor_type_tag));
+		uint8_t components = read_uint8(reader);
+DARX_TRACE("#       comps : " << ((int)components));
+		uint8_t bit_width = read_uint8(reader);
+DARX_TRACE("#       bitwidth : " << ((int)bit_width));
+		if(reader.failed){
+			return false;
+		}
+		key.push_back((char)tensor_type_tag);
+		key.push_back((char)components);
+		key.push_back((char)bit_width);
 		switch(tensor_type_tag){
 			case TYPE_INT: case TYPE_UINT: case TYPE_FLOAT: case TYPE_CHAR:
-				return new ElementTypeStruct((ElementType)tensor_type_tag, components, bit_width);
-			break;
-			case TYPE_MIXED:{
-				MixedElementTypeStruct* mixedtype = new MixedElementTypeStruct((ElementType)tensor_type_tag, components, bit_width);
+				return true;
+			case TYPE_MIXED:
 				for(int comp_idx=0; comp_idx < components; comp_idx++){
-					mixedtype->subtypes[comp_idx] = read_tensor_type(darx, file, dtinfo);
+					if(!read_tensor_type_key(reader, key)){
+						return false;
+					}
 				}
-				return mixedtype;
-			} break;
+				return true;
 			case TYPE_CUSTOM:{
-				uint8_t namelen;
-				fread(&namelen, sizeof(uint8_t), 1, file);
-				char* type_name = new char[namelen+1];
-				fread(type_name, sizeof(char), namelen, file);
-				type_name[namelen] = 0;
-				
-				CustomElementTypeStruct* customtype = new CustomElementTypeStruct(
-					(ElementType)tensor_type_tag, components, bit_width, type_name
-				);
-				return customtype;
-			} break;
+				uint8_t namelen = read_uint8(reader);
+				size_t name_pos = key.size() + 1;
+				key.push_back((char)namelen);
+				key.resize(name_pos + namelen);
+				return reader_read(reader, &key[name_pos], namelen);
+			}
 			default:
-				return 0;
-		}		
+				return false;
+		}
+	}
+	
+	/** Reads an element type, interned (see intern_type()). */
+	static ElementTypeStruct* read_tensor_type(descriptor_reader& reader){
+		// the key's buffer is reused, so that known types are found without allocating.
+		static thread_local std::string key;
+		key.clear();
+		if(!read_tensor_type_key(reader, key)){
+			return 0;
+		}
+		return intern_type_key((const uint8_t*)key.data(), key.size());
+	}
+	
+	ElementTypeStruct* decode_tensor_type(const uint8_t* data, size_t len){
+		return intern_type_key(data, len);
+	}
+	
+	/** Encodes a tensor's data as it is stored in the file (tiled and/or compressed). */
+	bool encode_tensor_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp){
+		uint64_t start = stats_clock();
+		bool encoded;
+		if(tensor.bit_packed || tensor.filters){
+			// the values are packed or filtered first, then the transformed data is compressed.
+			datatensor transformed = tensor;
+			if(tensor.bit_packed){
+				encoded = pack_tensor_data(tensor, (uint8_t**)&transformed.data, &transformed.data_size);
+			} else {
+				transformed.data = new uint8_t[tensor.data_size];
+				encoded = filter_tensor_data(tensor, (uint8_t*)transformed.data, tensor.data_size);
+			}
+			encoded = encoded && compress_data(transformed, cdata, cdata_len, cdata_is_temp);
+			if(encoded && !(*cdata_is_temp)){
+				// the transformed data is stored as is.
+				(*cdata_is_temp) = true;
+			} else if(transformed.data != tensor.data){
+				delete[] (uint8_t*)transformed.data;
+			}
+		} else {
+			encoded = tensor.tile_lengths ?
+				encode_tiled_data(tensor, cdata, cdata_len, cdata_is_temp) :
+				compress_data(tensor, cdata, cdata_len, cdata_is_temp);
+		}
+		count_stat(&io_stats::compress_time, stats_clock() - start);
+		return encoded;
 	}
 	
-	bool compress_data(datatensor& tensor, uint8_t** cdata, unsigned int* cdata_len, bool* cdata_is_temp);
-	bool decompress_data(datatensor& tensor, uint8_t** cdata, unsigned int* cdata_len, bool* cdata_is_temp);
+	/** Decodes a tensor's data from the way it is stored in the file, into out if given. */
+	bool decode_tensor_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp, bool swap, uint8_t* out, size_t out_len){
+		if(tensor.tile_lengths){
+			return decode_tiled_data(tensor, cdata, cdata_len, cdata_is_temp, swap, out, out_len);
+		}
+		if(tensor.bit_packed){
+			// the values are unpacked from the decompressed data, into out.
+			size_t packed_size = bit_packed_size(tensor);
+			if(!out || !decompress_data(tensor, cdata, cdata_len, cdata_is_temp, swap)){
+				return false;
+			}
+			bool unpacked = unpack_tensor_data(tensor, (const uint8_t*)tensor.data, tensor.data_size == packed_size ? packed_size : 0, out, out_len);
+			if(*cdata_is_temp){
+				delete[] (uint8_t*)tensor.data;
+			}
+			tensor.data = out;
+			tensor.data_size = out_len;
+			(*cdata_is_temp) = true;
+			return unpacked;
+		}
+		if(tensor.filters){
+			// the filters are undone from the decompressed data, into out.
+			if(!out || !decompress_data(tensor, cdata, cdata_len, cdata_is_temp, swap)){
+				return false;
+			}
+			bool unfiltered = unfilter_tensor_data(tensor, (const uint8_t*)tensor.data, tensor.data_size, out, out_len, swap);
+			if(*cdata_is_temp){
+				delete[] (uint8_t*)tensor.data;
+			}
+			tensor.data = out;
+			tensor.data_size = out_len;
+			(*cdata_is_temp) = true;
+			return unfiltered;
+		}
+		return decompress_data(tensor, cdata, cdata_len, cdata_is_temp, swap, out, out_len);
+	}
 	
-	int write_tensor(datatensor& tensor, FILE* file){
+	/**
+	 * Writes a tensor's descriptor, up to the size of its stored data.
+	 */
+	int write_tensor_descriptor(datatensor& tensor, FILE* file, size_t cdata_length, const data_type_info& format){
 		// write tensor's name
 		uint8_t namelen = tensor.name ? strlen(tensor.name) : 0;
 		fwrite(&namelen, sizeof(uint8_t), 1, file);
 		if(tensor.name){
-if(VERBOSE){ std::cout << "#    name : " << tensor.name << std::endl; }
+DARX_TRACE("#    name : " << tensor.name);
 			fwrite(tensor.name, sizeof(char), namelen, file);
 		}
 		// write the tensor's rank
-if(VERBOSE){ std::cout << "#    rank : " << ((int)tensor.rank) << std::endl; }
+DARX_TRACE("#    rank : " << ((int)tensor.rank));
 		fwrite(&(tensor.rank), sizeof(uint8_t), 1, file);
 		// write the length of each dimmension 
-if(VERBOSE){ std::cout << "#    lengths : "; for(int i=0; i < tensor.rank; i++){ std::cout << tensor.lengths[i] << "   "; } std::cout << std::endl; }
-		fwrite(tensor.lengths, sizeof(unsigned int), tensor.rank, file);
+DARX_TRACE_LIST("#    lengths : ", tensor.lengths, tensor.rank);
+		for(int dim_idx=0; dim_idx < tensor.rank; dim_idx++){
+			put_uint(file, tensor.lengths[dim_idx], format.int_size);
+		}
 		// write the element type stuct
 		if(!write_tensor_type(tensor.type, file)){
 			return UNSUPPORTED_ELEMENT_TYPE;
 		}
-		// write the data (possibly compressed)
-		{
-			bool cdata_is_temp=false;
-			unsigned int cdata_length=0;
-			uint8_t* cdata=0;
-			if(!tensor.data){
+		uint8_t ctype = (uint8_t)tensor.compression;
+		uint8_t layout = tensor.tile_lengths ? LAYOUT_TILED : LAYOUT_CONTIGUOUS;
+		if(tensor.columnar){
+			// columns are only defined for mixed types, and are not tiled.
+			if(tensor.type->type != TYPE_MIXED || tensor.tile_lengths){
 				return INVALID_STRUCT;
 			}
-			if(!compress_data(tensor, &cdata, &cdata_length, &cdata_is_temp)){
-if(VERBOSE){ std::cout << "#    cdata size:  " << cdata_length << std::endl; }
-				return UNSUPPORTED_COMPRESS_TYPE;
-			}
-			uint8_t ctype = (uint8_t)tensor.compression;
-			fwrite(&ctype, sizeof(uint8_t), 1, file);
-if(VERBOSE){ std::cout << "#    cdata size:  " << cdata_length << std::endl; }
-			fwrite(&cdata_length, sizeof(unsigned int), 1, file);
-if(VERBOSE){ std::cout << "#    cdata :  " << ((void*)cdata) << std::endl; }
-			fwrite(cdata, cdata_length, 1, file);
-			if(cdata_is_temp){
-if(VERBOSE){ std::cout << "#    deleting temp cdata...  " << cdata << std::endl; }
-				delete[] cdata;
+			layout |= LAYOUT_COLUMNAR;
+		}
+		if(tensor.bit_packed){
+			if(!can_bit_pack(tensor.type) || tensor.tile_lengths){
+				return INVALID_STRUCT;
+			}
+			layout |= LAYOUT_BITPACKED;
+		}
+		if(tensor.filters){
+			if(!can_filter(tensor)){
+				return INVALID_STRUCT;
+			}
+			layout |= LAYOUT_FILTERED;
+		}
+		if(layout != LAYOUT_CONTIGUOUS){
+			ctype |= DARX_EXTENDED_DESCRIPTOR;
+		}
+		fwrite(&ctype, sizeof(uint8_t), 1, file);
+		if(layout != LAYOUT_CONTIGUOUS){
+			// extended descriptor: layout flags, followed by each layout's parameters.
+DARX_TRACE("#    layout :  " << ((int)layout));
+			fwrite(&layout, sizeof(uint8_t), 1, file);
+			if(layout & LAYOUT_TILED){
+DARX_TRACE_LIST("#    tile lengths : ", tensor.tile_lengths, tensor.rank);
+				for(int dim_idx=0; dim_idx < tensor.rank; dim_idx++){
+					put_uint(file, tensor.tile_lengths[dim_idx], format.int_size);
+				}
 			}
+			if(layout & LAYOUT_FILTERED){
+DARX_TRACE("#    filters :  " << ((int)tensor.filters));
+				fwrite(&tensor.filters, sizeof(uint8_t), 1, file);
+			}
+		}
+DARX_TRACE("#    cdata size:  " << cdata_length);
+		if(!put_uint(file, cdata_length, format.int_size)){
+			// too large for the format's sizes.
+			return INVALID_STRUCT;
 		}
 		return SUCCESS;
 	}
 	
-	bool compress_data(datatensor& tensor, uint8_t** cdata, unsigned int* cdata_len, bool* cdata_is_temp){
-		CompressionType compression = tensor.compression;
-		if(compression == UNCOMPRESSED){
-if(VERBOSE){ std::cout << "#    [no compression] " << std::endl; }
-			(*cdata) = (uint8_t*)tensor.data;
-			(*cdata_len) = tensor.data_size;
-			(*cdata_is_temp) = false;
-			return true;
+	char* serialize_tensor_descriptor(datatensor& tensor, size_t cdata_length, long int position,
+		const data_type_info& format, size_t* descriptor_length
+	){
+		char* descriptor = 0;
+		FILE* mem = open_memstream(&descriptor, descriptor_length);
+		if(!mem){
+			return 0;
+		}
+		int result = write_tensor_descriptor(tensor, mem, cdata_length, format);
+		// padding up to the stored data's aligned offset.
+		long int data_pos = position + ftell(mem);
+		for(long int pad = align_payload(format, data_pos) - data_pos; pad > 0; pad--){
+			fputc(0, mem);
 		}
-		return false;
+		fclose(mem);
+		if(result != SUCCESS){
+			free(descriptor);
+			return 0;
+		}
+		return descriptor;
 	}
-
-	bool decompress_data(datatensor& tensor, uint8_t** cdata, unsigned int* cdata_len, bool* cdata_is_temp){
-		CompressionType compression = tensor.compression;
-		if(compression == UNCOMPRESSED){
-if(VERBOSE){ std::cout << "#    [no compression] " << std::endl; }
-			tensor.data = (*cdata);
-			tensor.data_size = (*cdata_len);
-			(*cdata_is_temp) = false;
-			return true;
+	
+	int write_tensor(datatensor& tensor, FILE* file, const data_type_info& format){
+		bool cdata_is_temp=false;
+		size_t cdata_length=0;
+		uint8_t* cdata=0;
+		if(!tensor.data || !valid_tile_lengths(tensor)){
+			return INVALID_STRUCT;
+		}
+		if(!encode_tensor_data(tensor, &cdata, &cdata_length, &cdata_is_temp)){
+			return UNSUPPORTED_COMPRESS_TYPE;
+		}
+		// the descriptor is written at once, followed by the data (possibly compressed).
+		size_t descriptor_length = 0;
+		char* descriptor = serialize_tensor_descriptor(tensor, cdata_length, ftell(file), format, &descriptor_length);
+		int result = descriptor ? SUCCESS : UNSUPPORTED_ELEMENT_TYPE;
+		if(descriptor){
+			write_file(descriptor, 1, descriptor_length, file);
+DARX_TRACE("#    cdata :  " << ((void*)cdata));
+			write_file(cdata, cdata_length, 1, file);
+			free(descriptor);
+		}
+		if(cdata_is_temp){
+DARX_TRACE("#    deleting temp cdata...  " << cdata);
+			delete[] cdata;
 		}
-		return false;
+		return result;
 	}
-		
+	
+	/** Reads len bytes at the given file offset, returns false on a short read. */
+	bool pread_all(int fd, void* buffer, size_t len, off_t offset){
+		uint8_t* out = (uint8_t*)buffer;
+		while(len > 0){
+			ssize_t count = pread(fd, out, len, offset);
+			count_stat(&io_stats::read_calls, 1);
+			if(count <= 0){
+				if(count < 0 && errno == EINTR){ continue; }
+				return false;
+			}
+			count_stat(&io_stats::bytes_read, count);
+			out += count;
+			len -= count;
+			offset += count;
+		}
+		return true;
+	}
+	
+	/** Writes len bytes at the given file offset, returns false on a short write. */
+	bool pwrite_all(int fd, const void* buffer, size_t len, off_t offset){
+		const uint8_t* in = (const uint8_t*)buffer;
+		while(len > 0){
+			ssize_t count = pwrite(fd, in, len, offset);
+			count_stat(&io_stats::write_calls, 1);
+			if(count <= 0){
+				if(count < 0 && errno == EINTR){ continue; }
+				return false;
+			}
+			count_stat(&io_stats::bytes_written, count);
+			in += count;
+			len -= count;
+			offset += count;
+		}
+		return true;
+	}
+	
+	/** Reads len bytes at the given file offset, returns false on a short read.
+	 *  Positional reads leave the file position alone, and may run concurrently.
+	 */
+	static bool read_file_data(FILE* file, uint8_t* buffer, size_t len, long int pos){
+		int fd = fileno(file);
+		return fd >= 0 ?
+			pread_all(fd, buffer, len, pos) :
+			!seek_file(file, pos, SEEK_SET) && read_file(buffer, 1, len, file) == len;
+	}
+	
+	uint8_t* read_stored_data(darx& darx, datatensor& tensor, size_t offset, size_t len, bool* is_temp){
+		if(tensor.data_offset < 0){
+			return 0;
+		}
+		if(darx.mapping){
+			// point straight into the file mapping, no copy.
+			if((size_t)tensor.data_offset + offset + len > darx.mapping_size){
+				return 0;
+			}
+			(*is_temp) = false;
+			return ((uint8_t*)darx.mapping) + tensor.data_offset + offset;
+		}
+		FILE* file = darx.file;
+		if(!file){
+			return 0;
+		}
+		uint8_t* buffer = new uint8_t[len];
+		if(!read_file_data(file, buffer, len, tensor.data_offset + offset)){
+			delete[] buffer;
+			return 0;
+		}
+		(*is_temp) = true;
+		return buffer;
+	}
+	
+	/** Allocates a buffer for a tensor's stored data, read from the file.
+	 *  Data stored raw is read straight into the archive's arena, other data into a temporary buffer.
+	 */
+	static uint8_t* new_stored_data(darx& darx, datatensor& tensor){
+		return is_stored_raw(tensor) ? arena_new<uint8_t>(darx, tensor.data_size) : new uint8_t[tensor.data_size];
+	}
+	
 	/**
-	 * Indicates whether a given open file contains .darx data.
-	 * 
-	 * @return true if the data pointed by the file pointer is a .darx file,
-	 * 	false otherwise.
+	 * Decodes a tensor's stored data, if needed, into the tensor's data, allocated in the arena.
+	 * The stored data either lies in the file mapping, or comes from new_stored_data().
+	 */
+	static int decode_stored_data(datatensor& tensor, darx& darx, uint8_t* cdata, bool cdata_is_mapped){
+		bool cdata_is_temp=false;
+		size_t cdata_length = tensor.data_size;
+		bool raw = is_stored_raw(tensor);
+DARX_TRACE("#    cdata :  " << ((void*)cdata) << (cdata_is_mapped ? " (mapped)" : ""));
+		bool swap = needs_swap(darx);
+		size_t data_size = element_size(tensor.type);
+		for(int dim_idx=0; dim_idx < tensor.rank; dim_idx++){
+			data_size *= tensor.lengths[dim_idx];
+		}
+		uint8_t* data = raw ? 0 : arena_new<uint8_t>(darx, data_size);
+		uint64_t start = stats_clock();
+		bool decoded = decode_tensor_data(tensor, &cdata, &cdata_length, &cdata_is_temp, swap, data, data_size);
+		count_stat(&io_stats::decompress_time, stats_clock() - start);
+		if(!raw && !cdata_is_mapped){
+DARX_TRACE("#    deleting temp cdata...  " << cdata);
+			delete[] cdata;
+		}
+		if(!decoded){
+			tensor.data = 0;
+			return UNSUPPORTED_COMPRESS_TYPE;
+		}
+		if(swap){
+			// mapped data is swapped in place, the mapping being private.
+DARX_TRACE("#    swapping endianness...  ");
+			start = stats_clock();
+			bool swapped = swap_tensor_data(tensor, tensor.data, tensor.data_size);
+			count_stat(&io_stats::swap_time, stats_clock() - start);
+			if(!swapped){
+				// custom values can not be swapped: they would be loaded in the wrong byte order.
+				tensor.data = 0;
+				return UNSUPPORTED_ELEMENT_TYPE;
+			}
+		}
+		// the data is owned by the archive, unless it still lies in the file mapping.
+		tensor.owns_data = !(raw && cdata_is_mapped);
+		return SUCCESS;
+	}
+	
+	/**
+	 * Reads a tensor's stored data, and decodes it if needed.
+	 * The tensor's descriptor must have been read with read_tensor().
+	 */
+	int read_tensor_data(datatensor& tensor, darx& darx){
+		if(darx.mapping){
+			bool cdata_is_buffer;
+			uint8_t* cdata = read_stored_data(darx, tensor, 0, tensor.data_size, &cdata_is_buffer);
+			if(!cdata){
+				return INVALID_STRUCT;
+			}
+			return decode_stored_data(tensor, darx, cdata, true);
+		}
+		if(!darx.file || tensor.data_offset < 0){
+			return INVALID_STRUCT;
+		}
+		uint8_t* cdata = new_stored_data(darx, tensor);
+		if(!read_file_data(darx.file, cdata, tensor.data_size, tensor.data_offset)){
+			if(!is_stored_raw(tensor)){
+				delete[] cdata;
+			}
+			return INVALID_STRUCT;
+		}
+		return decode_stored_data(tensor, darx, cdata, false);
+	}
+	
+	/**
+	 * Reads a tensor's descriptor from the reader, and its data unless the
+	 * loading is deferred.
 	 */
-	bool read_tensor(datatensor& tensor, darx& darx, FILE* file, data_type_info& dtinfo){
-if(VERBOSE){ std::cout << "# file pos:  " << ftell(file) << std::endl; }
-		uint8_t namelen=0;
-		fread(&namelen, sizeof(uint8_t), 1, file);
+	int read_tensor(datatensor& tensor, darx& darx, descriptor_reader& reader, data_type_info& dtinfo, bool defer_data){
+DARX_TRACE("# file pos:  " << reader.pos);
+		uint64_t start = stats_clock();
+		tensor.descriptor_offset = reader.pos;
+		uint8_t namelen = read_uint8(reader);
 		if(namelen > 0){
-			char* tensor_name = new char[namelen+1];
+			char* tensor_name = arena_new<char>(darx, namelen+1);
 			tensor.name=tensor_name;
-			fread(tensor_name, sizeof(uint8_t), namelen, file);
+			tensor_name[0]=0;
+			reader_read(reader, tensor_name, namelen);
 			tensor_name[namelen]=0;
-if(VERBOSE){ std::cout << "#    name : " << tensor.name << std::endl; }
+DARX_TRACE("#    name : " << tensor.name);
 		} else {
-if(VERBOSE){ std::cout << "#    (unnamed)" << std::endl; }
+DARX_TRACE("#    (unnamed)");
 		}
 		// write the tensor's rank
-		fread(&(tensor.rank), sizeof(uint8_t), 1, file);
-if(VERBOSE){ std::cout << "#    rank : " << ((int)tensor.rank) << std::endl; }
+		tensor.rank = read_uint8(reader);
+DARX_TRACE("#    rank : " << ((int)tensor.rank));
 		// write the length of each dimmension
-		tensor.lengths = new unsigned int[tensor.rank];
-if(VERBOSE){ std::cout << "#    lengths : "; }
+		tensor.lengths = arena_new<unsigned int>(darx, tensor.rank);
 		for(int dim_idx=0; dim_idx < tensor.rank; dim_idx++){
-			tensor.lengths[dim_idx]=0;
-			fread(&(tensor.lengths[dim_idx]), dtinfo.int_size, 1, file);
-			if(VERBOSE){ std::cout << tensor.lengths[dim_idx] << "   "; }
+			uint64_t length = read_uint(reader, dtinfo.int_size, dtinfo.swapEndian);
+			tensor.lengths[dim_idx] = length;
+			if(length != tensor.lengths[dim_idx]){
+				return INVALID_STRUCT;
+			}
 		}
-if(VERBOSE){ std::cout << std::endl; }
+DARX_TRACE_LIST("#    lengths : ", tensor.lengths, tensor.rank);
 		// write the element type stuct
-		tensor.type = read_tensor_type(darx, file, dtinfo);
+		tensor.type = read_tensor_type(reader);
 		if(!tensor.type){
-			return UNSUPPORTED_ELEMENT_TYPE;
+			return reader.failed ? INVALID_STRUCT : UNSUPPORTED_ELEMENT_TYPE;
 		}
-		// write the data (possibly compressed)
-		{
-			uint8_t ctype;
-			fread(&ctype, sizeof(uint8_t), 1, file);
-			tensor.compression = (CompressionType)ctype;
-if(VERBOSE){ std::cout << "#    compression :  " << ((int)ctype) << std::endl; }
-			bool cdata_is_temp=false;
-			unsigned int cdata_length;
-			fread(&cdata_length, sizeof(unsigned int), 1, file);
-if(VERBOSE){ std::cout << "#    cdata size:  " << cdata_length << std::endl; }
-			uint8_t* cdata = new uint8_t[cdata_length];
-			fread(cdata, cdata_length, 1, file);
-if(VERBOSE){ std::cout << "#    cdata :  " << ((void*)cdata) << std::endl; }
-			if(!decompress_data(tensor, &cdata, &cdata_length, &cdata_is_temp)){
-				return UNSUPPORTED_COMPRESS_TYPE;
-			}
-			if(cdata_is_temp){
-if(VERBOSE){ std::cout << "#    deleting temp cdata...  " << cdata << std::endl; }
-				delete[] cdata;
+		// read the stored data's descriptor
+		uint8_t ctype = read_uint8(reader);
+		tensor.compression = (CompressionType)(ctype & ~DARX_EXTENDED_DESCRIPTOR);
+DARX_TRACE("#    compression :  " << ((int)tensor.compression));
+		tensor.tile_lengths = 0;
+		tensor.columnar = false;
+		tensor.bit_packed = false;
+		tensor.filters = FILTER_NONE;
+		if(ctype & DARX_EXTENDED_DESCRIPTOR){
+			uint8_t layout = read_uint8(reader);
+DARX_TRACE("#    layout :  " << ((int)layout));
+			if((layout & ~(LAYOUT_TILED | LAYOUT_COLUMNAR | LAYOUT_BITPACKED | LAYOUT_FILTERED)) ||
+				((layout & LAYOUT_TILED) && (layout & (LAYOUT_COLUMNAR | LAYOUT_BITPACKED))) ||
+				((layout & LAYOUT_COLUMNAR) && tensor.type->type != TYPE_MIXED) ||
+				((layout & LAYOUT_BITPACKED) && !can_bit_pack(tensor.type))
+			){
+				return INVALID_STRUCT;
+			}
+			tensor.columnar = (layout & LAYOUT_COLUMNAR) != 0;
+			tensor.bit_packed = (layout & LAYOUT_BITPACKED) != 0;
+			if(layout & LAYOUT_TILED){
+				tensor.tile_lengths = arena_new<unsigned int>(darx, tensor.rank);
+				for(int dim_idx=0; dim_idx < tensor.rank; dim_idx++){
+					uint64_t tile_length = read_uint(reader, dtinfo.int_size, dtinfo.swapEndian);
+					tensor.tile_lengths[dim_idx] = tile_length;
+					if(!tile_length || tile_length != tensor.tile_lengths[dim_idx]){
+						return INVALID_STRUCT;
+					}
+				}
+			}
+			if(layout & LAYOUT_FILTERED){
+				tensor.filters = read_uint8(reader);
+DARX_TRACE("#    filters :  " << ((int)tensor.filters));
+				if(!tensor.filters || !can_filter(tensor)){
+					return INVALID_STRUCT;
+				}
 			}
 		}
-		return SUCCESS;
+		uint64_t data_size = read_uint(reader, dtinfo.int_size, dtinfo.swapEndian);
+		tensor.data_size = data_size;
+DARX_TRACE("#    cdata size:  " << tensor.data_size);
+		if(reader.failed || data_size != tensor.data_size){
+			return INVALID_STRUCT;
+		}
+		// the stored data starts at the next aligned offset.
+		reader.pos = align_payload(dtinfo, reader.pos);
+		tensor.data_offset = reader.pos;
+		tensor.data = 0;
+		tensor.owns_data = false;
+		count_stat(&io_stats::header_time, stats_clock() - start);
+		if(defer_data){
+DARX_TRACE("#    (data deferred)");
+			return SUCCESS;
+		}
+		// read the data (possibly compressed)
+		if(!darx.mapping && tensor.data_size <= DESCRIPTOR_WINDOW_SIZE){
+			// small data comes along with the descriptors, through the reader's window.
+			uint8_t* cdata = new_stored_data(darx, tensor);
+			if(!reader_read(reader, cdata, tensor.data_size)){
+				if(!is_stored_raw(tensor)){
+					delete[] cdata;
+				}
+				return INVALID_STRUCT;
+			}
+			return decode_stored_data(tensor, darx, cdata, false);
+		}
+		return read_tensor_data(tensor, darx);
 	}
 	
 	bool is_darx(FILE* file){
 		char magic[DARX_MAGIC_LEN];
-		fread(magic, sizeof(char), DARX_MAGIC_LEN, file); // read magic number
-		fseek(file, 0, SEEK_SET); // reset the file read position
+		read_file(magic, sizeof(char), DARX_MAGIC_LEN, file); // read magic number
+		seek_file(file, 0, SEEK_SET); // reset the file read position
 		return !strncmp(magic, DARX_MAGIC, DARX_MAGIC_LEN);
 	}
 	
@@ -263,119 +791,604 @@ if(VERBOSE){ std::cout << "#    deleting temp cdata...  " << cdata << std::endl;
 	 * @note reads only uncompressed 8,16 and 32 bit-per-pixel bmp images.
 	 */
 	ErrorCode load_image_from(darx& darx, FILE* file){
+		return load_image_from(darx, file, LOAD_DEFAULT);
+	}
+	
+	/** Maps the whole of the given file in memory, privately.
+	 * 
+	 * @returns true if the file could be mapped.
+	 */
+	bool map_file(darx& darx, FILE* file){
+		struct stat file_stat;
+		int fd = fileno(file);
+		if(fd < 0 || fstat(fd, &file_stat) || file_stat.st_size <= 0){
+			return false;
+		}
+		void* mapping = mmap(0, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if(mapping == MAP_FAILED){
+			return false;
+		}
+		darx.mapping = mapping;
+		darx.mapping_size = file_stat.st_size;
+DARX_TRACE("# file mapped @ " << mapping << " (size : " << darx.mapping_size << ")");
+		return true;
+	}
+	
+	typedef struct {
+		darx* archive;
+		int* results;
+	} load_tensor_job;
+	
+	static void load_tensor_data_job(void* ctx, unsigned int tensor_idx){
+		load_tensor_job& job = *(load_tensor_job*)ctx;
+		stats_scope scope(&job.archive->stats);
+		job.results[tensor_idx] = read_tensor_data(job.archive->tensors[tensor_idx], *job.archive);
+	}
+	
+	/** Orders tensor indices by their position in the file. */
+	typedef struct {
+		const long int* positions;
+		bool operator()(int a, int b) const { return positions[a] < positions[b]; }
+	} file_position_order;
+	
+	ErrorCode load_image_from(darx& darx, FILE* file, int flags){
+		return load_image_from(darx, file, flags, 0);
+	}
+	
+	ErrorCode load_image_from(darx& darx, FILE* file, int flags, darx_arena* arena){
 		data_type_info dtinfo;
+		memset(&darx.stats, 0, sizeof(io_stats));
+		stats_scope scope(&darx.stats);
+		uint64_t start = stats_clock();
+		darx.mapping = 0;
+		darx.mapping_size = 0;
+		darx.file = file;
+		darx.metadata = 0;
+		darx.tensors = 0;
+		darx.number_of_tensors = 0;
+		darx.arena = arena;
+		darx.owns_arena = false;
+		if(!arena){
+			// the archive's own arena, sized after the file if its data gets read into it.
+			struct stat file_stat;
+			int fd = fileno(file);
+			bool read_data = !(flags & (LOAD_MMAP | LOAD_LAZY)) && fd >= 0 && !fstat(fd, &file_stat);
+			darx.arena = create_arena(read_data ? file_stat.st_size : 0);
+			darx.owns_arena = true;
+		}
+		if(flags & LOAD_MMAP){
+			if(!map_file(darx, file)){
+				release_image(darx);
+				return INVALID_STRUCT;
+			}
+		}
+		// the header and descriptors are read through a single buffer, and decoded from memory.
+		long int start_pos = ftell(file);
+		descriptor_reader reader;
+		init_reader(reader, darx, file, start_pos > 0 ? start_pos : 0);
 		char magic[DARX_MAGIC_LEN+1];
-		fread(magic, sizeof(char), DARX_MAGIC_LEN, file);
-		magic[DARX_MAGIC_LEN] = 0;
-if(VERBOSE){ std::cout << "# read magic number : '" << magic << "' == " << DARX_MAGIC << std::endl; }
-if(VERBOSE){ std::cout << "#     " << magic[0] << magic[1] << magic[2] << magic[3] << std::endl; }
-		if(strncmp(magic, DARX_MAGIC, DARX_MAGIC_LEN)){
+		memset(magic, 0, sizeof(magic));
+		reader_read(reader, magic, DARX_MAGIC_LEN);
+DARX_TRACE("# read magic number : '" << magic << "' == " << DARX_MAGIC);
+DARX_TRACE("#     " << magic[0] << magic[1] << magic[2] << magic[3]);
+		char magic2[4];
+		if(strncmp(magic, DARX_MAGIC, DARX_MAGIC_LEN) || !reader_read(reader, magic2, 4)){
+			release_reader(reader);
+			release_image(darx);
 			return INVALID_STRUCT;
 		}
-		char magic2[4];
-		fread(&magic2, sizeof(char), 4, file);
 		bool storedAsBE = ( magic2[3] ==  ((uint8_t)( DARX_MAGIC_BE&0xff)));
 		darx.isBigEndian = storedAsBE;
-if(VERBOSE){ std::cout << "# file endianness ["<<magic2[3]<<" == " << ((uint8_t)(DARX_MAGIC_BE&0xff)) << "]: " << (storedAsBE ? "big" : "little") << std::endl; }
-		int endianness_i = 0x00010203;
-		bool systemIsBE = ( ((char*)&endianness_i)[0] ==  0x00);
-if(VERBOSE){ std::cout << "# system endianness : " << (systemIsBE ? "big" : "little") << std::endl; }
+DARX_TRACE("# file endianness ["<<magic2[3]<<" == " << ((uint8_t)(DARX_MAGIC_BE&0xff)) << "]: " << (storedAsBE ? "big" : "little"));
+		bool systemIsBE = system_is_big_endian();
+DARX_TRACE("# system endianness : " << (systemIsBE ? "big" : "little"));
 		
-		dtinfo.swapEndian = (systemIsBE == storedAsBE);
+		dtinfo.swapEndian = (systemIsBE != storedAsBE);
 		if(dtinfo.swapEndian){
-if(VERBOSE){ std::cout << "# need to swap endianness.." << std::endl; }
+DARX_TRACE("# need to swap endianness..");
+		}
+		dtinfo.int_size = read_uint8(reader);
+		dtinfo.long_size = read_uint8(reader);
+		dtinfo.count_size = sizeof(uint16_t);
+		dtinfo.version = 1;
+		dtinfo.payload_alignment = 1;
+		if(dtinfo.int_size == DARX_VERSIONED_HEADER){
+			// versioned header: the version, the payload alignment's log2, and a reserved byte.
+			dtinfo.version = dtinfo.long_size;
+			uint8_t alignment_log2 = read_uint8(reader);
+			read_uint8(reader);
+			if(reader.failed || dtinfo.version < 2 || !native_format(dtinfo, dtinfo.version, alignment_log2 < 32 ? 1u << alignment_log2 : 0)){
+DARX_TRACE("# unsupported format version : " << ((int)dtinfo.version));
+				release_reader(reader);
+				release_image(darx);
+				return INVALID_STRUCT;
+			}
+			dtinfo.swapEndian = (systemIsBE != storedAsBE);
 		}
-		fread(&dtinfo.int_size, sizeof(uint8_t), 1, file);
-		fread(&dtinfo.long_size, sizeof(uint8_t), 1, file);
+		darx.format_version = dtinfo.version;
+		darx.payload_alignment = dtinfo.payload_alignment;
 		
-if(VERBOSE){ std::cout << "# data sizes [int:" << ((int)dtinfo.int_size) << ", long:" << ((long)dtinfo.long_size) << "]" << std::endl; }
-		fread(&darx.number_of_tensors, sizeof(uint16_t), 1, file);
-if(VERBOSE){ std::cout << "# tensors : " << darx.number_of_tensors << std::endl; }
+DARX_TRACE("# format version " << ((int)dtinfo.version) << ", payload alignment : " << dtinfo.payload_alignment);
+DARX_TRACE("# data sizes [int:" << ((int)dtinfo.int_size) << ", long:" << ((long)dtinfo.long_size) << "]");
+		uint64_t number_of_tensors = read_uint(reader, dtinfo.count_size, dtinfo.swapEndian);
+		long int metadata_pos = -1;
+		if(number_of_tensors == streamed_index(dtinfo) && !reader.failed){
+			// streamed archives store the index in a footer, located by the trailer at the end of the file.
+			metadata_pos = reader.pos;
+			long int file_size = darx.mapping ? (long int)darx.mapping_size : (seek_file(file, 0, SEEK_END) ? -1 : ftell(file));
+			reader.pos = file_size - (long int)(dtinfo.long_size + DARX_MAGIC_LEN);
+			long int index_pos = read_uint(reader, dtinfo.long_size, dtinfo.swapEndian);
+			const uint8_t* trailer_magic = reader_bytes(reader, DARX_MAGIC_LEN);
+			if(!trailer_magic || strncmp((const char*)trailer_magic, DARX_TRAILER_MAGIC, DARX_MAGIC_LEN)){
+				release_reader(reader);
+				release_image(darx);
+				return INVALID_STRUCT;
+			}
+DARX_TRACE("# streamed archive, index @ file pos : " << index_pos);
+			reader.pos = index_pos;
+			number_of_tensors = read_uint(reader, dtinfo.count_size, dtinfo.swapEndian);
+		}
+		// the index must fit in the file, before the tensors are allocated.
+		struct stat file_stat;
+		size_t file_size = darx.mapping ? darx.mapping_size : fileno(file) >= 0 && !fstat(fileno(file), &file_stat) ? file_stat.st_size : 0;
+		darx.number_of_tensors = number_of_tensors;
+		if(reader.failed || number_of_tensors != darx.number_of_tensors || number_of_tensors >= streamed_index(dtinfo) ||
+			(file_size && number_of_tensors > file_size / dtinfo.long_size)
+		){
+			darx.number_of_tensors = 0;
+			release_reader(reader);
+			release_image(darx);
+			return INVALID_STRUCT;
+		}
+DARX_TRACE("# tensors : " << darx.number_of_tensors);
 		long int *tensor_indices  = new long int[darx.number_of_tensors];
 		assert(sizeof(long int) >= dtinfo.long_size);
-if(VERBOSE){ std::cout << "#  tensor file locations : ["; }
-		for(int i=0; i < darx.number_of_tensors; i++){
-			fread(&(tensor_indices[i]), dtinfo.long_size, 1, file);
-if(VERBOSE){ std::cout << tensor_indices[i] << "   "; }
-		}
-if(VERBOSE){ std::cout << "]" << std::endl; }
-		fread(&darx.metadata_size, sizeof(uint16_t), 1, file);
-		if(darx.metadata_size > 0){
-if(VERBOSE){ std::cout << "# metadata size:" << darx.metadata_size << std::endl; }
-			darx.metadata = new char[darx.metadata_size];
-			fread(&darx.metadata, 1, darx.metadata_size, file);
+		for(uint32_t i=0; i < darx.number_of_tensors; i++){
+			tensor_indices[i] = read_uint(reader, dtinfo.long_size, dtinfo.swapEndian);
+		}
+DARX_TRACE_LIST("#  tensor file locations : ", tensor_indices, darx.number_of_tensors);
+		if(metadata_pos >= 0){
+			reader.pos = metadata_pos;
+		}
+		uint64_t metadata_size = read_uint(reader, dtinfo.count_size, dtinfo.swapEndian);
+		darx.metadata_size = metadata_size;
+		if(metadata_size != darx.metadata_size){
+			reader.failed = true;
+		} else if(darx.metadata_size > 0){
+DARX_TRACE("# metadata size:" << darx.metadata_size);
+			darx.metadata = arena_new<char>(darx, darx.metadata_size);
+			reader_read(reader, darx.metadata, darx.metadata_size);
 		} else {
-if(VERBOSE){ std::cout << "# no metadata (size:0)." << std::endl; }
+DARX_TRACE("# no metadata (size:0).");
 			darx.metadata = 0;
 		}
-if(VERBOSE){ std::cout << "# readin tensors ("<< darx.number_of_tensors <<")." << std::endl; }
-		darx.tensors = new datatensor[darx.number_of_tensors];
-		for(int tensor_idx=0; tensor_idx < darx.number_of_tensors; tensor_idx++){
-			fseek(file, tensor_indices[tensor_idx], SEEK_SET);
-			read_tensor(darx.tensors[tensor_idx], darx, file, dtinfo);
+		if(reader.failed){
+			delete[] tensor_indices;
+			release_reader(reader);
+			release_image(darx);
+			return INVALID_STRUCT;
 		}
-		
-if(VERBOSE){ std::cout << "# darx file read successfully." << std::endl; }
+		count_stat(&io_stats::header_time, stats_clock() - start);
+DARX_TRACE("# readin tensors ("<< darx.number_of_tensors <<").");
+		darx.tensors = arena_new<datatensor>(darx, darx.number_of_tensors);
+		memset(darx.tensors, 0, darx.number_of_tensors * sizeof(datatensor));
+		// parallel loads read the descriptors first, and the tensors' data afterwards.
+		bool parallel = (flags & LOAD_PARALLEL) && (darx.mapping || fileno(file) >= 0);
+		bool defer_data = (flags & LOAD_LAZY) || parallel;
+		// descriptors are visited in file order, so that neighbouring ones share a read.
+		int* tensor_order = new int[darx.number_of_tensors];
+		for(uint32_t tensor_idx=0; tensor_idx < darx.number_of_tensors; tensor_idx++){
+			tensor_order[tensor_idx] = tensor_idx;
+		}
+		file_position_order order = { tensor_indices };
+		std::sort(tensor_order, tensor_order + darx.number_of_tensors, order);
+		for(uint32_t i=0; i < darx.number_of_tensors; i++){
+			int tensor_idx = tensor_order[i];
+			reader.pos = tensor_indices[tensor_idx];
+			int read_result = read_tensor(darx.tensors[tensor_idx], darx, reader, dtinfo, defer_data);
+			if(read_result != SUCCESS){
+				delete[] tensor_order;
+				delete[] tensor_indices;
+				release_reader(reader);
+				release_image(darx);
+				return (ErrorCode)read_result;
+			}
+		}
+DARX_TRACE("# descriptors read with " << reader.reads << " file reads.");
+		release_reader(reader);
+		delete[] tensor_order;
 		delete[] tensor_indices;
+		if(parallel && !(flags & LOAD_LAZY)){
+DARX_TRACE("# reading tensors' data in parallel.");
+			load_tensor_job job;
+			job.archive = &darx;
+			job.results = new int[darx.number_of_tensors];
+			run_parallel(darx.number_of_tensors, load_tensor_data_job, &job);
+			int read_result = SUCCESS;
+			for(uint32_t tensor_idx=0; tensor_idx < darx.number_of_tensors && read_result == SUCCESS; tensor_idx++){
+				read_result = job.results[tensor_idx];
+			}
+			delete[] job.results;
+			if(read_result != SUCCESS){
+				release_image(darx);
+				return (ErrorCode)read_result;
+			}
+		}
+		
+DARX_TRACE("# darx file read successfully.");
+		// the file is only kept for loading deferred tensors.
+		if(!(flags & LOAD_LAZY)){
+			darx.file = 0;
+		}
+		darx.valid = true;
 		return SUCCESS;
 	}
 	
+	int find_tensor(darx& darx, const char* name){
+		if(!name){
+			return -1;
+		}
+		for(uint32_t tensor_idx=0; tensor_idx < darx.number_of_tensors; tensor_idx++){
+			const char* tensor_name = darx.tensors[tensor_idx].name;
+			if(tensor_name && !strcmp(tensor_name, name)){
+				return tensor_idx;
+			}
+		}
+		return -1;
+	}
+	
+	ErrorCode load_tensor(darx& darx, int tensor_idx){
+		if(!darx.valid || tensor_idx < 0 || (uint32_t)tensor_idx >= darx.number_of_tensors){
+			return INVALID_STRUCT;
+		}
+		datatensor& tensor = darx.tensors[tensor_idx];
+		if(tensor.data){
+			return SUCCESS;
+		}
+DARX_TRACE("# loading tensor["<<tensor_idx<<"] data @ file pos : " << tensor.data_offset);
+		stats_scope scope(&darx.stats);
+		return (ErrorCode)read_tensor_data(tensor, darx);
+	}
+	
+	datatensor* get_tensor(darx& darx, const char* name){
+		int tensor_idx = find_tensor(darx, name);
+		if(tensor_idx < 0 || load_tensor(darx, tensor_idx) != SUCCESS){
+			return 0;
+		}
+		return &darx.tensors[tensor_idx];
+	}
+	
+	/** Size of an element of the type, as held in memory. */
+	unsigned int element_size(ElementTypeStruct* type){
+		if(!type){
+			return 0;
+		}
+		if(type->layout){
+			return type->layout->size;
+		}
+		if(type->type == TYPE_MIXED){
+			MixedElementTypeStruct* mixedtype = (MixedElementTypeStruct*)type;
+			unsigned int size = 0;
+			for(int comp_idx=0; comp_idx < mixedtype->components; comp_idx++){
+				size += element_size(mixedtype->subtypes[comp_idx]);
+			}
+			return size;
+		}
+		if(type->type == TYPE_INT || type->type == TYPE_UINT){
+			// held in native integers, in memory, whatever their bit width.
+			return type->components * value_size(type->bit_width);
+		}
+		return (type->components * type->bit_width + 7) / 8;
+	}
+	
+	/** Deletes an element type struct read by read_tensor_type(), along with its subtypes.
+	 */
+	void delete_tensor_type(ElementTypeStruct* tensor_type){
+		if(!tensor_type || tensor_type == &UNKNOWN_TYPE || tensor_type->layout){
+			// interned types are shared.
+			return;
+		}
+		switch(tensor_type->type){
+			case TYPE_MIXED:{
+				MixedElementTypeStruct* mixedtype = (MixedElementTypeStruct*)tensor_type;
+				for(int comp_idx=0; comp_idx < mixedtype->components; comp_idx++){
+					delete_tensor_type(mixedtype->subtypes[comp_idx]);
+				}
+				delete mixedtype;
+			} break;
+			case TYPE_CUSTOM:{
+				CustomElementTypeStruct* customtype = (CustomElementTypeStruct*)tensor_type;
+				delete[] customtype->type_name;
+				delete customtype;
+			} break;
+			default:
+				delete tensor_type;
+		}
+	}
+	
+	void release_image(darx& darx){
+		if(darx.arena){
+			// everything was allocated from the arena.
+			darx.tensors = 0;
+			darx.metadata = 0;
+			if(darx.owns_arena){
+				destroy_arena(darx.arena);
+			} else {
+				reset_arena(darx.arena);
+			}
+			darx.arena = 0;
+			darx.owns_arena = false;
+		}
+		if(darx.tensors){
+			for(uint32_t tensor_idx=0; tensor_idx < darx.number_of_tensors; tensor_idx++){
+				datatensor& tensor = darx.tensors[tensor_idx];
+				delete[] tensor.name;
+				delete[] tensor.lengths;
+				delete[] tensor.tile_lengths;
+				delete_tensor_type(tensor.type);
+				if(tensor.owns_data){
+					delete[] (uint8_t*)tensor.data;
+				}
+			}
+			delete[] darx.tensors;
+			darx.tensors = 0;
+		}
+		delete[] darx.metadata;
+		darx.metadata = 0;
+		if(darx.mapping){
+			detach_shared_image(darx.mapping);
+DARX_TRACE("# unmapping file @ " << darx.mapping);
+			munmap(darx.mapping, darx.mapping_size);
+			darx.mapping = 0;
+			darx.mapping_size = 0;
+		}
+		darx.number_of_tensors = 0;
+		darx.file = 0;
+		darx.valid = false;
+	}
+	
+	bool advise_tensor(darx& darx, int tensor_idx, AccessAdvice advice){
+		if(!darx.mapping || tensor_idx < 0 || (uint32_t)tensor_idx >= darx.number_of_tensors){
+			return false;
+		}
+		datatensor& tensor = darx.tensors[tensor_idx];
+		// also works for deferred tensors, whose data is not loaded yet.
+		uint8_t* map_begin = (uint8_t*)darx.mapping;
+		if(tensor.owns_data || tensor.data_offset < 0 || (size_t)tensor.data_offset + tensor.data_size > darx.mapping_size){
+			return false;
+		}
+		int madv;
+		switch(advice){
+			case ADVICE_NORMAL:     madv = MADV_NORMAL;     break;
+			case ADVICE_SEQUENTIAL: madv = MADV_SEQUENTIAL; break;
+			case ADVICE_RANDOM:     madv = MADV_RANDOM;     break;
+			case ADVICE_WILLNEED:   madv = MADV_WILLNEED;   break;
+			case ADVICE_DONTNEED:   madv = MADV_DONTNEED;   break;
+			default: return false;
+		}
+		// madvise needs a page aligned address.
+		size_t page_size = sysconf(_SC_PAGESIZE);
+		size_t begin = tensor.data_offset - (tensor.data_offset % page_size);
+		size_t end = tensor.data_offset + tensor.data_size;
+		if(advice == ADVICE_DONTNEED){
+			// dropped pages of the private mapping lose their changes: tensors swapped in place
+			// are refused, and only the pages lying entirely within the tensor are dropped.
+			if(tensor.data && needs_swap(darx)){
+				return false;
+			}
+			begin = (tensor.data_offset + page_size - 1) / page_size * page_size;
+			end -= end % page_size;
+			if(end <= begin){
+				return true;
+			}
+		}
+DARX_TRACE("# advising tensor["<<tensor_idx<<"] : " << ((int)advice));
+		return !madvise(map_begin + begin, end - begin, madv);
+	}
+	
+	
+	/** Writes the archive's header, up to the tensors index.
+	 * 
+	 * @returns the file offset of the tensors index, or -1 if the header could not be written.
+	 */
+	long int write_header(darx& darx, FILE* file, const data_type_info& format, bool streamed){
+		// store magic number
+		const char* magic = DARX_MAGIC;
+DARX_TRACE("# image magic number : " << magic);
+		write_file(magic, sizeof(char), DARX_MAGIC_LEN, file);
+		// store an endianness test in the file: 
+		uint32_t int_magic2 = DARX_MAGIC_BE; // "LIVE" in hex
+DARX_TRACE("# image magic number, endianed : " << int_magic2);
+		write_file(&int_magic2, sizeof(uint32_t), 1, file);
+		if(format.version < 2){
+			// write the size of an integer (in an 8-bit int)
+			uint8_t int_size = format.int_size;
+DARX_TRACE("# int size : " << int_size);
+			write_file(&int_size, sizeof(uint8_t), 1, file);
+			// write the size of a long int (in a 8-bit int)
+			uint8_t long_size = format.long_size;
+DARX_TRACE("# long size : " << long_size);
+			write_file(&long_size, sizeof(uint8_t), 1, file);
+		} else {
+			// versioned header: the version, the payload alignment's log2, and a reserved byte.
+			uint8_t alignment_log2 = __builtin_ctz(format.payload_alignment);
+			uint8_t version[4] = { DARX_VERSIONED_HEADER, format.version, alignment_log2, 0 };
+DARX_TRACE("# format version : " << ((int)format.version) << ", payload alignment : " << format.payload_alignment);
+			write_file(version, sizeof(uint8_t), 4, file);
+		}
+		// count how many tensors we were given, and store the number
+DARX_TRACE("# tensors : " << darx.number_of_tensors);
+		uint64_t number_of_tensors = streamed ? streamed_index(format) : darx.number_of_tensors;
+		if(!streamed && number_of_tensors >= streamed_index(format)){
+			// too many tensors for the format.
+			return -1;
+		}
+		if(!write_uint(file, number_of_tensors, format.count_size) || ferror(file)){
+			return -1;
+		}
+		// record the file offset of the archive's tensor index (streamed archives may be written
+		// to pipes, which have no file position: their header is followed by the metadata).
+		return streamed ? count_offset(format) + format.count_size : ftell(file);
+	}
+	
+	/** Per-tensor state of a parallel save. */
+	typedef struct {
+		darx* archive;
+		int fd;
+		uint8_t** cdata;
+		size_t* cdata_lengths;
+		bool* cdata_is_temp;
+		char** descriptors;
+		size_t* descriptor_lengths;
+		long int* positions;
+		int* results;
+	} save_tensor_job;
+	
+	static void encode_tensor_job(void* ctx, unsigned int tensor_idx){
+		save_tensor_job& job = *(save_tensor_job*)ctx;
+		stats_scope scope(&job.archive->stats);
+		datatensor& tensor = job.archive->tensors[tensor_idx];
+		job.cdata[tensor_idx] = 0;
+		job.cdata_lengths[tensor_idx] = 0;
+		job.cdata_is_temp[tensor_idx] = false;
+		job.descriptors[tensor_idx] = 0;
+		job.descriptor_lengths[tensor_idx] = 0;
+		if(!tensor.data || !valid_tile_lengths(tensor)){
+			job.results[tensor_idx] = INVALID_STRUCT;
+			return;
+		}
+		if(!encode_tensor_data(tensor, &job.cdata[tensor_idx], &job.cdata_lengths[tensor_idx], &job.cdata_is_temp[tensor_idx])){
+			job.results[tensor_idx] = UNSUPPORTED_COMPRESS_TYPE;
+			return;
+		}
+		job.results[tensor_idx] = SUCCESS;
+	}
+	
+	static void write_tensor_job(void* ctx, unsigned int tensor_idx){
+		save_tensor_job& job = *(save_tensor_job*)ctx;
+		stats_scope scope(&job.archive->stats);
+		long int pos = job.positions[tensor_idx];
+		size_t desc_len = job.descriptor_lengths[tensor_idx];
+		if(!pwrite_all(job.fd, job.descriptors[tensor_idx], desc_len, pos) ||
+			!pwrite_all(job.fd, job.cdata[tensor_idx], job.cdata_lengths[tensor_idx], pos + desc_len)
+		){
+			job.results[tensor_idx] = INVALID_STRUCT;
+		}
+	}
+	
+	/** Saves the tensors concurrently, with positional writes at precomputed offsets.
+	 */
+	bool save_tensors_parallel(darx& darx, FILE* file, long int tensors_index_pos, const data_type_info& format){
+		uint32_t number_of_tensors = darx.number_of_tensors;
+		save_tensor_job job;
+		job.archive = &darx;
+		job.fd = fileno(file);
+		job.cdata = new uint8_t*[number_of_tensors];
+		job.cdata_lengths = new size_t[number_of_tensors];
+		job.cdata_is_temp = new bool[number_of_tensors];
+		job.descriptors = new char*[number_of_tensors];
+		job.descriptor_lengths = new size_t[number_of_tensors];
+		job.positions = new long int[number_of_tensors];
+		job.results = new int[number_of_tensors];
+		run_parallel(number_of_tensors, encode_tensor_job, &job);
+		bool success = true;
+		// lay out the tensors one after the other, past the index and metadata.
+		long int tensor_pos = tensors_index_pos + number_of_tensors * format.long_size + format.count_size + darx.metadata_size;
+		for(uint32_t tensor_idx=0; tensor_idx < number_of_tensors; tensor_idx++){
+			success = success && job.results[tensor_idx] == SUCCESS;
+			if(!success){
+				break;
+			}
+			// serialize the descriptor in memory, padded for the data to be aligned, so its size is known before writing it.
+			datatensor& tensor = darx.tensors[tensor_idx];
+			job.descriptors[tensor_idx] = serialize_tensor_descriptor(tensor, job.cdata_lengths[tensor_idx], tensor_pos, format, &job.descriptor_lengths[tensor_idx]);
+			success = job.descriptors[tensor_idx] != 0;
+			job.positions[tensor_idx] = tensor_pos;
+DARX_TRACE("# tensor["<<tensor_idx<<"] @ file pos : " << tensor_pos);
+			tensor_pos += job.descriptor_lengths[tensor_idx] + job.cdata_lengths[tensor_idx];
+		}
+		if(success){
+			success = write_index(file, job.positions, number_of_tensors, format) &&
+				write_uint(file, darx.metadata_size, format.count_size);
+			if(darx.metadata_size > 0){ write_file(darx.metadata, 1, darx.metadata_size, file); }
+			success = success && !fflush(file);
+		}
+		if(success){
+			run_parallel(number_of_tensors, write_tensor_job, &job);
+			for(uint32_t tensor_idx=0; tensor_idx < number_of_tensors; tensor_idx++){
+				success = success && job.results[tensor_idx] == SUCCESS;
+			}
+			// leave the file position at the end of the archive.
+			seek_file(file, tensor_pos, SEEK_SET);
+		}
+		for(uint32_t tensor_idx=0; tensor_idx < number_of_tensors; tensor_idx++){
+			if(job.cdata_is_temp[tensor_idx]){
+				delete[] job.cdata[tensor_idx];
+			}
+			free(job.descriptors[tensor_idx]);
+		}
+		delete[] job.cdata;
+		delete[] job.cdata_lengths;
+		delete[] job.cdata_is_temp;
+		delete[] job.descriptors;
+		delete[] job.descriptor_lengths;
+		delete[] job.positions;
+		delete[] job.results;
+		return success;
+	}
+	
+	bool save_image_to(darx& darx, FILE* file){
+		return save_image_to(darx, file, SAVE_DEFAULT);
+	}
 	
 	/** Saves a darx data archive to a file.
 	 * 
 	 * @param[in] darx - reference to the darx structure to store
 	 * @param[in] file - pointer to the file where to store the darx data
+	 * @param[in] flags - or'ed combination of SaveFlags values
 	 * 
 	 * @returns true if the darx file could be saved
 	 */
-	bool save_image_to(darx& darx, FILE* file){
+	bool save_image_to(darx& darx, FILE* file, int flags){
 		if(!darx.valid){
 			return false;
 		}
-		
-		// store magic number
-		const char* magic = DARX_MAGIC;
-if(VERBOSE){ std::cout << "# image magic number : " << magic << std::endl; }
-		fwrite(magic, sizeof(char), DARX_MAGIC_LEN, file);
-		// store an endianness test in the file: 
-		uint32_t int_magic2 = DARX_MAGIC_BE; // "LIVE" in hex
-if(VERBOSE){ std::cout << "# image magic number, endianed : " << int_magic2 << std::endl; }
-		fwrite(&int_magic2, sizeof(uint32_t), 1, file);
-		// write the size of an integer (in an 8-bit int)
-		uint8_t int_size = sizeof(unsigned int);
-if(VERBOSE){ std::cout << "# int size : " << int_size << std::endl; }
-		fwrite(&int_size, sizeof(uint8_t), 1, file);
-		// write the size of a long int (in a 8-bit int)
-		uint8_t long_size = sizeof(long int);
-if(VERBOSE){ std::cout << "# long size : " << long_size << std::endl; }
-		fwrite(&long_size, sizeof(uint8_t), 1, file);
-		// count how many tensors we were given, and store the number
-if(VERBOSE){ std::cout << "# tensors : " << darx.number_of_tensors << std::endl; }
-		fwrite(&darx.number_of_tensors, sizeof(uint16_t), 1, file);
-		// record the file offset of the archive's tensor index.
-		long int tensors_index_pos = ftell(file);
+		memset(&darx.stats, 0, sizeof(io_stats));
+		stats_scope scope(&darx.stats);
+		data_type_info format;
+		if(!native_format(format, FORMAT_VERSION, PAYLOAD_ALIGNMENT)){
+			return false;
+		}
+		long int tensors_index_pos = write_header(darx, file, format);
+		if(tensors_index_pos < 0){
+			return false;
+		}
+		if((flags & SAVE_PARALLEL) && fileno(file) >= 0){
+DARX_TRACE("# writing tensors in parallel.");
+			return save_tensors_parallel(darx, file, tensors_index_pos, format);
+		}
 		// leave a space in the file for the tensors index
-if(VERBOSE){ std::cout << "# tensors index filepos : " << tensors_index_pos << std::endl; }
-		fseek(file, darx.number_of_tensors * sizeof(long int), SEEK_CUR);
+DARX_TRACE("# tensors index filepos : " << tensors_index_pos);
+		seek_file(file, darx.number_of_tensors * format.long_size, SEEK_CUR);
 		// write out any metadata that may be added to the file
-if(VERBOSE){ std::cout << "# metadata : " << ((void*)darx.metadata) << "(size : " << darx.metadata_size << ")" << std::endl; }
-		fwrite(&darx.metadata_size, sizeof(uint16_t), 1, file);
-		fwrite(darx.metadata, 1, darx.metadata_size, file);
+DARX_TRACE("# metadata : " << ((void*)darx.metadata) << "(size : " << darx.metadata_size << ")");
+		write_uint(file, darx.metadata_size, format.count_size);
+		if(darx.metadata_size > 0){ write_file(darx.metadata, 1, darx.metadata_size, file); }
 		// write the tensors to the file, one by one
-		for(int tensor_idx=0; tensor_idx < darx.number_of_tensors; tensor_idx++){
+		for(uint32_t tensor_idx=0; tensor_idx < darx.number_of_tensors; tensor_idx++){
 			long int tensor_pos = ftell(file);
-if(VERBOSE){ std::cout << "# tensor["<<tensor_idx<<"] @ file pos : " << tensor_pos << std::endl; }
-			fseek(file, tensors_index_pos, SEEK_SET); // get file position of tensor
-			fwrite(&tensor_pos, sizeof(long int), 1, file); // write it in the index
-			tensors_index_pos += sizeof(long int);
-			fseek(file, tensor_pos, SEEK_SET); // seek back to the tensor's file position
+DARX_TRACE("# tensor["<<tensor_idx<<"] @ file pos : " << tensor_pos);
+			seek_file(file, tensors_index_pos, SEEK_SET); // get file position of tensor
+			write_index(file, &tensor_pos, 1, format); // write it in the index
+			tensors_index_pos += format.long_size;
+			seek_file(file, tensor_pos, SEEK_SET); // seek back to the tensor's file position
 			// write the tensor
-			int write_result = write_tensor(darx.tensors[tensor_idx], file);
+			int write_result = write_tensor(darx.tensors[tensor_idx], file, format);
 			if(write_result != SUCCESS){
-				return write_result;
+				return false;
 			}
 		}
-		return SUCCESS;
+		return true;
 	}
 	
 	
@@ -16,6 +16,7 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <stddef.h>
 
 /**
  * Utility Namespace for .darx format I/O functions and structures.
@@ -25,9 +26,38 @@ namespace darx{
 	/** Value indicating the verbosity when reading/writing a darx data archive.
 	 * 0 - no verbosity
 	 * non-zero - diagnostic messages
+	 * The messages are compiled out if the library is configured with --disable-trace.
+	 * Use the I/O counters (see io_stats) for monitoring loads and saves.
 	 */
 	extern int VERBOSE;
 	
+	/** Maximum number of threads used for processing tensors, or the blocks of a tensor, in parallel.
+	 * 0 - one per hardware thread
+	 * 1 - no multi-threading
+	 */
+	extern int THREADS;
+	
+	/** Size, in bytes, of the blocks a tensor's data is split into before compressing it.
+	 * Each block is compressed independently. Defaults to 1 MiB.
+	 */
+	extern unsigned int COMPRESSION_BLOCK_SIZE;
+	
+	/** Version of the format archives are saved with. Archives of either version are loaded.
+	 * 1 - sizes and file offsets are stored as the host's unsigned int and long int: at
+	 *     most 65534 tensors per archive, and tensors of at most 4 GiB (with 32-bit ints).
+	 * 2 - counts, lengths, sizes and file offsets are stored as 64-bit integers, and each
+	 *     tensor's stored data starts at a multiple of PAYLOAD_ALIGNMENT bytes.
+	 * Defaults to 1, which older readers can load.
+	 */
+	extern int FORMAT_VERSION;
+	
+	/** Alignment, in bytes, of the file offset of each tensor's stored data, in archives
+	 * saved with format version 2. Must be a power of 2, e.g. 64 (a cache line, for aligned
+	 * vector loads of mapped data) or 4096 (a page, for O_DIRECT reads and huge page mappings).
+	 * Defaults to 64.
+	 */
+	extern unsigned int PAYLOAD_ALIGNMENT;
+	
 	/** Describes the available types and sizes of pixels in an image.
 	 *  Each type has an associated size and data structure.
 	 */
@@ -49,9 +79,125 @@ namespace darx{
 	 */
 	enum CompressionType {
 		/** No compression is used for the data. */
-		UNCOMPRESSED=0
+		UNCOMPRESSED=0,
+		/** The data is stored in blocks compressed with deflate (zlib).
+		 *  Only available if the library was built with zlib.
+		 */
+		DEFLATE_COMPRESSED=1,
+		/** The data is stored in blocks compressed with LZ4 (fast, lower ratio). */
+		LZ4_COMPRESSED=2
+	};
+	
+	/** Flags modifying how load_image_from() reads a darx data archive.
+	 *  Flags may be or'ed together.
+	 */
+	enum LoadFlags {
+		/** Tensor data is read into buffers allocated by the library. */
+		LOAD_DEFAULT=0,
+		/** The file is memory mapped, and the data of uncompressed tensors points
+		 *  straight into the mapping instead of being copied. Pages are only read
+		 *  from storage once they are touched.
+		 */
+		LOAD_MMAP=1,
+		/** Only the archive's header and tensor descriptors are read. Each tensor's
+		 *  data is loaded once it is requested with load_tensor() or get_tensor().
+		 *  The file must stay open until release_image() is called.
+		 */
+		LOAD_LAZY=2,
+		/** The tensors' data is read and decompressed concurrently, on up to THREADS
+		 *  threads, using positional reads. Has no effect together with LOAD_LAZY.
+		 */
+		LOAD_PARALLEL=4
+	};
+	
+	/** Flags modifying how save_image_to() writes a darx data archive.
+	 *  Flags may be or'ed together.
+	 */
+	enum SaveFlags {
+		/** Tensors are compressed and written one after the other. */
+		SAVE_DEFAULT=0,
+		/** Tensors are compressed concurrently, on up to THREADS threads, and written
+		 *  with positional writes at offsets computed beforehand. The file must be a
+		 *  regular, seekable file, otherwise the tensors are written one by one.
+		 */
+		SAVE_PARALLEL=1
+	};
+	
+	/** Layouts in which a tensor's data can be stored in the file.
+	 */
+	enum TensorLayout {
+		/** The data is stored as one row-major blob. */
+		LAYOUT_CONTIGUOUS=0,
+		/** The data is split in tiles of tile_lengths elements (per dimmension), each
+		 *  stored (and compressed) on its own, row-major, so that a region of the tensor
+		 *  can be read without reading the whole tensor (see read_tensor_region()).
+		 */
+		LAYOUT_TILED=1,
+		/** The data of a mixed type tensor is stored as one column per field (subtype)
+		 *  of its element type, instead of one record per element, so that single fields
+		 *  can be read without reading the others (see read_tensor_field()).
+		 *  Can not be combined with LAYOUT_TILED.
+		 */
+		LAYOUT_COLUMNAR=2,
+		/** The integer values of the tensor are stored densely packed, in bit_width bits
+		 *  each, and widened to native integers when loaded (see datatensor::bit_packed).
+		 *  Can not be combined with LAYOUT_TILED.
+		 */
+		LAYOUT_BITPACKED=4,
+		/** The data is transformed by the tensor's filters before it is compressed,
+		 *  and restored after it is decompressed (see datatensor::filters).
+		 *  Can not be combined with LAYOUT_TILED or LAYOUT_BITPACKED.
+		 */
+		LAYOUT_FILTERED=8
+	};
+	
+	/** Filters transforming a tensor's data before it is compressed, so that the codec
+	 *  finds more redundancy in it. Value filters (FILTER_DELTA, FILTER_XOR) are applied
+	 *  first, then the bytes are shuffled (FILTER_SHUFFLE or FILTER_BITSHUFFLE).
+	 */
+	enum FilterType {
+		FILTER_NONE=0,
+		/** Groups the bytes of the values by significance: all first bytes, then all second
+		 *  bytes, and so on (values are integer or floating point components, or whole elements
+		 *  of mixed and custom types).
+		 */
+		FILTER_SHUFFLE=1,
+		/** Groups the bits of the values by significance, as FILTER_SHUFFLE does with bytes. */
+		FILTER_BITSHUFFLE=2,
+		/** Stores each integer value as its difference with the same component of the
+		 *  previous element, for slowly growing values (e.g. timestamps, indices).
+		 *  Only for integers of 8, 16, 32 or 64 bits.
+		 */
+		FILTER_DELTA=4,
+		/** Stores each floating point value XORed with the same component of the previous
+		 *  element, leaving mostly zero bits between slowly varying values.
+		 *  Only for 32 and 64 bit floating point values.
+		 */
+		FILTER_XOR=8
+	};
+	
+	/** Access pattern hints that can be given for a tensor's data with advise_tensor().
+	 */
+	enum AccessAdvice {
+		/** No special treatment. */
+		ADVICE_NORMAL=0,
+		/** The data will be accessed in sequential order (aggressive read-ahead). */
+		ADVICE_SEQUENTIAL,
+		/** The data will be accessed in random order (no read-ahead). */
+		ADVICE_RANDOM,
+		/** The data will be needed soon, start reading it in. */
+		ADVICE_WILLNEED,
+		/** The data will not be needed anymore, its pages may be dropped.
+		 *  Only the pages lying entirely within the tensor's data are dropped, and any change
+		 *  made to them is lost (they are read from the file again). Refused for loaded tensors
+		 *  of archives stored with the other endianness, which are swapped in place.
+		 */
+		ADVICE_DONTNEED
 	};
 	
+	/** Precomputed layout of an interned element type (see intern_type()). */
+	struct element_layout;
+	
 	/** Structure used for describing simple element types.
 	 * Can be used for describing signed/unsigned integer, floating point and character string types.
 	 */
@@ -69,12 +215,18 @@ namespace darx{
 		uint8_t components;
 		/** Size, in bits, of each value described in this element type.
 		 *  (e.g. each component in a 24-bit RGB pixel is 8 bits in size.)
+		 *  Integer values whose size is not a multiple of 8 bits are held in memory in the
+		 *  smallest native integer type wide enough (e.g. 12-bit values in 16-bit integers).
 		 */
 		uint8_t bit_width;
+		/** Layout of the elements, precomputed for interned types, or 0 (runtime).
+		 *  Interned types are shared and must not be modified nor deleted.
+		 */
+		const element_layout* layout;
 		/** Construct an ElementTypeStruct for the given type, number of components and bit width.
 		 */
 		inline ElementTypeStruct(ElementType _type, uint8_t _components, uint8_t _bit_width):
-			type(_type), components(_components), bit_width(_bit_width){}
+			type(_type), components(_components), bit_width(_bit_width), layout(0){}
 	};
 	/** Structure used for mixed types. A mixed type describes each data element as a sequence
 	 *  of values, each described by it's own ElementTypeStruct.
@@ -107,6 +259,40 @@ namespace darx{
 		CustomElementTypeStruct(ElementType _type, uint8_t _components, uint8_t _bit_width, const char* _type_name);
 	};
 	
+	/** Input/output counters of archive loads and saves.
+	 *  Times are in nanoseconds, summed over all threads taking part.
+	 */
+	typedef struct {
+		/** Bytes read from files. */
+		uint64_t bytes_read;
+		/** Bytes written to files. */
+		uint64_t bytes_written;
+		/** Number of calls reading from files. */
+		uint64_t read_calls;
+		/** Number of calls writing to files. */
+		uint64_t write_calls;
+		/** Number of changes of file position. */
+		uint64_t seeks;
+		/** Time spent parsing headers, indices and tensor descriptors. */
+		uint64_t header_time;
+		/** Time spent compressing (and tiling) tensor data. */
+		uint64_t compress_time;
+		/** Time spent decompressing (and untiling) tensor data. */
+		uint64_t decompress_time;
+		/** Time spent converting tensor data's endianness. */
+		uint64_t swap_time;
+	} io_stats;
+	
+	/** Background loader of the tensors of a lazily loaded archive (opaque).
+	 *  See begin_prefetch().
+	 */
+	typedef struct darx_prefetcher darx_prefetcher;
+	
+	/** Memory arena holding everything allocated while loading an archive (opaque).
+	 *  See create_arena().
+	 */
+	typedef struct darx_arena darx_arena;
+	
 	/** Low-level structure representing a tensor of data.
 	 * A tensor is a (possibly) multi-dimmensional array of data,
 	 * with each element of the tensor belong to some datatype.
@@ -122,14 +308,39 @@ namespace darx{
 		uint8_t rank;
 		/** the lengths of each dimmension in the tensor. */
 		unsigned int* lengths;
-		/** types of each element in the struct. */
+		/** types of each element in the struct (interned, in loaded archives, see intern_type()). */
 		ElementTypeStruct* type;
 		/** Compression algorithm used on this tensor's data. */
 		CompressionType compression;
-		/** total size of the compressed stored data. */
-		unsigned int data_size;
+		/** total size of the tensor's data, once loaded (size of the compressed stored data, otherwise). */
+		size_t data_size;
 		/** The tensor's data. */
 		void* data;
+		/** Wether data was allocated by the library, and gets released by release_image() (runtime flag).
+		 *  Data pointing into an archive's file mapping is never owned.
+		 */
+		bool owns_data;
+		/** Lengths of the tiles the data is stored in (one per dimmension), or 0 if the
+		 *  data is stored contiguously. Tiles on the tensor's edges may be smaller.
+		 */
+		unsigned int* tile_lengths;
+		/** File offset of the tensor's stored data (runtime). */
+		long int data_offset;
+		/** File offset of the tensor's descriptor, which ends where its stored data starts (runtime). */
+		long int descriptor_offset;
+		/** Wether the data of a mixed type tensor is laid out as one column per field, both
+		 *  in memory and in the file (see LAYOUT_COLUMNAR and set_columnar()).
+		 */
+		bool columnar;
+		/** Wether the values of an integer tensor are stored densely packed, in bit_width bits
+		 *  each, rather than in whole native integers (see LAYOUT_BITPACKED). The data in
+		 *  memory always holds native integers.
+		 */
+		bool bit_packed;
+		/** Filters (FilterType flags) applied to the data before it is compressed, or
+		 *  FILTER_NONE (see LAYOUT_FILTERED). The data in memory is never filtered.
+		 */
+		uint8_t filters;
 	} datatensor;
 	
 	/** Data structure representing a darx data archive.
@@ -140,15 +351,133 @@ namespace darx{
 		/** Wether this archive was stored in a big endian computer, or not. */
 		bool isBigEndian;
 		/**  number of tensors in the data archive. */
-		uint16_t number_of_tensors;
+		uint32_t number_of_tensors;
 		/**  size of the header's metadata. */
 		uint16_t metadata_size;
 		/**  Archive metadata string. */
 		char* metadata;
 		/** array of tensor in this darx structure. */
 		datatensor* tensors;
+		/** Base address of the file mapping backing the tensors' data, if the archive
+		 *  was loaded with LOAD_MMAP, 0 otherwise (runtime).
+		 *  The mapping is private: writes to mapped tensor data are never stored back
+		 *  into the file. It stays valid until release_image() is called.
+		 */
+		void* mapping;
+		/** Size of the file mapping, in bytes (runtime). */
+		size_t mapping_size;
+		/** File the archive was loaded from with LOAD_LAZY, from which tensor data
+		 *  is read on demand, 0 otherwise (runtime).
+		 */
+		FILE* file;
+		/** Arena the archive's tensors, names, types, metadata and data were allocated
+		 *  from, if it was loaded with load_image_from(), 0 otherwise (runtime).
+		 */
+		darx_arena* arena;
+		/** Wether the arena was created by load_image_from(), and gets destroyed by
+		 *  release_image(), rather than reset for reuse (runtime flag).
+		 */
+		bool owns_arena;
+		/** Counters of the archive's last load or save, along with the lazy tensor loads
+		 *  and region reads since (runtime).
+		 */
+		io_stats stats;
+		/** Format version the archive was loaded from (see FORMAT_VERSION, runtime).
+		 *  Archives are saved with FORMAT_VERSION, whatever version they were loaded from.
+		 */
+		uint8_t format_version;
+		/** Alignment of the file offsets of the tensors' stored data, in the file the
+		 *  archive was loaded from (1 for format version 1, runtime).
+		 */
+		unsigned int payload_alignment;
 	} darx;
 	
+	/** State of a darx data archive being written with the streaming writer
+	 *  (see begin_archive(), append_tensor() and finish_archive()).
+	 */
+	typedef struct {
+		/** File the archive is written to. It does not need to be seekable. */
+		FILE* file;
+		/** Number of bytes written so far. */
+		long int position;
+		/** Format version and payload alignment the archive is written with
+		 *  (FORMAT_VERSION and PAYLOAD_ALIGNMENT, when it was begun).
+		 */
+		uint8_t format_version;
+		unsigned int payload_alignment;
+		/** Number of tensors written so far. */
+		uint32_t number_of_tensors;
+		/** File offsets of the tensors written so far. */
+		long int* tensor_positions;
+		/** Allocated size of tensor_positions. */
+		unsigned int capacity;
+		/** Wether writing the archive failed. */
+		bool failed;
+	} stream_writer;
+	
+	/** Function producing a tensor's data for the streaming writer.
+	 * 
+	 * @param[in] ctx - the context given to append_tensor()
+	 * @param[out] buffer - receives the next bytes of the tensor's data
+	 * @param[in] size - maximum number of bytes to produce
+	 * 
+	 * @returns the number of bytes produced, 0 on failure
+	 */
+	typedef size_t (*tensor_producer)(void* ctx, void* buffer, size_t size);
+	
+	/** State of a darx data archive being updated in place
+	 *  (see begin_update(), update_tensor() and finish_update()).
+	 */
+	typedef struct {
+		/** File holding the archive, open for reading and writing. */
+		FILE* file;
+		/** The archive being updated, loaded with LOAD_LAZY. */
+		darx archive;
+		/** Number of tensors in the updated archive. */
+		uint32_t number_of_tensors;
+		/** File offsets of the updated archive's tensors. */
+		long int* tensor_positions;
+		/** Names of the updated archive's tensors (copies, may be 0). */
+		char** tensor_names;
+		/** Allocated size of tensor_positions and tensor_names. */
+		unsigned int capacity;
+		/** Wether updating the archive failed. */
+		bool failed;
+	} archive_updater;
+	
+	/** Catalog of the tensors held by a set of darx data archives (opaque).
+	 *  See build_catalog() and open_catalog().
+	 */
+	typedef struct darx_catalog darx_catalog;
+	
+	/** A tensor found in a catalog, with its descriptor as it was when the archive was scanned.
+	 *  Pointers stay valid until the catalog is closed.
+	 */
+	typedef struct {
+		/** The tensor's name. */
+		const char* name;
+		/** Path of the archive holding the tensor, as given to build_catalog(). */
+		const char* path;
+		/** Index of the tensor in the archive. */
+		int tensor_idx;
+		/** Number of dimmensions of the tensor. */
+		uint8_t rank;
+		/** The lengths of each dimmension in the tensor. */
+		const unsigned int* lengths;
+		/** Type of the tensor's elements (interned, see intern_type()). */
+		ElementTypeStruct* type;
+		/** Compression algorithm used on the tensor's data. */
+		CompressionType compression;
+		/** Or'ed combination of the TensorLayout values the data is stored with. */
+		uint8_t layout;
+		/** File offset of the tensor's descriptor. */
+		long int descriptor_offset;
+		/** File offset of the tensor's stored data. */
+		long int data_offset;
+		/** Size of the tensor's stored data. */
+		size_t data_size;
+	} catalog_entry;
+	
 	/** Error codes returned from the load_image_from() function.
 	 */
 	enum ErrorCode{
@@ -167,6 +496,10 @@ namespace darx{
 	 */
 	extern CustomElementTypeStruct UNKNOWN_TYPE;
 	
+	/** Indicates whether the library can read and write data with the given compression type.
+	 */
+	bool is_compression_supported(CompressionType compression);
+	
 	/** Indicates whether a given open file contains .darx data.
 	 * 
 	 * @return true if the data pointed by the file pointer is a .darx file,
@@ -184,6 +517,307 @@ namespace darx{
 	 */
 	ErrorCode load_image_from(darx& darx, FILE* file);
 	
+	/** Loads a darx data archive from a file into the structure, using the given load flags.
+	 * 
+	 * @param[in] darx - reference to the darx structure to fill
+	 * @param[in] file - pointer to the file containing the darx data
+	 * @param[in] flags - or'ed combination of LoadFlags values
+	 * 
+	 * @returns an error code indicating success or reson of failure
+	 * @note with LOAD_MMAP, the archive must be released with release_image(),
+	 *       the file itself may be closed as soon as this function returns.
+	 */
+	ErrorCode load_image_from(darx& darx, FILE* file, int flags);
+	
+	/** Loads a darx data archive from a file into the structure, allocating it from the given arena.
+	 * The arena is reset by release_image(), and may then be used for loading another archive.
+	 * Its memory is kept, so that repeatedly loading similarly shaped archives allocates nothing.
+	 * 
+	 * @param[in] darx - reference to the darx structure to fill
+	 * @param[in] file - pointer to the file containing the darx data
+	 * @param[in] flags - or'ed combination of LoadFlags values
+	 * @param[in] arena - arena created with create_arena(), not used by any other loaded archive
+	 * 
+	 * @returns an error code indicating success or reson of failure
+	 */
+	ErrorCode load_image_from(darx& darx, FILE* file, int flags, darx_arena* arena);
+	
+	/** Creates a memory arena for loading archives into.
+	 * 
+	 * @param[in] size - initial size of the arena, in bytes (it grows as needed)
+	 * 
+	 * @returns the new arena, to be destroyed with destroy_arena()
+	 */
+	darx_arena* create_arena(size_t size);
+	
+	/** Destroys a memory arena, releasing all of its memory.
+	 * Archives loaded into it must have been released first.
+	 */
+	void destroy_arena(darx_arena* arena);
+	
+	/** Releases the resources held by a darx data archive loaded with load_image_from().
+	 * Frees any data owned by the archive, and unmaps its file mapping, if any.
+	 * Archives loaded into a given arena reset it instead, for it to be reused.
+	 * Archives loaded with load_shared_image() release their reference to the shared segment.
+	 * Pointers to tensor data are invalid afterwards.
+	 * 
+	 * @param[in] darx - reference to the darx structure to release
+	 */
+	void release_image(darx& darx);
+	
+	/** Loads a darx data archive through a cache shared by the processes of the host.
+	 * The first process loading an archive decodes it into a named POSIX shared memory
+	 * segment, others attach to the segment and map it, instead of reading the archive
+	 * again: all of the tensors are loaded, and their data is held once per host.
+	 * Segments are named after the file's device, inode, size and modification time,
+	 * so that archives modified since are loaded into a new segment.
+	 * 
+	 * The archive is read-only: its tensors' names, lengths and data lie in the segment's
+	 * read-only mapping, and must not be written to. Segments are reference counted, and
+	 * evicted when their last archive is released with release_image() (archives of
+	 * processes that died without releasing them keep their segment, see evict_shared_image()).
+	 * If shared memory is not available, the archive is loaded privately, as by load_image_from().
+	 * 
+	 * @param[out] darx - reference to the darx structure to load the archive into
+	 * @param[in] path - path of the archive's file
+	 * 
+	 * @returns SUCCESS, or an error code if the archive could not be loaded
+	 */
+	ErrorCode load_shared_image(darx& darx, const char* path);
+	
+	/** Evicts an archive's shared memory segment, if any (see load_shared_image()).
+	 * Archives attached to it keep using it until they are released, later loads build a new one.
+	 * 
+	 * @param[in] path - path of the archive's file
+	 * 
+	 * @returns true if a segment was evicted
+	 */
+	bool evict_shared_image(const char* path);
+	
+	/** Gets the I/O counters of all the loads and saves of the process, since they were last reset.
+	 *  Counters of a single load or save are in the archive's stats.
+	 */
+	void get_io_stats(io_stats& stats);
+	
+	/** Resets the process' I/O counters. */
+	void reset_io_stats();
+	
+	/** Finds a tensor in the archive by its name.
+	 * 
+	 * @param[in] darx - reference to the darx structure holding the tensor
+	 * @param[in] name - the tensor's name
+	 * 
+	 * @returns the index of the tensor in the archive, or -1 if there is no such tensor
+	 */
+	int find_tensor(darx& darx, const char* name);
+	
+	/** Loads a tensor's data, if it has not been loaded yet.
+	 * Only needed for archives loaded with LOAD_LAZY.
+	 * 
+	 * @param[in] darx - reference to the darx structure holding the tensor
+	 * @param[in] tensor_idx - index of the tensor in the archive
+	 * 
+	 * @returns an error code indicating success or reson of failure
+	 */
+	ErrorCode load_tensor(darx& darx, int tensor_idx);
+	
+	/** Finds a tensor in the archive by its name, and loads its data if needed.
+	 * 
+	 * @param[in] darx - reference to the darx structure holding the tensor
+	 * @param[in] name - the tensor's name
+	 * 
+	 * @returns a pointer to the tensor, or 0 if there is no such tensor or it could not be loaded
+	 */
+	datatensor* get_tensor(darx& darx, const char* name);
+	
+	/** Starts loading the tensors of an archive loaded with LOAD_LAZY in the background,
+	 * in the order they are stored in the file, ahead of the tensors waited for with
+	 * wait_tensor(). Up to depth tensors past the last one waited for are read (and
+	 * decompressed) on background threads, while the caller processes the previous ones.
+	 * The archive must not be used with load_tensor() or get_tensor() until end_prefetch().
+	 * 
+	 * @param[in] darx - reference to the darx structure, loaded with LOAD_LAZY
+	 * @param[in] depth - number of tensors read ahead (0 for loading tensors only when waited for)
+	 * 
+	 * @returns the prefetcher, to be ended with end_prefetch(), or 0 if the archive's
+	 *          tensors can not be read concurrently (its file has no file descriptor)
+	 */
+	darx_prefetcher* begin_prefetch(darx& darx, unsigned int depth);
+	
+	/** Waits until a tensor's data is loaded, loading it on the calling thread if it
+	 * was not being read yet, and moves the read ahead window past it.
+	 * 
+	 * @param[in] prefetcher - the prefetcher started with begin_prefetch()
+	 * @param[in] tensor_idx - index of the tensor in the archive
+	 * 
+	 * @returns an error code indicating success or reson of failure
+	 */
+	ErrorCode wait_tensor(darx_prefetcher* prefetcher, int tensor_idx);
+	
+	/** Wether a tensor's data is loaded (or failed to load), without waiting for it. */
+	bool tensor_ready(darx_prefetcher* prefetcher, int tensor_idx);
+	
+	/** Stops loading tensors in the background, and destroys the prefetcher.
+	 * Tensors being read are waited for, queued ones are left unloaded.
+	 */
+	void end_prefetch(darx_prefetcher* prefetcher);
+	
+	/** Reads a region (hyperslab) of a tensor into a buffer.
+	 * If the tensor's data has not been loaded yet, only the tiles of a tiled tensor that
+	 * intersect the region are read (and decompressed), and only the region's bytes of an
+	 * uncompressed contiguous tensor (which is not loaded). Other tensors are loaded first.
+	 * 
+	 * @param[in] darx - reference to the darx structure holding the tensor
+	 * @param[in] tensor_idx - index of the tensor in the archive
+	 * @param[in] start - first element of the region, in each dimmension
+	 * @param[in] count - number of elements in the region, in each dimmension
+	 * @param[out] buffer - receives the region's elements, row-major
+	 * 
+	 * @returns an error code indicating success or reson of failure
+	 */
+	ErrorCode read_tensor_region(darx& darx, int tensor_idx, const unsigned int* start, const unsigned int* count, void* buffer);
+	
+	/** Reads a strided region (hyperslab) of a tensor into a buffer, taking every stride'th
+	 * element along each dimmension. Uncompressed contiguous tensors are read as runs of
+	 * contiguous bytes (the innermost dimmensions fully spanned by the region are read at
+	 * once), with as few positional reads as possible, straight into the buffer.
+	 * 
+	 * @param[in] darx - reference to the darx structure holding the tensor
+	 * @param[in] tensor_idx - index of the tensor in the archive
+	 * @param[in] start - first element of the region, in each dimmension
+	 * @param[in] count - number of elements in the region, in each dimmension
+	 * @param[in] stride - distance between the region's elements, in elements, in each dimmension (at least 1)
+	 * @param[out] buffer - receives the region's elements, packed row-major
+	 * 
+	 * @returns an error code indicating success or reson of failure
+	 */
+	ErrorCode read_tensor_region(darx& darx, int tensor_idx, const unsigned int* start, const unsigned int* count,
+		const unsigned int* stride, void* buffer);
+	
+	/** Reads one field of every element of a mixed type tensor into a buffer.
+	 * Only the field's column is read from the file if the tensor is columnar and
+	 * uncompressed, and its data has not been loaded yet. Otherwise, the tensor is
+	 * loaded and the field is gathered from its data.
+	 * 
+	 * @param[in] darx - reference to the darx structure holding the tensor
+	 * @param[in] tensor_idx - index of the tensor in the archive
+	 * @param[in] field - index of the field in the tensor's element type (its subtypes)
+	 * @param[out] buffer - receives the field of each element, row-major
+	 *                      (elements times element_size() of the field's type bytes)
+	 * 
+	 * @returns an error code indicating success or reson of failure
+	 */
+	ErrorCode read_tensor_field(darx& darx, int tensor_idx, int field, void* buffer);
+	
+	/** Reads a tensor's values into a buffer, converted to another element type.
+	 * Integers are converted exactly, saturating to the range of their new type, and
+	 * floats converted to integers are rounded to the nearest one.
+	 * 
+	 * @see read_tensor_converted(darx&, int, ElementTypeStruct*, void*, double, double)
+	 */
+	ErrorCode read_tensor_converted(darx& darx, int tensor_idx, ElementTypeStruct* type, void* buffer);
+	
+	/** Reads a tensor's values into a buffer, converted to another element type, and scaled:
+	 * each value is stored as value * scale + offset. Integer results are rounded to
+	 * the nearest integer, and saturated to their type's range.
+	 * If the tensor's data has not been loaded yet, values are converted as they are read
+	 * and decompressed, without loading the tensor's data: it stays unloaded.
+	 * Only integer (of up to 64 bits) and float (32 or 64 bits) types are converted, and
+	 * both types must have the same number of components.
+	 * 
+	 * @param[in] darx - reference to the darx structure holding the tensor
+	 * @param[in] tensor_idx - index of the tensor in the archive
+	 * @param[in] type - the element type to convert to
+	 * @param[out] buffer - receives the converted elements, row-major
+	 *                      (elements times element_size() of type bytes)
+	 * @param[in] scale - factor each value is multiplied by
+	 * @param[in] offset - value added to each scaled value
+	 * 
+	 * @returns an error code indicating success or reson of failure
+	 */
+	ErrorCode read_tensor_converted(darx& darx, int tensor_idx, ElementTypeStruct* type, void* buffer,
+		double scale, double offset);
+	
+	/** Converts the data of a mixed type tensor between the record layout (one element
+	 * after the other) and the columnar layout (one column per field), in place.
+	 * The tensor is then stored with the new layout when saved.
+	 * 
+	 * @param[in,out] tensor - the mixed type tensor, with its data loaded
+	 * @param[in] columnar - wether the data is to be laid out in columns
+	 * 
+	 * @returns false if the tensor is not a mixed type tensor, or has no data
+	 */
+	bool set_columnar(datatensor& tensor, bool columnar);
+	
+	/** Transposes data elements of a mixed type from the record layout to the columnar layout.
+	 * Column i holds field i of every element, and directly follows column i-1.
+	 * 
+	 * @param[in] type - the elements' mixed type
+	 * @param[in] records - the elements, one after the other
+	 * @param[out] columns - receives the columns (must not overlap records)
+	 * @param[in] number_of_elements - number of elements
+	 * 
+	 * @returns false if the type is not a mixed type
+	 */
+	bool records_to_columns(ElementTypeStruct* type, const void* records, void* columns, size_t number_of_elements);
+	
+	/** Transposes data elements of a mixed type from the columnar layout to the record layout.
+	 * See records_to_columns().
+	 */
+	bool columns_to_records(ElementTypeStruct* type, const void* columns, void* records, size_t number_of_elements);
+	
+	/** Swaps the byte order of each value in an array of data elements of the given type.
+	 * Archives stored with the other endianness are swapped when loaded, this function
+	 * is only needed for data from other sources. Mixed types are swapped field by field.
+	 * 
+	 * @param[in] type - the type of the data elements
+	 * @param[in,out] data - the data elements
+	 * @param[in] data_size - size of the data, in bytes
+	 * 
+	 * @returns false if the type can not be swapped (custom types, non integer values that
+	 *          are not a whole number of bytes), in which case the data is left untouched
+	 */
+	bool swap_endianness(ElementTypeStruct* type, void* data, size_t data_size);
+	
+	/** Size, in bytes, of a data element of the given type.
+	 * Mixed types are the sum of their subtypes' sizes. Integer values whose bit width
+	 * is not a multiple of 8 take the size of the smallest native integer wide enough.
+	 */
+	unsigned int element_size(ElementTypeStruct* type);
+	
+	/** Returns the interned element type equal to the given one: a single, shared and
+	 *  immutable copy of each distinct type, with its layout precomputed (see element_size(),
+	 *  element_alignment(), field_offset() and swap_endianness()). The types of the tensors
+	 *  of loaded archives are interned, so tensors of the same type share it, across archives.
+	 *  Interned types are never deleted, release_image() leaves them.
+	 *
+	 * @param[in] type - the type to intern (left untouched, the interned type is a copy)
+	 *
+	 * @returns the interned type, or 0 if the type is invalid
+	 */
+	ElementTypeStruct* intern_type(ElementTypeStruct* type);
+	
+	/** Alignment, in bytes, of the widest value of an element of the given type
+	 *  (1 for custom types). Interns the type.
+	 */
+	unsigned int element_alignment(ElementTypeStruct* type);
+	
+	/** Offset, in bytes, of the given field (subtype) of a mixed type's elements, or
+	 *  of the given component of other types' elements.
+	 */
+	unsigned int field_offset(ElementTypeStruct* type, int field);
+	
+	/** Gives the system a hint about how a tensor's data is going to be accessed.
+	 * Only has an effect on tensors whose data lies in the archive's file mapping.
+	 * 
+	 * @param[in] darx - reference to the darx structure holding the tensor
+	 * @param[in] tensor_idx - index of the tensor in the archive
+	 * @param[in] advice - the expected access pattern
+	 * 
+	 * @returns true if the hint was given
+	 */
+	bool advise_tensor(darx& darx, int tensor_idx, AccessAdvice advice);
+	
 	
 	/** Saves a darx data archive to a file.
 	 * 
@@ -193,6 +827,143 @@ namespace darx{
 	 * @returns true if the darx file could be saved
 	 */
 	bool save_image_to(darx& darx, FILE* file);
+	
+	/** Saves a darx data archive to a file, using the given save flags.
+	 * 
+	 * @param[in] darx - reference to the darx structure to store
+	 * @param[in] file - pointer to the file where to store the darx data
+	 * @param[in] flags - or'ed combination of SaveFlags values
+	 * 
+	 * @returns true if the darx file could be saved
+	 */
+	bool save_image_to(darx& darx, FILE* file, int flags);
+	
+	/** Starts writing a darx data archive sequentially, without ever seeking in the file.
+	 * The tensors index is written at the end of the archive, by finish_archive().
+	 * 
+	 * @param[out] writer - the writer's state
+	 * @param[in] file - pointer to the file where to store the darx data (may be a pipe)
+	 * @param[in] metadata - archive metadata string
+	 * @param[in] metadata_size - size of the metadata
+	 * 
+	 * @returns true if the archive's header could be written
+	 */
+	bool begin_archive(stream_writer& writer, FILE* file, const char* metadata, uint16_t metadata_size);
+	
+	/** Appends a tensor to an archive started with begin_archive().
+	 * 
+	 * @param[in] writer - the writer's state
+	 * @param[in] tensor - the tensor to append
+	 * 
+	 * @returns true if the tensor could be written
+	 */
+	bool append_tensor(stream_writer& writer, datatensor& tensor);
+	
+	/** Appends a tensor to an archive started with begin_archive(), its data being
+	 * pulled from a producer function in chunks, instead of the tensor's data.
+	 * The tensor's data_size must be set. Uncompressed, contiguous tensors are streamed
+	 * straight through, others are gathered in memory first to be encoded.
+	 * 
+	 * @param[in] writer - the writer's state
+	 * @param[in] tensor - the tensor to append
+	 * @param[in] producer - function producing the tensor's data
+	 * @param[in] ctx - context passed to the producer
+	 * 
+	 * @returns true if the tensor could be written
+	 */
+	bool append_tensor(stream_writer& writer, datatensor& tensor, tensor_producer producer, void* ctx);
+	
+	/** Finishes an archive started with begin_archive(), writing its tensors index.
+	 * The writer's resources are released, whether it succeeds or not.
+	 * 
+	 * @param[in] writer - the writer's state
+	 * 
+	 * @returns true if the archive was written completely
+	 */
+	bool finish_archive(stream_writer& writer);
+	
+	/** Starts updating an archive in place.
+	 * Updated tensors are appended to the file, leaving the existing ones untouched,
+	 * and a new index is written by finish_update(), so the cost of an update is that
+	 * of the updated tensors, not of the whole archive. Replaced tensors are left in
+	 * the file as dead space, until the archive is compacted with compact_archive().
+	 * The archive must have been stored with this system's endianness (and, in format
+	 * version 1, integer sizes). Tensors are written with the archive's format version.
+	 * Updates are not crash-safe: see finish_update().
+	 * 
+	 * @param[out] updater - state of the update
+	 * @param[in] file - the archive's file, open for reading and writing ("r+b")
+	 * 
+	 * @returns true if the archive can be updated
+	 */
+	bool begin_update(archive_updater& updater, FILE* file);
+	
+	/** Appends a tensor to an archive being updated, replacing any tensor with the same name.
+	 * 
+	 * @param[in] updater - state of the update
+	 * @param[in] tensor - the tensor to store, its data is compressed and tiled as described
+	 * 
+	 * @returns true if the tensor could be written
+	 */
+	bool update_tensor(archive_updater& updater, datatensor& tensor);
+	
+	/** Writes the updated archive's index, and releases the update's state.
+	 * The archive is stored as a streamed archive (its index lies in a footer),
+	 * and is only valid again once this function returns.
+	 * The first update of an archive whose index lies in its header is not crash-safe:
+	 * the header's tensor count is then rewritten and the metadata moved over the old
+	 * index, in separate writes, and a crash in between leaves the archive unreadable.
+	 * The footer is synced to disk before the header is touched.
+	 * 
+	 * @returns true if the archive was updated
+	 */
+	bool finish_update(archive_updater& updater);
+	
+	/** Copies the tensors of an archive to a new file, leaving out the dead space
+	 * left by in-place updates. Tensors are copied as stored, without being decoded,
+	 * in the archive's format version.
+	 * 
+	 * @param[in] src - the archive's file
+	 * @param[in] dst - the file for the compacted archive
+	 * 
+	 * @returns true if the archive was compacted
+	 */
+	bool compact_archive(FILE* src, FILE* dst);
+	
+	/** Builds a catalog of the tensors held by a set of archives, and stores it in a file.
+	 * If the file already holds a catalog, archives whose size and modification time
+	 * did not change since are not read again, their entries are taken from it.
+	 * The catalog is written to a temporary file, which then replaces the old one, so
+	 * that catalogs opened with open_catalog() are not disturbed.
+	 * 
+	 * @param[in] catalog_path - path of the catalog's file
+	 * @param[in] archive_paths - paths of the archives (files that are not archives are skipped)
+	 * @param[in] number_of_archives - number of archive paths
+	 * 
+	 * @returns true if the catalog was stored
+	 */
+	bool build_catalog(const char* catalog_path, const char* const* archive_paths, size_t number_of_archives);
+	
+	/** Opens a catalog stored by build_catalog(), by mapping its file.
+	 * 
+	 * @returns the catalog, to be closed with close_catalog(), or 0 if the file is not a
+	 *          catalog built on a system of this endianness and integer sizes
+	 */
+	darx_catalog* open_catalog(const char* catalog_path);
+	
+	/** Finds the tensors with the given name in a catalog, with a binary search.
+	 * 
+	 * @param[in] catalog - the catalog opened with open_catalog()
+	 * @param[in] name - the tensors' name
+	 * @param[out] entries - receives up to max_entries of the tensors found, ordered by archive
+	 * @param[in] max_entries - size of entries
+	 * 
+	 * @returns the number of tensors with that name in the catalog (which may be more than max_entries)
+	 */
+	size_t find_in_catalog(darx_catalog* catalog, const char* name, catalog_entry* entries, size_t max_entries);
+	
+	/** Closes a catalog, unmapping its file. */
+	void close_catalog(darx_catalog* catalog);
 };
 
 #endif
\ No newline at end of file
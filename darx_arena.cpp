@@ -0,0 +1,115 @@
+/**
+ * @file
+ * Memory arenas holding everything allocated while loading a darx data archive:
+ * the tensors array, names, lengths, element types, metadata and tensor data.
+ * Releasing an archive releases its arena at once, instead of each allocation.
+ *
+ * An arena is a chain of blocks handed out by bumping a pointer. When an arena is
+ * reset, blocks are merged into a single one, large enough for the previous load,
+ * so that reloading similarly shaped archives allocates nothing.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <iostream>
+#include <stdlib.h>
+#include <mutex>
+#include <new>
+
+// alignment of the allocations made in an arena.
+#define ARENA_ALIGNMENT 16
+// smallest block allocated by an arena.
+#define ARENA_MIN_BLOCK_SIZE (64 << 10)
+// largest block allocated by doubling the previous one (larger allocations get a block of their own size).
+#define ARENA_MAX_BLOCK_SIZE (64 << 20)
+
+namespace darx{
+
+	typedef struct arena_block {
+		struct arena_block* next;
+		size_t size;
+		size_t used;
+		uint8_t* data;
+	} arena_block;
+
+	struct darx_arena {
+		/** blocks of the arena, the one currently allocated from first. */
+		arena_block* blocks;
+		/** bytes allocated since the arena was last reset. */
+		size_t allocated;
+		/** tensors' data may be allocated from several threads, in parallel loads. */
+		std::mutex mutex;
+	};
+
+	static arena_block* new_arena_block(size_t size, arena_block* next){
+		arena_block* block = new arena_block;
+		if(posix_memalign((void**)&block->data, ARENA_ALIGNMENT, size)){
+			delete block;
+			throw std::bad_alloc();
+		}
+		block->next = next;
+		block->size = size;
+		block->used = 0;
+		return block;
+	}
+
+	static void delete_arena_blocks(arena_block* block){
+		while(block){
+			arena_block* next = block->next;
+			free(block->data);
+			delete block;
+			block = next;
+		}
+	}
+
+	darx_arena* create_arena(size_t size){
+		darx_arena* arena = new darx_arena;
+		arena->blocks = 0;
+		arena->allocated = 0;
+		if(size > 0){
+			arena->blocks = new_arena_block(size, 0);
+		}
+		return arena;
+	}
+
+	void* arena_alloc(darx_arena* arena, size_t len){
+		size_t aligned_len = (len + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+		std::lock_guard<std::mutex> lock(arena->mutex);
+		arena_block* block = arena->blocks;
+		if(!block || block->size - block->used < aligned_len){
+			// grow geometrically, so that the number of blocks stays small, up to a maximum:
+			// the first block may be as large as the archive's file.
+			size_t size = block && block->size < ARENA_MAX_BLOCK_SIZE / 2 ? block->size * 2 : ARENA_MAX_BLOCK_SIZE;
+			if(!block || size < ARENA_MIN_BLOCK_SIZE){
+				size = ARENA_MIN_BLOCK_SIZE;
+			}
+			if(size < aligned_len){
+				size = aligned_len;
+			}
+			block = new_arena_block(size, arena->blocks);
+			arena->blocks = block;
+		}
+		void* ptr = block->data + block->used;
+		block->used += aligned_len;
+		arena->allocated += aligned_len;
+		return ptr;
+	}
+
+	void reset_arena(darx_arena* arena){
+		if(arena->blocks && arena->blocks->next){
+			// merge the blocks into one, sized for what was needed last time.
+DARX_TRACE("# merging arena blocks (" << arena->allocated << " bytes)");
+			delete_arena_blocks(arena->blocks);
+			arena->blocks = new_arena_block(arena->allocated, 0);
+		} else if(arena->blocks){
+			arena->blocks->used = 0;
+		}
+		arena->allocated = 0;
+	}
+
+	void destroy_arena(darx_arena* arena){
+		if(arena){
+			delete_arena_blocks(arena->blocks);
+			delete arena;
+		}
+	}
+};
@@ -0,0 +1,278 @@
+/**
+ * @file
+ * Bit-packed storage of integer tensors.
+ * Integer values whose bit width is not a multiple of 8 are held in memory in the
+ * smallest native integer wide enough (sign extended for TYPE_INT), and may be stored
+ * densely packed instead: value i occupies bits [i*bit_width, (i+1)*bit_width) of the
+ * stored data, least significant bit first, bit 0 of each byte first. The packed data
+ * is the same on every system, it is never swapped.
+ *
+ * Values are widened and narrowed 8 at a time with AVX2 (when the cpu supports it) for
+ * bit widths from 9 to 25, otherwise through a 64 bit accumulator.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <iostream>
+#include <string.h>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define DARX_X86_SIMD 1
+#endif
+
+namespace darx{
+
+	unsigned int value_size(uint8_t bit_width){
+		if(!(bit_width % 8)){
+			return bit_width / 8;
+		}
+		return bit_width < 8 ? 1 : bit_width < 16 ? 2 : bit_width < 32 ? 4 : 8;
+	}
+
+	bool can_bit_pack(ElementTypeStruct* type){
+		return type && (type->type == TYPE_INT || type->type == TYPE_UINT) &&
+			type->bit_width > 0 && type->bit_width <= 64;
+	}
+
+	static size_t number_of_values(datatensor& tensor){
+		size_t count = tensor.type->components;
+		for(int dim_idx=0; dim_idx < tensor.rank; dim_idx++){
+			count *= tensor.lengths[dim_idx];
+		}
+		return count;
+	}
+
+	size_t bit_packed_size(datatensor& tensor){
+		return (number_of_values(tensor) * tensor.type->bit_width + 7) / 8;
+	}
+
+	static inline uint64_t load_value(const uint8_t* p, unsigned int size){
+		switch(size){
+			case 1: return *p;
+			case 2:{ uint16_t v; memcpy(&v, p, 2); return v; }
+			case 4:{ uint32_t v; memcpy(&v, p, 4); return v; }
+			case 8:{ uint64_t v; memcpy(&v, p, 8); return v; }
+			default:{
+				// values of 3, 5, 6 or 7 bytes, in the system's byte order.
+				uint64_t v = 0;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+				memcpy((uint8_t*)&v + 8 - size, p, size);
+#else
+				memcpy(&v, p, size);
+#endif
+				return v;
+			}
+		}
+	}
+
+	static inline void store_value(uint8_t* p, unsigned int size, uint64_t value){
+		switch(size){
+			case 1: *p = (uint8_t)value; break;
+			case 2:{ uint16_t v = value; memcpy(p, &v, 2); } break;
+			case 4:{ uint32_t v = value; memcpy(p, &v, 4); } break;
+			case 8: memcpy(p, &value, 8); break;
+			default:
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+				memcpy(p, (uint8_t*)&value + 8 - size, size);
+#else
+				memcpy(p, &value, size);
+#endif
+		}
+	}
+
+	/** Reads consecutive fields of up to 32 bits from packed data. */
+	typedef struct {
+		const uint8_t* p;
+		uint64_t acc;
+		unsigned int acc_bits;
+	} bit_reader;
+
+	static inline uint64_t get_bits(bit_reader& reader, unsigned int bits){
+		while(reader.acc_bits < bits){
+			reader.acc |= (uint64_t)(*reader.p++) << reader.acc_bits;
+			reader.acc_bits += 8;
+		}
+		uint64_t value = reader.acc & ((1ull << bits) - 1);
+		reader.acc >>= bits;
+		reader.acc_bits -= bits;
+		return value;
+	}
+
+	/** Widens count values, starting on a byte boundary of the packed data. */
+	static void unpack_scalar(const uint8_t* packed, uint8_t* out, size_t count, unsigned int bits, unsigned int size, bool is_signed){
+		bit_reader reader = { packed, 0, 0 };
+		unsigned int low_bits = bits < 32 ? bits : 32;
+		for(size_t i=0; i < count; i++, out += size){
+			uint64_t value = get_bits(reader, low_bits);
+			if(bits > 32){
+				value |= get_bits(reader, bits - 32) << 32;
+			}
+			if(is_signed && bits < 64){
+				value = (uint64_t)((int64_t)(value << (64 - bits)) >> (64 - bits));
+			}
+			store_value(out, size, value);
+		}
+	}
+
+#ifdef DARX_X86_SIMD
+	/** Widens groups of 8 values (bits bytes of packed data each) to 16 or 32 bit integers.
+	 *  Each 32 bit lane gathers the 4 bytes holding its value, which is then shifted into place.
+	 *  Returns the number of values widened.
+	 */
+	__attribute__((target("avx2")))
+	static size_t unpack_avx2(const uint8_t* packed, size_t packed_len, uint8_t* out, size_t count, unsigned int bits, unsigned int size, bool is_signed){
+		uint8_t shuffle[32];
+		uint32_t shifts[8];
+		unsigned int half_offset = (4 * bits) / 8;
+		for(int lane=0; lane < 8; lane++){
+			unsigned int bit_offset = (lane < 4 ? 0 : (4 * bits) % 8) + (lane % 4) * bits;
+			for(int b=0; b < 4; b++){
+				shuffle[lane * 4 + b] = bit_offset / 8 + b;
+			}
+			shifts[lane] = bit_offset % 8;
+		}
+		__m256i shuffle_mask = _mm256_loadu_si256((const __m256i*)shuffle);
+		__m256i shift = _mm256_loadu_si256((const __m256i*)shifts);
+		__m256i value_mask = _mm256_set1_epi32((1u << bits) - 1);
+		__m128i sign_shift = _mm_cvtsi32_si128(32 - bits);
+		size_t i = 0;
+		// the upper half reads 16 bytes from half_offset, which must lie in the packed data.
+		for(const uint8_t* p = packed; i + 8 <= count && (size_t)(p - packed) + half_offset + 16 <= packed_len; i += 8, p += bits){
+			__m256i bytes = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+				_mm_loadu_si128((const __m128i*)(p + half_offset)), 1
+			);
+			__m256i values = _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(bytes, shuffle_mask), shift), value_mask);
+			if(is_signed){
+				values = _mm256_sra_epi32(_mm256_sll_epi32(values, sign_shift), sign_shift);
+			}
+			if(size == 4){
+				_mm256_storeu_si256((__m256i*)(out + i * 4), values);
+			} else {
+				__m128i low = _mm256_castsi256_si128(values);
+				__m128i high = _mm256_extracti128_si256(values, 1);
+				_mm_storeu_si128((__m128i*)(out + i * 2), is_signed ? _mm_packs_epi32(low, high) : _mm_packus_epi32(low, high));
+			}
+		}
+		return i;
+	}
+#endif
+
+	bool unpack_tensor_data(datatensor& tensor, const uint8_t* packed, size_t packed_len, uint8_t* out, size_t out_len){
+		unsigned int bits = tensor.type->bit_width;
+		unsigned int size = value_size(bits);
+		size_t count = number_of_values(tensor);
+		if(!can_bit_pack(tensor.type) || packed_len != bit_packed_size(tensor) || out_len != count * size){
+			return false;
+		}
+		bool is_signed = tensor.type->type == TYPE_INT;
+		size_t done = 0;
+#ifdef DARX_X86_SIMD
+		__builtin_cpu_init();
+		if(bits > 8 && bits <= 25 && (size == 2 || size == 4) && __builtin_cpu_supports("avx2")){
+			done = unpack_avx2(packed, packed_len, out, count, bits, size, is_signed);
+		}
+#endif
+		// groups of 8 values end on a byte boundary.
+		unpack_scalar(packed + done / 8 * bits, out + done * size, count - done, bits, size, is_signed);
+		return true;
+	}
+
+	/** Packs count values, starting on a byte boundary of the packed data. */
+	static void pack_scalar(const uint8_t* values, uint8_t* p, size_t count, unsigned int bits, unsigned int size){
+		uint64_t acc = 0;
+		unsigned int acc_bits = 0;
+		unsigned int low_bits = bits < 32 ? bits : 32;
+		for(size_t i=0; i < count; i++, values += size){
+			uint64_t value = load_value(values, size);
+			// only the low bits of each value are kept, in pieces of up to 32 bits.
+			acc |= (value & ((1ull << low_bits) - 1)) << acc_bits;
+			acc_bits += low_bits;
+			for(; acc_bits >= 8; acc_bits -= 8, acc >>= 8){ *p++ = (uint8_t)acc; }
+			if(bits > 32){
+				acc |= ((value >> 32) & ((1ull << (bits - 32)) - 1)) << acc_bits;
+				acc_bits += bits - 32;
+				for(; acc_bits >= 8; acc_bits -= 8, acc >>= 8){ *p++ = (uint8_t)acc; }
+			}
+		}
+		if(acc_bits){
+			*p++ = (uint8_t)acc;
+		}
+	}
+
+#ifdef DARX_X86_SIMD
+	/** Narrows groups of 8 values from 16 or 32 bit integers (the reverse of unpack_avx2()).
+	 *  Each 32 bit lane holds a value shifted to its bit offset, and each packed byte gathers
+	 *  the bytes of the (at most 2) values it holds bits of. The first 4 values are stored
+	 *  at the group's first byte, the others or'ed in from half_offset on. The packed data
+	 *  must be zeroed. Returns the number of values narrowed.
+	 */
+	__attribute__((target("avx2")))
+	static size_t pack_avx2(const uint8_t* values, uint8_t* packed, size_t packed_len, size_t count, unsigned int bits, unsigned int size){
+		uint8_t first[32];
+		uint8_t second[32];
+		uint32_t shifts[8];
+		unsigned int half_offset = (4 * bits) / 8;
+		for(int half=0; half < 2; half++){
+			unsigned int base = half ? (4 * bits) % 8 : 0;
+			for(int lane=0; lane < 4; lane++){
+				shifts[half * 4 + lane] = (base + lane * bits) % 8;
+			}
+			for(unsigned int j=0; j < 16; j++){
+				// bytes of the lanes holding bits [8j, 8j+8) of this half's packed data.
+				uint8_t* sources[2] = { &first[half * 16 + j], &second[half * 16 + j] };
+				int found = 0;
+				*sources[0] = *sources[1] = 0x80;
+				for(int lane=0; lane < 4; lane++){
+					unsigned int begin = base + lane * bits;
+					if(begin < 8 * (j + 1) && begin + bits > 8 * j && found < 2){
+						*sources[found++] = lane * 4 + (j - begin / 8);
+					}
+				}
+			}
+		}
+		__m256i first_mask = _mm256_loadu_si256((const __m256i*)first);
+		__m256i second_mask = _mm256_loadu_si256((const __m256i*)second);
+		__m256i shift = _mm256_loadu_si256((const __m256i*)shifts);
+		__m256i value_mask = _mm256_set1_epi32((1u << bits) - 1);
+		size_t i = 0;
+		// the upper half writes 16 bytes from half_offset, which must lie in the packed data.
+		for(uint8_t* p = packed; i + 8 <= count && (size_t)(p - packed) + half_offset + 16 <= packed_len; i += 8, p += bits){
+			__m256i lanes = size == 4 ?
+				_mm256_loadu_si256((const __m256i*)(values + i * 4)) :
+				_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(values + i * 2)));
+			lanes = _mm256_sllv_epi32(_mm256_and_si256(lanes, value_mask), shift);
+			__m256i bytes = _mm256_or_si256(_mm256_shuffle_epi8(lanes, first_mask), _mm256_shuffle_epi8(lanes, second_mask));
+			_mm_storeu_si128((__m128i*)p, _mm256_castsi256_si128(bytes));
+			__m128i high = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + half_offset)), _mm256_extracti128_si256(bytes, 1));
+			_mm_storeu_si128((__m128i*)(p + half_offset), high);
+		}
+		return i;
+	}
+#endif
+
+	bool pack_tensor_data(datatensor& tensor, uint8_t** packed, size_t* packed_len){
+		if(!can_bit_pack(tensor.type) || !tensor.data){
+			return false;
+		}
+		unsigned int bits = tensor.type->bit_width;
+		unsigned int size = value_size(bits);
+		size_t count = number_of_values(tensor);
+		size_t len = bit_packed_size(tensor);
+		uint8_t* out = new uint8_t[len];
+		const uint8_t* values = (const uint8_t*)tensor.data;
+		size_t done = 0;
+#ifdef DARX_X86_SIMD
+		__builtin_cpu_init();
+		if(bits > 8 && bits <= 25 && (size == 2 || size == 4) && __builtin_cpu_supports("avx2")){
+			memset(out, 0, len);
+			done = pack_avx2(values, out, len, count, bits, size);
+		}
+#endif
+		// groups of 8 values end on a byte boundary.
+		pack_scalar(values + done * size, out + done / 8 * bits, count - done, bits, size);
+DARX_TRACE("#    [bit packed] " << count << " values of " << bits << " bits : " << len << " bytes");
+		(*packed) = out;
+		(*packed_len) = len;
+		return true;
+	}
+};
@@ -0,0 +1,414 @@
+/**
+ * @file
+ * Catalogs of the tensors held by sets of darx data archives.
+ * A catalog file is mapped as is, and searched in place. It holds, in this system's
+ * endianness and integer sizes:
+ *   catalog_header
+ *   catalog_file files[number_of_files]           (the scanned archives)
+ *   catalog_record records[number_of_records]     (the tensors, sorted by name)
+ *   unsigned int lengths[]                        (the tensors' lengths)
+ *   uint8_t types[]                               (element types, as in tensor descriptors)
+ *   char strings[]                                (paths and names, 0 terminated)
+ * Identical element types are stored once.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace darx{
+	#define CATALOG_MAGIC "DRXC"
+	#define CATALOG_VERSION 2
+
+	typedef struct {
+		char magic[DARX_MAGIC_LEN];
+		uint32_t int_magic;
+		uint32_t version;
+		uint32_t number_of_files;
+		uint64_t number_of_records;
+		uint64_t files_offset;
+		uint64_t records_offset;
+		uint64_t lengths_offset;
+		uint64_t types_offset;
+		uint64_t strings_offset;
+		uint64_t size;
+	} catalog_header;
+
+	/** A scanned archive, with the size and modification time it had when scanned. */
+	typedef struct {
+		uint64_t path;
+		uint64_t size;
+		int64_t mtime_sec;
+		int64_t mtime_nsec;
+	} catalog_file;
+
+	/** A tensor of a scanned archive. Offsets of names and types are into their sections,
+	 *  lengths are an index into the lengths section.
+	 */
+	typedef struct {
+		uint64_t name;
+		uint64_t type;
+		uint64_t lengths;
+		int64_t descriptor_offset;
+		int64_t data_offset;
+		uint64_t data_size;
+		uint32_t file;
+		uint32_t type_size;
+		uint32_t tensor_idx;
+		uint8_t rank;
+		uint8_t compression;
+		uint8_t layout;
+		uint8_t reserved[1];
+	} catalog_record;
+
+	struct darx_catalog {
+		uint8_t* mapping;
+		size_t size;
+		const catalog_header* header;
+		const catalog_file* files;
+		const catalog_record* records;
+	};
+
+	/** A tensor being added to a catalog. */
+	typedef struct {
+		std::string name;
+		std::string type;
+		std::vector<unsigned int> lengths;
+		catalog_record record;
+	} pending_record;
+
+	/** Orders pending records by name, then by archive. */
+	static bool pending_record_order(const pending_record* a, const pending_record* b){
+		int cmp = a->name.compare(b->name);
+		if(cmp){
+			return cmp < 0;
+		}
+		if(a->record.file != b->record.file){
+			return a->record.file < b->record.file;
+		}
+		return a->record.tensor_idx < b->record.tensor_idx;
+	}
+
+	static inline const char* catalog_string(const darx_catalog* catalog, uint64_t offset){
+		return (const char*)catalog->mapping + catalog->header->strings_offset + offset;
+	}
+
+	static inline size_t align8(size_t len){
+		return (len + 7) & ~(size_t)7;
+	}
+
+	/** Checks that the paths, names, archives, lengths and types the files and records refer
+	 *  to lie within their sections. Strings end within the file, as its last byte is a 0.
+	 */
+	static bool are_valid_records(const uint8_t* mapping, const catalog_header* header){
+		const catalog_file* files = (const catalog_file*)(mapping + header->files_offset);
+		const catalog_record* records = (const catalog_record*)(mapping + header->records_offset);
+		uint64_t number_of_lengths = (header->types_offset - header->lengths_offset) / sizeof(unsigned int);
+		uint64_t types_size = header->strings_offset - header->types_offset;
+		uint64_t strings_size = header->size - header->strings_offset;
+		for(uint32_t i=0; i < header->number_of_files; i++){
+			if(files[i].path >= strings_size){
+				return false;
+			}
+		}
+		for(uint64_t i=0; i < header->number_of_records; i++){
+			const catalog_record& record = records[i];
+			if(record.name >= strings_size || record.file >= header->number_of_files ||
+				record.lengths > number_of_lengths || record.rank > number_of_lengths - record.lengths ||
+				record.type > types_size || record.type_size > types_size - record.type
+			){
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/** Checks that the mapped file is a catalog of this system, and that its sections, and
+	 *  everything its records refer to, lie within it.
+	 */
+	static bool is_valid_catalog(const uint8_t* mapping, size_t size){
+		const catalog_header* header = (const catalog_header*)mapping;
+		uint32_t int_magic = DARX_MAGIC_BE;
+		if(size < sizeof(catalog_header) || memcmp(header->magic, CATALOG_MAGIC, DARX_MAGIC_LEN) ||
+			header->int_magic != int_magic || header->version != CATALOG_VERSION || header->size != size
+		){
+			return false;
+		}
+		// sections are in order and aligned, and the counts can not overflow their sizes.
+		return header->files_offset >= sizeof(catalog_header) && header->files_offset <= size &&
+			!(header->files_offset % 8) && !(header->records_offset % 8) && !(header->lengths_offset % 8) &&
+			header->number_of_files <= (size - header->files_offset) / sizeof(catalog_file) &&
+			header->files_offset + header->number_of_files * sizeof(catalog_file) <= header->records_offset &&
+			header->records_offset <= size &&
+			header->number_of_records <= (size - header->records_offset) / sizeof(catalog_record) &&
+			header->records_offset + header->number_of_records * sizeof(catalog_record) <= header->lengths_offset &&
+			header->lengths_offset <= header->types_offset &&
+			header->types_offset <= header->strings_offset &&
+			size > header->strings_offset && mapping[size - 1] == 0 &&
+			are_valid_records(mapping, header);
+	}
+
+	darx_catalog* open_catalog(const char* catalog_path){
+		int fd = open(catalog_path, O_RDONLY);
+		if(fd < 0){
+			return 0;
+		}
+		struct stat file_stat;
+		void* mapping = MAP_FAILED;
+		if(!fstat(fd, &file_stat) && file_stat.st_size > 0){
+			mapping = mmap(0, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if(mapping == MAP_FAILED){
+			return 0;
+		}
+		if(!is_valid_catalog((const uint8_t*)mapping, file_stat.st_size)){
+			munmap(mapping, file_stat.st_size);
+			return 0;
+		}
+		darx_catalog* catalog = new darx_catalog;
+		catalog->mapping = (uint8_t*)mapping;
+		catalog->size = file_stat.st_size;
+		catalog->header = (const catalog_header*)mapping;
+		catalog->files = (const catalog_file*)(catalog->mapping + catalog->header->files_offset);
+		catalog->records = (const catalog_record*)(catalog->mapping + catalog->header->records_offset);
+DARX_TRACE("# catalog of " << catalog->header->number_of_records << " tensors in " << catalog->header->number_of_files << " archives.");
+		return catalog;
+	}
+
+	void close_catalog(darx_catalog* catalog){
+		if(catalog){
+			munmap(catalog->mapping, catalog->size);
+			delete catalog;
+		}
+	}
+
+	/** Decodes a record's element type, interned along with the types of loaded archives. */
+	static ElementTypeStruct* catalog_type(darx_catalog* catalog, const catalog_record& record){
+		const uint8_t* types = catalog->mapping + catalog->header->types_offset;
+		size_t types_size = catalog->header->strings_offset - catalog->header->types_offset;
+		if(record.type + record.type_size > types_size){
+			return 0;
+		}
+		return decode_tensor_type(types + record.type, record.type_size);
+	}
+
+	size_t find_in_catalog(darx_catalog* catalog, const char* name, catalog_entry* entries, size_t max_entries){
+		if(!catalog || !name){
+			return 0;
+		}
+		// binary search for the first record with the name.
+		size_t first = 0;
+		size_t last = catalog->header->number_of_records;
+		while(first < last){
+			size_t middle = first + (last - first) / 2;
+			if(strcmp(catalog_string(catalog, catalog->records[middle].name), name) < 0){
+				first = middle + 1;
+			} else {
+				last = middle;
+			}
+		}
+		const unsigned int* lengths = (const unsigned int*)(catalog->mapping + catalog->header->lengths_offset);
+		size_t count = 0;
+		for(size_t i=first; i < catalog->header->number_of_records; i++, count++){
+			const catalog_record& record = catalog->records[i];
+			if(strcmp(catalog_string(catalog, record.name), name)){
+				break;
+			}
+			if(count < max_entries){
+				catalog_entry& entry = entries[count];
+				entry.name = catalog_string(catalog, record.name);
+				entry.path = catalog_string(catalog, catalog->files[record.file].path);
+				entry.tensor_idx = record.tensor_idx;
+				entry.rank = record.rank;
+				entry.lengths = lengths + record.lengths;
+				entry.type = catalog_type(catalog, record);
+				entry.compression = (CompressionType)record.compression;
+				entry.layout = record.layout;
+				entry.descriptor_offset = record.descriptor_offset;
+				entry.data_offset = record.data_offset;
+				entry.data_size = record.data_size;
+			}
+		}
+		return count;
+	}
+
+	/** Reads the descriptors of an archive's tensors into pending records. */
+	static void scan_archive(const char* path, uint32_t file_idx, std::vector<pending_record*>& pending){
+		FILE* file = fopen(path, "rb");
+		if(!file){
+			return;
+		}
+		darx archive;
+		memset(&archive, 0, sizeof(darx));
+		if(!is_darx(file) || load_image_from(archive, file, LOAD_LAZY) != SUCCESS){
+DARX_TRACE("# catalog : skipping " << path);
+			fclose(file);
+			return;
+		}
+DARX_TRACE("# catalog : scanned " << path << " (" << archive.number_of_tensors << " tensors)");
+		for(uint32_t tensor_idx=0; tensor_idx < archive.number_of_tensors; tensor_idx++){
+			datatensor& tensor = archive.tensors[tensor_idx];
+			std::string type;
+			if(append_type_key(tensor.type, type)){
+				pending_record* entry = new pending_record;
+				entry->name = tensor.name ? tensor.name : "";
+				entry->type = type;
+				entry->lengths.assign(tensor.lengths, tensor.lengths + tensor.rank);
+				memset(&entry->record, 0, sizeof(catalog_record));
+				entry->record.descriptor_offset = tensor.descriptor_offset;
+				entry->record.data_offset = tensor.data_offset;
+				entry->record.data_size = tensor.data_size;
+				entry->record.file = file_idx;
+				entry->record.tensor_idx = tensor_idx;
+				entry->record.rank = tensor.rank;
+				entry->record.compression = tensor.compression;
+				entry->record.layout = (tensor.tile_lengths ? LAYOUT_TILED : 0) |
+					(tensor.columnar ? LAYOUT_COLUMNAR : 0) | (tensor.bit_packed ? LAYOUT_BITPACKED : 0) |
+					(tensor.filters ? LAYOUT_FILTERED : 0);
+				pending.push_back(entry);
+			}
+		}
+		release_image(archive);
+		fclose(file);
+	}
+
+	/** Copies an old catalog's records of an archive into pending records. */
+	static void reuse_records(darx_catalog* catalog, uint32_t old_file_idx, uint32_t file_idx, std::vector<pending_record*>& pending){
+		const unsigned int* lengths = (const unsigned int*)(catalog->mapping + catalog->header->lengths_offset);
+		const uint8_t* types = catalog->mapping + catalog->header->types_offset;
+		for(uint64_t i=0; i < catalog->header->number_of_records; i++){
+			const catalog_record& record = catalog->records[i];
+			if(record.file != old_file_idx){
+				continue;
+			}
+			pending_record* entry = new pending_record;
+			entry->name = catalog_string(catalog, record.name);
+			entry->type.assign((const char*)types + record.type, record.type_size);
+			entry->lengths.assign(lengths + record.lengths, lengths + record.lengths + record.rank);
+			entry->record = record;
+			entry->record.file = file_idx;
+			pending.push_back(entry);
+		}
+	}
+
+	bool build_catalog(const char* catalog_path, const char* const* archive_paths, size_t number_of_archives){
+		darx_catalog* old_catalog = open_catalog(catalog_path);
+		std::map<std::string, uint32_t> old_files;
+		for(uint32_t i=0; old_catalog && i < old_catalog->header->number_of_files; i++){
+			old_files[catalog_string(old_catalog, old_catalog->files[i].path)] = i;
+		}
+		std::vector<catalog_file> files;
+		std::vector<pending_record*> pending;
+		std::string strings;
+		size_t rescanned = 0;
+		for(size_t i=0; i < number_of_archives; i++){
+			struct stat file_stat;
+			if(stat(archive_paths[i], &file_stat) || !S_ISREG(file_stat.st_mode)){
+				continue;
+			}
+			catalog_file file;
+			file.path = strings.size();
+			file.size = file_stat.st_size;
+			file.mtime_sec = file_stat.st_mtim.tv_sec;
+			file.mtime_nsec = file_stat.st_mtim.tv_nsec;
+			strings.append(archive_paths[i], strlen(archive_paths[i]) + 1);
+			uint32_t file_idx = files.size();
+			files.push_back(file);
+			// archives that did not change are not read again.
+			std::map<std::string, uint32_t>::iterator old = old_files.find(archive_paths[i]);
+			if(old != old_files.end()){
+				const catalog_file& old_file = old_catalog->files[old->second];
+				if(old_file.size == file.size && old_file.mtime_sec == file.mtime_sec && old_file.mtime_nsec == file.mtime_nsec){
+					reuse_records(old_catalog, old->second, file_idx, pending);
+					continue;
+				}
+			}
+			scan_archive(archive_paths[i], file_idx, pending);
+			rescanned++;
+		}
+		close_catalog(old_catalog);
+DARX_TRACE("# catalog : " << rescanned << " of " << files.size() << " archives scanned, " << pending.size() << " tensors.");
+		std::sort(pending.begin(), pending.end(), pending_record_order);
+		// lay out the sections, storing each distinct type once.
+		std::vector<catalog_record> records(pending.size());
+		std::vector<unsigned int> lengths;
+		std::string types;
+		std::map<std::string, uint64_t> type_offsets;
+		for(size_t i=0; i < pending.size(); i++){
+			catalog_record& record = records[i];
+			record = pending[i]->record;
+			record.name = strings.size();
+			strings.append(pending[i]->name.c_str(), pending[i]->name.size() + 1);
+			record.lengths = lengths.size();
+			lengths.insert(lengths.end(), pending[i]->lengths.begin(), pending[i]->lengths.end());
+			std::map<std::string, uint64_t>::iterator type = type_offsets.find(pending[i]->type);
+			if(type == type_offsets.end()){
+				type = type_offsets.insert(std::make_pair(pending[i]->type, (uint64_t)types.size())).first;
+				types.append(pending[i]->type);
+			}
+			record.type = type->second;
+			record.type_size = pending[i]->type.size();
+			delete pending[i];
+		}
+		if(strings.empty()){
+			strings.push_back(0);
+		}
+		catalog_header header;
+		memset(&header, 0, sizeof(catalog_header));
+		memcpy(header.magic, CATALOG_MAGIC, DARX_MAGIC_LEN);
+		header.int_magic = DARX_MAGIC_BE;
+		header.version = CATALOG_VERSION;
+		header.number_of_files = files.size();
+		header.number_of_records = records.size();
+		header.files_offset = align8(sizeof(catalog_header));
+		header.records_offset = align8(header.files_offset + files.size() * sizeof(catalog_file));
+		header.lengths_offset = align8(header.records_offset + records.size() * sizeof(catalog_record));
+		header.types_offset = header.lengths_offset + lengths.size() * sizeof(unsigned int);
+		header.strings_offset = header.types_offset + types.size();
+		header.size = header.strings_offset + strings.size();
+		// the new catalog replaces the old one at once, from a temporary file of its own, so
+		// that concurrent builds of the same catalog do not write to the same file.
+		std::string tmp_path = std::string(catalog_path) + ".XXXXXX";
+		int fd = mkstemp(&tmp_path[0]);
+		if(fd < 0){
+			return false;
+		}
+		// mkstemp() only lets the owner read the file.
+		FILE* file = fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) ? 0 : fdopen(fd, "wb");
+		if(!file){
+			close(fd);
+			unlink(tmp_path.c_str());
+			return false;
+		}
+		static const uint8_t padding[8] = {0};
+		bool success =
+			write_file(&header, sizeof(catalog_header), 1, file) == 1 &&
+			write_file(padding, 1, header.files_offset - sizeof(catalog_header), file) == header.files_offset - sizeof(catalog_header) &&
+			write_file(files.data(), sizeof(catalog_file), files.size(), file) == files.size() &&
+			write_file(padding, 1, header.records_offset - header.files_offset - files.size() * sizeof(catalog_file), file) ==
+				header.records_offset - header.files_offset - files.size() * sizeof(catalog_file) &&
+			write_file(records.data(), sizeof(catalog_record), records.size(), file) == records.size() &&
+			write_file(padding, 1, header.lengths_offset - header.records_offset - records.size() * sizeof(catalog_record), file) ==
+				header.lengths_offset - header.records_offset - records.size() * sizeof(catalog_record) &&
+			write_file(lengths.data(), sizeof(unsigned int), lengths.size(), file) == lengths.size() &&
+			write_file(types.data(), 1, types.size(), file) == types.size() &&
+			write_file(strings.data(), 1, strings.size(), file) == strings.size();
+		success = !fclose(file) && success;
+		if(!success || rename(tmp_path.c_str(), catalog_path)){
+			unlink(tmp_path.c_str());
+			return false;
+		}
+		return true;
+	}
+};
@@ -0,0 +1,213 @@
+/**
+ * @file
+ * Columnar layout of mixed type tensors.
+ * A columnar tensor's data holds one column per field (subtype) of its element type,
+ * each column holding that field of every element, one column after the other.
+ * Scanning a few fields of wide records then only touches those fields' columns.
+ *
+ * Records are transposed to columns (and back) in blocks of elements that fit in
+ * the cpu cache, so that every field of a block is gathered from cached records.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <iostream>
+#include <string.h>
+
+namespace darx{
+	// bytes of records transposed at once, sized to stay in the L1 cache.
+	#define TRANSPOSE_BLOCK_SIZE (16 << 10)
+
+	/** Sizes of the fields of a mixed type, and its element size.
+	 *  Returns false if the type is not a mixed type.
+	 */
+	static bool field_sizes(ElementTypeStruct* type, unsigned int* sizes, unsigned int* elem_size){
+		if(!type || type->type != TYPE_MIXED){
+			return false;
+		}
+		MixedElementTypeStruct* mixedtype = (MixedElementTypeStruct*)type;
+		*elem_size = 0;
+		for(int comp_idx=0; comp_idx < mixedtype->components; comp_idx++){
+			sizes[comp_idx] = element_size(mixedtype->subtypes[comp_idx]);
+			*elem_size += sizes[comp_idx];
+		}
+		return true;
+	}
+
+	static size_t count_elements(datatensor& tensor){
+		size_t count = 1;
+		for(int dim_idx=0; dim_idx < tensor.rank; dim_idx++){
+			count *= tensor.lengths[dim_idx];
+		}
+		return count;
+	}
+
+	/** Copies count values of W bytes between two strided arrays.
+	 *  The fixed width lets the compiler turn each copy into a single load and store.
+	 */
+	template<unsigned int W> static inline void copy_strided(uint8_t* dst, size_t dst_stride, const uint8_t* src, size_t src_stride, size_t count){
+		for(size_t i=0; i < count; i++, dst += dst_stride, src += src_stride){
+			memcpy(dst, src, W);
+		}
+	}
+
+	static void copy_field(uint8_t* dst, size_t dst_stride, const uint8_t* src, size_t src_stride, size_t count, unsigned int width){
+		switch(width){
+			case 1: copy_strided<1>(dst, dst_stride, src, src_stride, count); break;
+			case 2: copy_strided<2>(dst, dst_stride, src, src_stride, count); break;
+			case 4: copy_strided<4>(dst, dst_stride, src, src_stride, count); break;
+			case 8: copy_strided<8>(dst, dst_stride, src, src_stride, count); break;
+			case 16: copy_strided<16>(dst, dst_stride, src, src_stride, count); break;
+			default:
+				for(size_t i=0; i < count; i++, dst += dst_stride, src += src_stride){
+					memcpy(dst, src, width);
+				}
+		}
+	}
+
+	/** Transposes elements between records and columns, in either direction. */
+	static bool transpose(ElementTypeStruct* type, const uint8_t* src, uint8_t* dst, size_t number_of_elements, bool to_columns){
+		unsigned int sizes[256];
+		unsigned int elem_size;
+		if(!field_sizes(type, sizes, &elem_size)){
+			return false;
+		}
+		if(!elem_size){
+			return true;
+		}
+		size_t block = TRANSPOSE_BLOCK_SIZE / elem_size;
+		if(!block){
+			block = 1;
+		}
+		for(size_t first=0; first < number_of_elements; first += block){
+			size_t count = number_of_elements - first < block ? number_of_elements - first : block;
+			size_t column_offset = 0;
+			unsigned int field_offset = 0;
+			for(int comp_idx=0; comp_idx < type->components; comp_idx++){
+				uint8_t* column = (to_columns ? dst : (uint8_t*)src) + column_offset + first * sizes[comp_idx];
+				uint8_t* record = (to_columns ? (uint8_t*)src : dst) + first * elem_size + field_offset;
+				if(to_columns){
+					copy_field(column, sizes[comp_idx], record, elem_size, count, sizes[comp_idx]);
+				} else {
+					copy_field(record, elem_size, column, sizes[comp_idx], count, sizes[comp_idx]);
+				}
+				column_offset += number_of_elements * sizes[comp_idx];
+				field_offset += sizes[comp_idx];
+			}
+		}
+		return true;
+	}
+
+	bool records_to_columns(ElementTypeStruct* type, const void* records, void* columns, size_t number_of_elements){
+		return transpose(type, (const uint8_t*)records, (uint8_t*)columns, number_of_elements, true);
+	}
+
+	bool columns_to_records(ElementTypeStruct* type, const void* columns, void* records, size_t number_of_elements){
+		return transpose(type, (const uint8_t*)columns, (uint8_t*)records, number_of_elements, false);
+	}
+
+	bool set_columnar(datatensor& tensor, bool columnar){
+		unsigned int sizes[256];
+		unsigned int elem_size;
+		if(!tensor.data || !field_sizes(tensor.type, sizes, &elem_size)){
+			return false;
+		}
+		if(tensor.columnar == columnar){
+			return true;
+		}
+		size_t number_of_elements = count_elements(tensor);
+		size_t data_size = number_of_elements * elem_size;
+		uint8_t* copy = new uint8_t[data_size];
+		memcpy(copy, tensor.data, data_size);
+		transpose(tensor.type, copy, (uint8_t*)tensor.data, number_of_elements, columnar);
+		delete[] copy;
+		tensor.columnar = columnar;
+		return true;
+	}
+
+	bool swap_tensor_data(datatensor& tensor, void* data, size_t data_size){
+		if(tensor.bit_packed){
+			// packed values are widened to native integers.
+			return true;
+		}
+		if(tensor.filters & (FILTER_DELTA | FILTER_XOR)){
+			// swapped before the values are restored, see unfilter_tensor_data().
+			return true;
+		}
+		if(!tensor.columnar){
+			return swap_endianness(tensor.type, data, data_size);
+		}
+		// each column holds values of a single field type.
+		MixedElementTypeStruct* mixedtype = (MixedElementTypeStruct*)tensor.type;
+		size_t number_of_elements = count_elements(tensor);
+		uint8_t* column = (uint8_t*)data;
+		bool swapped = true;
+		for(int comp_idx=0; comp_idx < mixedtype->components; comp_idx++){
+			size_t column_size = number_of_elements * element_size(mixedtype->subtypes[comp_idx]);
+			swapped = swap_endianness(mixedtype->subtypes[comp_idx], column, column_size) && swapped;
+			column += column_size;
+		}
+		return swapped;
+	}
+
+	ErrorCode read_tensor_field(darx& darx, int tensor_idx, int field, void* buffer){
+		if(!darx.valid || tensor_idx < 0 || (uint32_t)tensor_idx >= darx.number_of_tensors){
+			return INVALID_STRUCT;
+		}
+		stats_scope scope(&darx.stats);
+		datatensor& tensor = darx.tensors[tensor_idx];
+		unsigned int sizes[256];
+		unsigned int elem_size;
+		if(!field_sizes(tensor.type, sizes, &elem_size)){
+			return UNSUPPORTED_ELEMENT_TYPE;
+		}
+		if(field < 0 || field >= tensor.type->components){
+			return INVALID_STRUCT;
+		}
+		size_t number_of_elements = count_elements(tensor);
+		size_t column_offset = 0;
+		unsigned int field_offset = 0;
+		for(int comp_idx=0; comp_idx < field; comp_idx++){
+			column_offset += number_of_elements * sizes[comp_idx];
+			field_offset += sizes[comp_idx];
+		}
+		size_t column_size = number_of_elements * sizes[field];
+		if(!tensor.data && tensor.columnar && tensor.compression == UNCOMPRESSED && !tensor.filters){
+			// only the field's column is read.
+DARX_TRACE("# reading tensor["<<tensor_idx<<"] field " << field << " @ file pos : " << (tensor.data_offset + column_offset));
+			if(column_offset + column_size > tensor.data_size){
+				return INVALID_STRUCT;
+			}
+			bool is_temp = false;
+			uint8_t* column = read_stored_data(darx, tensor, column_offset, column_size, &is_temp);
+			if(!column){
+				return INVALID_STRUCT;
+			}
+			memcpy(buffer, column, column_size);
+			if(is_temp){
+				delete[] column;
+			}
+			if(needs_swap(darx)){
+				MixedElementTypeStruct* mixedtype = (MixedElementTypeStruct*)tensor.type;
+				uint64_t start = stats_clock();
+				bool swapped = swap_endianness(mixedtype->subtypes[field], buffer, column_size);
+				count_stat(&io_stats::swap_time, stats_clock() - start);
+				if(!swapped){
+					return UNSUPPORTED_ELEMENT_TYPE;
+				}
+			}
+			return SUCCESS;
+		}
+		if(!tensor.data){
+			ErrorCode result = load_tensor(darx, tensor_idx);
+			if(result != SUCCESS){
+				return result;
+			}
+		}
+		if(tensor.columnar){
+			memcpy(buffer, (uint8_t*)tensor.data + column_offset, column_size);
+		} else {
+			copy_field((uint8_t*)buffer, sizes[field], (uint8_t*)tensor.data + field_offset, elem_size, number_of_elements, sizes[field]);
+		}
+		return SUCCESS;
+	}
+};
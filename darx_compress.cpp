@@ -0,0 +1,479 @@
+/**
+ * @file
+ * Tensor data compression for darx data archives.
+ * Compressed tensor data is stored as a sequence of independently compressed
+ * fixed-size blocks, preceded by a block offset table, so that the blocks of
+ * a large tensor can be compressed and decompressed on several threads.
+ *
+ * Layout of the stored (compressed) data of a tensor:
+ *   unsigned int raw_size         - size of the uncompressed data
+ *   unsigned int block_size       - size of each uncompressed block (the last one may be shorter)
+ *   unsigned int number_of_blocks
+ *   unsigned int block_offsets[number_of_blocks+1] - offsets of each compressed block,
+ *                                  relative to the end of this table.
+ *   compressed blocks...
+ * A block whose stored size equals its uncompressed size is stored as is.
+ * The table's unsigned ints limit compressed tensors to 4 GiB, in every format version.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "darx.h"
+#include "darx_private.h"
+#include "darx_parallel.h"
+#include <iostream>
+#include <string.h>
+#include <atomic>
+#include <limits.h>
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#define DARX_HAVE_DEFLATE 1
+#endif
+
+namespace darx{
+	unsigned int COMPRESSION_BLOCK_SIZE = 1 << 20;
+
+	// number of unsigned ints in the compressed data header, before the offset table.
+	#define CDATA_HEADER_INTS 3
+
+	/**
+	 * Minimal implementation of the LZ4 block format.
+	 * The output is compatible with LZ4_decompress_safe().
+	 */
+	#define LZ4_MINMATCH 4
+	#define LZ4_MFLIMIT 12
+	#define LZ4_LASTLITERALS 5
+	#define LZ4_HASH_LOG 16
+	#define LZ4_MAX_DISTANCE 65535
+
+	static inline uint32_t lz4_read32(const uint8_t* p){
+		uint32_t v;
+		memcpy(&v, p, sizeof(uint32_t));
+		return v;
+	}
+
+	static inline uint32_t lz4_hash(uint32_t sequence){
+		return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+	}
+
+	/** Writes an LZ4 length extension, returns false if there is no room for it. */
+	static inline bool lz4_write_length(uint8_t*& op, const uint8_t* oend, size_t len){
+		for(; len >= 255; len -= 255){
+			if(op >= oend){ return false; }
+			*op++ = 255;
+		}
+		if(op >= oend){ return false; }
+		*op++ = (uint8_t)len;
+		return true;
+	}
+
+	/** Writes an LZ4 sequence (literals, optionally followed by a match).
+	 *  A match_len of 0 means the sequence has no match (last sequence).
+	 */
+	static bool lz4_write_sequence(uint8_t*& op, const uint8_t* oend,
+		const uint8_t* literals, size_t lit_len, size_t offset, size_t match_len
+	){
+		if(op >= oend){ return false; }
+		uint8_t* token = op++;
+		*token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+		if(lit_len >= 15 && !lz4_write_length(op, oend, lit_len - 15)){ return false; }
+		if((size_t)(oend - op) < lit_len){ return false; }
+		memcpy(op, literals, lit_len);
+		op += lit_len;
+		if(match_len){
+			if(oend - op < 2){ return false; }
+			*op++ = (uint8_t)(offset & 0xff);
+			*op++ = (uint8_t)(offset >> 8);
+			size_t ml = match_len - LZ4_MINMATCH;
+			*token |= (uint8_t)(ml >= 15 ? 15 : ml);
+			if(ml >= 15 && !lz4_write_length(op, oend, ml - 15)){ return false; }
+		}
+		return true;
+	}
+
+	/** Compresses src into dst, returns the compressed size, or 0 if it does not fit in dst_cap. */
+	static size_t lz4_compress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap){
+		uint8_t* op = dst;
+		const uint8_t* oend = dst + dst_cap;
+		size_t anchor = 0;
+		if(src_len > LZ4_MFLIMIT){
+			uint32_t* table = new uint32_t[1 << LZ4_HASH_LOG];
+			// positions are stored off by one, 0 meaning empty.
+			memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG);
+			size_t match_limit = src_len - LZ4_LASTLITERALS;
+			size_t ip = 0;
+			while(ip + LZ4_MFLIMIT <= src_len){
+				uint32_t sequence = lz4_read32(src + ip);
+				uint32_t h = lz4_hash(sequence);
+				size_t ref = table[h];
+				table[h] = ip + 1;
+				if(!ref || ip - (ref - 1) > LZ4_MAX_DISTANCE || lz4_read32(src + ref - 1) != sequence){
+					ip++;
+					continue;
+				}
+				ref--;
+				size_t match_len = LZ4_MINMATCH;
+				while(ip + match_len < match_limit && src[ref + match_len] == src[ip + match_len]){
+					match_len++;
+				}
+				if(!lz4_write_sequence(op, oend, src + anchor, ip - anchor, ip - ref, match_len)){
+					delete[] table;
+					return 0;
+				}
+				ip += match_len;
+				anchor = ip;
+			}
+			delete[] table;
+		}
+		if(!lz4_write_sequence(op, oend, src + anchor, src_len - anchor, 0, 0)){
+			return 0;
+		}
+		return op - dst;
+	}
+
+	/** Decompresses src into dst, which must be exactly dst_len bytes long.
+	 *  @returns false if the compressed data is malformed.
+	 */
+	static bool lz4_decompress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len){
+		size_t ip = 0, op = 0;
+		while(ip < src_len){
+			uint8_t token = src[ip++];
+			size_t lit_len = token >> 4;
+			if(lit_len == 15){
+				uint8_t b;
+				do {
+					if(ip >= src_len){ return false; }
+					b = src[ip++];
+					lit_len += b;
+				} while(b == 255);
+			}
+			if(lit_len > src_len - ip || lit_len > dst_len - op){ return false; }
+			memcpy(dst + op, src + ip, lit_len);
+			ip += lit_len;
+			op += lit_len;
+			if(ip == src_len){
+				break; // last sequence has no match
+			}
+			if(src_len - ip < 2){ return false; }
+			size_t offset = src[ip] | (src[ip+1] << 8);
+			ip += 2;
+			if(!offset || offset > op){ return false; }
+			size_t match_len = token & 15;
+			if(match_len == 15){
+				uint8_t b;
+				do {
+					if(ip >= src_len){ return false; }
+					b = src[ip++];
+					match_len += b;
+				} while(b == 255);
+			}
+			match_len += LZ4_MINMATCH;
+			if(match_len > dst_len - op){ return false; }
+			// matches may overlap their own output, copy byte by byte.
+			uint8_t* d = dst + op;
+			const uint8_t* s = d - offset;
+			for(size_t i=0; i < match_len; i++){ d[i] = s[i]; }
+			op += match_len;
+		}
+		return op == dst_len;
+	}
+
+	/** Upper bound of the size of a compressed block. */
+	static size_t compress_bound(CompressionType compression, size_t len){
+		switch(compression){
+#ifdef DARX_HAVE_DEFLATE
+			case DEFLATE_COMPRESSED: return compressBound(len);
+#endif
+			case LZ4_COMPRESSED: return len + len / 255 + 16;
+			default: return 0;
+		}
+	}
+
+	/** Compresses a single block, returns its compressed size, or 0 on failure.
+	 */
+	static size_t compress_block(CompressionType compression, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap){
+		switch(compression){
+#ifdef DARX_HAVE_DEFLATE
+			case DEFLATE_COMPRESSED:{
+				uLongf dst_len = dst_cap;
+				if(compress2(dst, &dst_len, src, src_len, Z_DEFAULT_COMPRESSION) != Z_OK){
+					return 0;
+				}
+				return dst_len;
+			}
+#endif
+			case LZ4_COMPRESSED:
+				return lz4_compress(src, src_len, dst, dst_cap);
+			default:
+				return 0;
+		}
+	}
+
+	/** Decompresses a single block, returns false on failure.
+	 */
+	static bool decompress_block(CompressionType compression, const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len){
+		if(src_len == dst_len){
+			// stored as is
+			memcpy(dst, src, dst_len);
+			return true;
+		}
+		switch(compression){
+#ifdef DARX_HAVE_DEFLATE
+			case DEFLATE_COMPRESSED:{
+				uLongf out_len = dst_len;
+				return uncompress(dst, &out_len, src, src_len) == Z_OK && out_len == dst_len;
+			}
+#endif
+			case LZ4_COMPRESSED:
+				return lz4_decompress(src, src_len, dst, dst_len);
+			default:
+				return false;
+		}
+	}
+
+	bool is_compression_supported(CompressionType compression){
+		switch(compression){
+			case UNCOMPRESSED:
+			case LZ4_COMPRESSED:
+				return true;
+#ifdef DARX_HAVE_DEFLATE
+			case DEFLATE_COMPRESSED:
+				return true;
+#endif
+			default:
+				return false;
+		}
+	}
+
+	typedef struct {
+		CompressionType compression;
+		const uint8_t* src;
+		size_t src_len;
+		size_t block_size;
+		// per block scratch buffers (compression) and sizes
+		uint8_t** blocks;
+		size_t* block_lengths;
+		// offset table and data (decompression)
+		const unsigned int* offsets;
+		const uint8_t* cblocks;
+		uint8_t* dst;
+		// receives each decompressed block instead of dst, if set (decompression)
+		block_sink sink;
+		void* sink_context;
+		std::atomic<bool> failed;
+	} block_job;
+
+	static void compress_block_job(void* ctx, unsigned int block_idx){
+		block_job& job = *(block_job*)ctx;
+		size_t begin = block_idx * job.block_size;
+		size_t len = job.src_len - begin < job.block_size ? job.src_len - begin : job.block_size;
+		size_t cap = compress_bound(job.compression, len);
+		uint8_t* block = new uint8_t[cap > len ? cap : len];
+		size_t clen = compress_block(job.compression, job.src + begin, len, block, cap);
+		if(!clen || clen >= len){
+			// incompressible (or failed), store as is
+			memcpy(block, job.src + begin, len);
+			clen = len;
+		}
+		job.blocks[block_idx] = block;
+		job.block_lengths[block_idx] = clen;
+	}
+
+	static void decompress_block_job(void* ctx, unsigned int block_idx){
+		block_job& job = *(block_job*)ctx;
+		size_t begin = block_idx * job.block_size;
+		size_t len = job.src_len - begin < job.block_size ? job.src_len - begin : job.block_size;
+		const uint8_t* cblock = job.cblocks + job.offsets[block_idx];
+		size_t clen = job.offsets[block_idx+1] - job.offsets[block_idx];
+		if(job.sink){
+			if(clen == len){
+				// stored as is, handed over without a copy.
+				job.sink(job.sink_context, begin, cblock, len);
+				return;
+			}
+			uint8_t* block = new uint8_t[len];
+			if(decompress_block(job.compression, cblock, clen, block, len)){
+				job.sink(job.sink_context, begin, block, len);
+			} else {
+				job.failed = true;
+			}
+			delete[] block;
+			return;
+		}
+		if(!decompress_block(job.compression, cblock, clen, job.dst + begin, len)){
+			job.failed = true;
+		}
+	}
+
+	bool compress_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp){
+		CompressionType compression = tensor.compression;
+		if(compression == UNCOMPRESSED){
+DARX_TRACE("#    [no compression] ");
+			(*cdata) = (uint8_t*)tensor.data;
+			(*cdata_len) = tensor.data_size;
+			(*cdata_is_temp) = false;
+			return true;
+		}
+		if(!is_compression_supported(compression) || tensor.data_size > UINT_MAX){
+			// the block table holds unsigned ints.
+			return false;
+		}
+		size_t block_size = COMPRESSION_BLOCK_SIZE ? COMPRESSION_BLOCK_SIZE : tensor.data_size;
+		unsigned int number_of_blocks = block_size ? (tensor.data_size + block_size - 1) / block_size : 0;
+DARX_TRACE("#    [compression " << ((int)compression) << "] blocks : " << number_of_blocks);
+		block_job job;
+		job.compression = compression;
+		job.src = (const uint8_t*)tensor.data;
+		job.src_len = tensor.data_size;
+		job.block_size = block_size;
+		job.blocks = new uint8_t*[number_of_blocks];
+		job.block_lengths = new size_t[number_of_blocks];
+		run_parallel(number_of_blocks, compress_block_job, &job);
+
+		// assemble the header, offset table and blocks
+		size_t table_len = (CDATA_HEADER_INTS + number_of_blocks + 1) * sizeof(unsigned int);
+		size_t total_len = table_len;
+		for(unsigned int i=0; i < number_of_blocks; i++){ total_len += job.block_lengths[i]; }
+		if(total_len - table_len > UINT_MAX){
+			for(unsigned int i=0; i < number_of_blocks; i++){ delete[] job.blocks[i]; }
+			delete[] job.blocks;
+			delete[] job.block_lengths;
+			return false;
+		}
+		uint8_t* out = new uint8_t[total_len];
+		unsigned int* header = (unsigned int*)out;
+		header[0] = tensor.data_size;
+		header[1] = block_size;
+		header[2] = number_of_blocks;
+		unsigned int* offsets = header + CDATA_HEADER_INTS;
+		offsets[0] = 0;
+		for(unsigned int i=0; i < number_of_blocks; i++){
+			offsets[i+1] = offsets[i] + job.block_lengths[i];
+			memcpy(out + table_len + offsets[i], job.blocks[i], job.block_lengths[i]);
+			delete[] job.blocks[i];
+		}
+		delete[] job.blocks;
+		delete[] job.block_lengths;
+		(*cdata) = out;
+		(*cdata_len) = total_len;
+		(*cdata_is_temp) = true;
+		return true;
+	}
+
+	/** Reads the header and block offset table of compressed data into the job.
+	 *  Returns the offset table (to be deleted by the caller), or 0 if it is not valid.
+	 */
+	static unsigned int* read_block_table(const uint8_t* cdata, size_t cdata_len, bool swap, block_job& job, unsigned int* number_of_blocks){
+		if(cdata_len < CDATA_HEADER_INTS * sizeof(unsigned int)){
+			return 0;
+		}
+		unsigned int raw_size = load_stored_uint(cdata, swap);
+		unsigned int block_size = load_stored_uint(cdata + sizeof(unsigned int), swap);
+		(*number_of_blocks) = load_stored_uint(cdata + 2 * sizeof(unsigned int), swap);
+		size_t table_len = (CDATA_HEADER_INTS + (size_t)(*number_of_blocks) + 1) * sizeof(unsigned int);
+		if(table_len > cdata_len || (raw_size && !block_size) ||
+			(block_size && (raw_size + (size_t)block_size - 1) / block_size != (*number_of_blocks))
+		){
+			return 0;
+		}
+		// the offset table may be unaligned in a file mapping, so copy it out.
+		unsigned int* offsets = new unsigned int[(*number_of_blocks) + 1];
+		for(unsigned int i=0; i <= (*number_of_blocks); i++){
+			offsets[i] = load_stored_uint(cdata + (CDATA_HEADER_INTS + i) * sizeof(unsigned int), swap);
+		}
+		for(unsigned int i=0; i < (*number_of_blocks); i++){
+			if(offsets[i] > offsets[i+1]){
+				delete[] offsets;
+				return 0;
+			}
+		}
+		if(offsets[0] != 0 || offsets[*number_of_blocks] > cdata_len - table_len){
+			delete[] offsets;
+			return 0;
+		}
+		job.src_len = raw_size;
+		job.block_size = block_size;
+		job.offsets = offsets;
+		job.cblocks = cdata + table_len;
+		return offsets;
+	}
+
+	unsigned int compressed_block_size(const uint8_t* cdata, size_t cdata_len, bool swap){
+		if(cdata_len < CDATA_HEADER_INTS * sizeof(unsigned int)){
+			return 0;
+		}
+		return load_stored_uint(cdata + sizeof(unsigned int), swap);
+	}
+
+	bool decompress_blocks(datatensor& tensor, const uint8_t* cdata, size_t cdata_len, bool swap, size_t raw_len,
+		block_sink sink, void* context
+	){
+		if(tensor.compression == UNCOMPRESSED || !is_compression_supported(tensor.compression)){
+			return false;
+		}
+		block_job job;
+		unsigned int number_of_blocks;
+		unsigned int* offsets = read_block_table(cdata, cdata_len, swap, job, &number_of_blocks);
+		if(!offsets){
+			return false;
+		}
+		if(job.src_len != raw_len){
+			delete[] offsets;
+			return false;
+		}
+DARX_TRACE("#    [compression " << ((int)tensor.compression) << "] blocks : " << number_of_blocks << ", to sink");
+		job.compression = tensor.compression;
+		job.dst = 0;
+		job.sink = sink;
+		job.sink_context = context;
+		job.failed = false;
+		run_parallel(number_of_blocks, decompress_block_job, &job);
+		delete[] offsets;
+		return !job.failed;
+	}
+
+	bool decompress_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp, bool swap,
+		uint8_t* out, size_t out_len
+	){
+		CompressionType compression = tensor.compression;
+		if(compression == UNCOMPRESSED){
+DARX_TRACE("#    [no compression] ");
+			tensor.data = (*cdata);
+			tensor.data_size = (*cdata_len);
+			(*cdata_is_temp) = false;
+			return true;
+		}
+		if(!is_compression_supported(compression)){
+			return false;
+		}
+		block_job job;
+		unsigned int number_of_blocks;
+		unsigned int* offsets = read_block_table(*cdata, *cdata_len, swap, job, &number_of_blocks);
+		if(!offsets){
+			return false;
+		}
+		if(out && job.src_len != out_len){
+			delete[] offsets;
+			return false;
+		}
+		size_t raw_size = job.src_len;
+DARX_TRACE("#    [compression " << ((int)compression) << "] blocks : " << number_of_blocks << ", raw size : " << raw_size);
+		uint8_t* data = out ? out : new uint8_t[raw_size];
+		job.compression = compression;
+		job.dst = data;
+		job.sink = 0;
+		job.failed = false;
+		run_parallel(number_of_blocks, decompress_block_job, &job);
+		delete[] offsets;
+		if(job.failed){
+			if(!out){
+				delete[] data;
+			}
+			return false;
+		}
+		tensor.data = data;
+		tensor.data_size = raw_size;
+		(*cdata_is_temp) = true;
+		return true;
+	}
+};
@@ -0,0 +1,299 @@
+/**
+ * @file
+ * Reading tensors converted to another element type, as they are loaded.
+ * Values are converted (and scaled) in the same pass that swaps their endianness and
+ * decompresses them, straight into the caller's buffer: raw tensors are converted from
+ * the file mapping, or from the file in chunks, and compressed ones block by block, as
+ * each block is decompressed. Neither the tensor's data nor a copy of it is allocated.
+ * Tiled, bit-packed and filtered tensors are decoded into a temporary buffer first.
+ *
+ * Each pair of value types, with or without byte swapping and scaling, has its own
+ * conversion loop, chosen once per tensor, for the compiler to vectorize.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include "darx_parallel.h"
+#include <iostream>
+#include <string.h>
+#include <math.h>
+#include <limits>
+
+// number of values converted by each job of a parallel conversion, or each read from the file.
+#define CONVERT_CHUNK_VALUES (64 << 10)
+
+namespace darx{
+
+	/** Converts count values from src (stored) to dst (target type), both unaligned. */
+	typedef void (*convert_fn)(const uint8_t* src, uint8_t* dst, size_t count, double scale, double offset);
+
+	typedef struct {
+		convert_fn convert;
+		const uint8_t* src;
+		uint8_t* dst;
+		size_t src_value_size;
+		size_t dst_value_size;
+		size_t count;
+		double scale;
+		double offset;
+	} convert_job;
+
+	template<typename T, bool Swap> static inline T load_value(const uint8_t* src){
+		uint8_t bytes[sizeof(T)];
+		for(size_t i=0; i < sizeof(T); i++){
+			bytes[i] = src[Swap ? sizeof(T) - 1 - i : i];
+		}
+		T value;
+		memcpy(&value, bytes, sizeof(T));
+		return value;
+	}
+
+	/** Rounds a value to the nearest integer of type T, saturating it to T's range (NaNs give 0). */
+	template<typename T> static inline T from_double(double value){
+		if(!std::numeric_limits<T>::is_integer){
+			return (T)value;
+		}
+		double rounded = round(value);
+		if(rounded != rounded){
+			return 0;
+		}
+		if(rounded <= (double)std::numeric_limits<T>::min()){
+			return std::numeric_limits<T>::min();
+		}
+		if(rounded >= (double)std::numeric_limits<T>::max()){
+			return std::numeric_limits<T>::max();
+		}
+		return (T)rounded;
+	}
+
+	/** Converts a value, without scaling: integers are converted exactly, saturating to Dst's range. */
+	template<typename Src, typename Dst> static inline Dst convert_value(Src value){
+		if(!std::numeric_limits<Dst>::is_integer){
+			return (Dst)value;
+		}
+		if(!std::numeric_limits<Src>::is_integer){
+			return from_double<Dst>(value);
+		}
+		if(std::numeric_limits<Src>::is_signed && value < 0){
+			if(!std::numeric_limits<Dst>::is_signed){
+				return 0;
+			}
+			return (int64_t)value < (int64_t)std::numeric_limits<Dst>::min() ? std::numeric_limits<Dst>::min() : (Dst)value;
+		}
+		return (uint64_t)value > (uint64_t)std::numeric_limits<Dst>::max() ? std::numeric_limits<Dst>::max() : (Dst)value;
+	}
+
+	template<typename Src, typename Dst, bool Swap, bool Scaled>
+	static void convert_values(const uint8_t* src, uint8_t* dst, size_t count, double scale, double offset){
+		for(size_t i=0; i < count; i++){
+			Src value = load_value<Src, Swap>(src + i * sizeof(Src));
+			Dst result = Scaled ? from_double<Dst>(value * scale + offset) : convert_value<Src, Dst>(value);
+			memcpy(dst + i * sizeof(Dst), &result, sizeof(Dst));
+		}
+	}
+
+	template<typename Src, typename Dst> static convert_fn select_variant(bool swap, bool scaled){
+		if(swap){
+			return scaled ? convert_values<Src, Dst, true, true> : convert_values<Src, Dst, true, false>;
+		}
+		return scaled ? convert_values<Src, Dst, false, true> : convert_values<Src, Dst, false, false>;
+	}
+
+	/** Kinds of values conversions are defined for. */
+	enum value_kind{
+		KIND_INT8, KIND_INT16, KIND_INT32, KIND_INT64,
+		KIND_UINT8, KIND_UINT16, KIND_UINT32, KIND_UINT64,
+		KIND_FLOAT32, KIND_FLOAT64,
+		KIND_UNSUPPORTED
+	};
+
+	/** Kind of the values of a type, as held in memory, and their size. */
+	static value_kind kind_of(ElementTypeStruct* type, size_t* size){
+		if(!type || !type->components){
+			return KIND_UNSUPPORTED;
+		}
+		switch(type->type){
+			case TYPE_INT: case TYPE_UINT:{
+				if(!type->bit_width || type->bit_width > 64){
+					return KIND_UNSUPPORTED;
+				}
+				(*size) = value_size(type->bit_width);
+				int log2_size = (*size) == 1 ? 0 : (*size) == 2 ? 1 : (*size) == 4 ? 2 : 3;
+				return (value_kind)((type->type == TYPE_INT ? KIND_INT8 : KIND_UINT8) + log2_size);
+			}
+			case TYPE_FLOAT:
+				(*size) = type->bit_width / 8;
+				return type->bit_width == 32 ? KIND_FLOAT32 : type->bit_width == 64 ? KIND_FLOAT64 : KIND_UNSUPPORTED;
+			default:
+				return KIND_UNSUPPORTED;
+		}
+	}
+
+	template<typename Src> static convert_fn select_target(value_kind target, bool swap, bool scaled){
+		switch(target){
+			case KIND_INT8:    return select_variant<Src, int8_t>(swap, scaled);
+			case KIND_INT16:   return select_variant<Src, int16_t>(swap, scaled);
+			case KIND_INT32:   return select_variant<Src, int32_t>(swap, scaled);
+			case KIND_INT64:   return select_variant<Src, int64_t>(swap, scaled);
+			case KIND_UINT8:   return select_variant<Src, uint8_t>(swap, scaled);
+			case KIND_UINT16:  return select_variant<Src, uint16_t>(swap, scaled);
+			case KIND_UINT32:  return select_variant<Src, uint32_t>(swap, scaled);
+			case KIND_UINT64:  return select_variant<Src, uint64_t>(swap, scaled);
+			case KIND_FLOAT32: return select_variant<Src, float>(swap, scaled);
+			case KIND_FLOAT64: return select_variant<Src, double>(swap, scaled);
+			default: return 0;
+		}
+	}
+
+	static convert_fn select_converter(value_kind source, value_kind target, bool swap, bool scaled){
+		switch(source){
+			case KIND_INT8:    return select_target<int8_t>(target, swap, scaled);
+			case KIND_INT16:   return select_target<int16_t>(target, swap, scaled);
+			case KIND_INT32:   return select_target<int32_t>(target, swap, scaled);
+			case KIND_INT64:   return select_target<int64_t>(target, swap, scaled);
+			case KIND_UINT8:   return select_target<uint8_t>(target, swap, scaled);
+			case KIND_UINT16:  return select_target<uint16_t>(target, swap, scaled);
+			case KIND_UINT32:  return select_target<uint32_t>(target, swap, scaled);
+			case KIND_UINT64:  return select_target<uint64_t>(target, swap, scaled);
+			case KIND_FLOAT32: return select_target<float>(target, swap, scaled);
+			case KIND_FLOAT64: return select_target<double>(target, swap, scaled);
+			default: return 0;
+		}
+	}
+
+	/** Converts a chunk of the job's values. */
+	static void convert_chunk_job(void* ctx, unsigned int chunk_idx){
+		convert_job& job = *(convert_job*)ctx;
+		size_t first = (size_t)chunk_idx * CONVERT_CHUNK_VALUES;
+		size_t count = job.count - first < CONVERT_CHUNK_VALUES ? job.count - first : CONVERT_CHUNK_VALUES;
+		job.convert(job.src + first * job.src_value_size, job.dst + first * job.dst_value_size, count, job.scale, job.offset);
+	}
+
+	/** Converts the values of a decompressed block (see decompress_blocks()). */
+	static void convert_block(void* ctx, size_t offset, const uint8_t* data, size_t len){
+		convert_job& job = *(convert_job*)ctx;
+		job.convert(data, job.dst + offset / job.src_value_size * job.dst_value_size, len / job.src_value_size, job.scale, job.offset);
+	}
+
+	/** Converts all of the job's values, from its source, on several threads. */
+	static void convert_all(convert_job& job){
+		run_parallel((job.count + CONVERT_CHUNK_VALUES - 1) / CONVERT_CHUNK_VALUES, convert_chunk_job, &job);
+	}
+
+	/** Converts a tensor's values stored raw, from the file mapping or from the file, a chunk at a time. */
+	static ErrorCode convert_raw_data(darx& darx, datatensor& tensor, convert_job& job){
+		if(tensor.data_size != job.count * job.src_value_size){
+			return INVALID_STRUCT;
+		}
+		if(darx.mapping){
+			bool is_temp = false;
+			job.src = read_stored_data(darx, tensor, 0, tensor.data_size, &is_temp);
+			if(!job.src){
+				return INVALID_STRUCT;
+			}
+			convert_all(job);
+			return SUCCESS;
+		}
+		uint8_t* dst = job.dst;
+		for(size_t first=0; first < job.count; first += CONVERT_CHUNK_VALUES){
+			size_t count = job.count - first < CONVERT_CHUNK_VALUES ? job.count - first : CONVERT_CHUNK_VALUES;
+			bool is_temp = false;
+			uint8_t* chunk = read_stored_data(darx, tensor, first * job.src_value_size, count * job.src_value_size, &is_temp);
+			if(!chunk){
+				return INVALID_STRUCT;
+			}
+			job.convert(chunk, dst + first * job.dst_value_size, count, job.scale, job.offset);
+			if(is_temp){
+				delete[] chunk;
+			}
+		}
+		return SUCCESS;
+	}
+
+	/** Decodes a tensor's stored data into a temporary buffer, and converts it with convert,
+	 *  a converter of values in this system's endianness.
+	 */
+	static ErrorCode convert_decoded_data(darx& darx, datatensor& tensor, uint8_t* cdata, convert_job& job, convert_fn convert){
+		// decoding sets the data of the tensor it is given, so a copy is decoded.
+		datatensor decoded = tensor;
+		size_t cdata_length = tensor.data_size;
+		bool cdata_is_temp = false;
+		bool swap = needs_swap(darx);
+		size_t data_size = job.count * job.src_value_size;
+		uint8_t* data = new uint8_t[data_size];
+		uint64_t start = stats_clock();
+		bool decoded_ok = decode_tensor_data(decoded, &cdata, &cdata_length, &cdata_is_temp, swap, data, data_size);
+		count_stat(&io_stats::decompress_time, stats_clock() - start);
+		ErrorCode result = decoded_ok ? SUCCESS : UNSUPPORTED_COMPRESS_TYPE;
+		if(decoded_ok && swap && !swap_tensor_data(decoded, decoded.data, decoded.data_size)){
+			result = UNSUPPORTED_ELEMENT_TYPE;
+		}
+		if(result == SUCCESS){
+			job.convert = convert;
+			job.src = (const uint8_t*)decoded.data;
+			convert_all(job);
+		}
+		delete[] data;
+		return result;
+	}
+
+	ErrorCode read_tensor_converted(darx& darx, int tensor_idx, ElementTypeStruct* type, void* buffer, double scale, double offset){
+		if(!darx.valid || tensor_idx < 0 || (uint32_t)tensor_idx >= darx.number_of_tensors || !buffer){
+			return INVALID_STRUCT;
+		}
+		stats_scope scope(&darx.stats);
+		datatensor& tensor = darx.tensors[tensor_idx];
+		convert_job job;
+		value_kind source = kind_of(tensor.type, &job.src_value_size);
+		value_kind target = kind_of(type, &job.dst_value_size);
+		if(source == KIND_UNSUPPORTED || target == KIND_UNSUPPORTED || tensor.type->components != type->components){
+			return UNSUPPORTED_ELEMENT_TYPE;
+		}
+		job.count = tensor.type->components;
+		for(int dim_idx=0; dim_idx < tensor.rank; dim_idx++){
+			job.count *= tensor.lengths[dim_idx];
+		}
+		job.dst = (uint8_t*)buffer;
+		job.scale = scale;
+		job.offset = offset;
+		bool scaled = scale != 1.0 || offset != 0.0;
+		if(tensor.data){
+DARX_TRACE("# converting tensor["<<tensor_idx<<"] from its data");
+			job.convert = select_converter(source, target, false, scaled);
+			job.src = (const uint8_t*)tensor.data;
+			convert_all(job);
+			return SUCCESS;
+		}
+		bool swap = needs_swap(darx);
+		job.convert = select_converter(source, target, swap, scaled);
+		if(is_stored_raw(tensor)){
+DARX_TRACE("# converting tensor["<<tensor_idx<<"] from its stored data @ file pos : " << tensor.data_offset);
+			return convert_raw_data(darx, tensor, job);
+		}
+		bool is_temp = false;
+		uint8_t* cdata = read_stored_data(darx, tensor, 0, tensor.data_size, &is_temp);
+		if(!cdata){
+			return INVALID_STRUCT;
+		}
+		ErrorCode result;
+		unsigned int block_size = compressed_block_size(cdata, tensor.data_size, swap);
+		if(!tensor.tile_lengths && !tensor.bit_packed && !tensor.filters && block_size && block_size % job.src_value_size == 0){
+			// each block is converted as it is decompressed.
+DARX_TRACE("# converting tensor["<<tensor_idx<<"] block by block @ file pos : " << tensor.data_offset);
+			uint64_t start = stats_clock();
+			bool decompressed = decompress_blocks(tensor, cdata, tensor.data_size, swap, job.count * job.src_value_size, convert_block, &job);
+			count_stat(&io_stats::decompress_time, stats_clock() - start);
+			result = decompressed ? SUCCESS : UNSUPPORTED_COMPRESS_TYPE;
+		} else {
+DARX_TRACE("# converting tensor["<<tensor_idx<<"] once decoded @ file pos : " << tensor.data_offset);
+			result = convert_decoded_data(darx, tensor, cdata, job, select_converter(source, target, false, scaled));
+		}
+		if(is_temp){
+			delete[] cdata;
+		}
+		return result;
+	}
+
+	ErrorCode read_tensor_converted(darx& darx, int tensor_idx, ElementTypeStruct* type, void* buffer){
+		return read_tensor_converted(darx, tensor_idx, type, buffer, 1.0, 0.0);
+	}
+};
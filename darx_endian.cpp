@@ -0,0 +1,191 @@
+/**
+ * @file
+ * Byte order conversion of tensor data, driven by the tensors' element types.
+ * Elements whose size divides 16 bytes are converted with byte shuffles
+ * (SSSE3/AVX2, when the cpu supports them), others with a scalar loop.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <string.h>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define DARX_X86_SIMD 1
+#endif
+
+namespace darx{
+
+	/** Appends the fields of the given type to the swap plan, returns false if
+	 *  the type can not be swapped (custom types, non byte sized values).
+	 */
+	static bool build_swap_plan(ElementTypeStruct* type, swap_field* plan, int& fields, int max_fields, unsigned int& offset){
+		switch(type->type){
+			case TYPE_INT: case TYPE_UINT: case TYPE_FLOAT: case TYPE_CHAR:{
+				bool is_integer = type->type == TYPE_INT || type->type == TYPE_UINT;
+				if(type->bit_width % 8 && !is_integer){
+					return false;
+				}
+				// integers of other bit widths are held in native integers.
+				uint8_t width = is_integer ? value_size(type->bit_width) : type->bit_width / 8;
+				if(width > 1){
+					if(fields == max_fields){ return false; }
+					swap_field& field = plan[fields++];
+					field.offset = offset;
+					field.width = width;
+					field.count = type->components;
+				}
+				offset += width * type->components;
+				return true;
+			}
+			case TYPE_MIXED:{
+				MixedElementTypeStruct* mixedtype = (MixedElementTypeStruct*)type;
+				for(int comp_idx=0; comp_idx < mixedtype->components; comp_idx++){
+					if(!build_swap_plan(mixedtype->subtypes[comp_idx], plan, fields, max_fields, offset)){
+						return false;
+					}
+				}
+				return true;
+			}
+			default:
+				return false;
+		}
+	}
+
+	static inline void swap_value(uint8_t* p, uint8_t width){
+		switch(width){
+			case 2:{ uint16_t v; memcpy(&v, p, 2); v = __builtin_bswap16(v); memcpy(p, &v, 2); } break;
+			case 4:{ uint32_t v; memcpy(&v, p, 4); v = __builtin_bswap32(v); memcpy(p, &v, 4); } break;
+			case 8:{ uint64_t v; memcpy(&v, p, 8); v = __builtin_bswap64(v); memcpy(p, &v, 8); } break;
+			default:
+				for(int i=0, j=width-1; i < j; i++, j--){
+					uint8_t t = p[i]; p[i] = p[j]; p[j] = t;
+				}
+		}
+	}
+
+	/** Swaps elements one by one, following the plan. */
+	static void swap_scalar(uint8_t* data, size_t number_of_elements, unsigned int elem_size, const swap_field* plan, int fields){
+		for(size_t e=0; e < number_of_elements; e++, data += elem_size){
+			for(int f=0; f < fields; f++){
+				uint8_t* p = data + plan[f].offset;
+				for(unsigned int c=0; c < plan[f].count; c++, p += plan[f].width){
+					swap_value(p, plan[f].width);
+				}
+			}
+		}
+	}
+
+#ifdef DARX_X86_SIMD
+	__attribute__((target("ssse3")))
+	static size_t swap_ssse3(uint8_t* data, size_t len, const uint8_t* mask16){
+		__m128i mask = _mm_loadu_si128((const __m128i*)mask16);
+		size_t i = 0;
+		for(; i + 16 <= len; i += 16){
+			__m128i v = _mm_loadu_si128((__m128i*)(data + i));
+			_mm_storeu_si128((__m128i*)(data + i), _mm_shuffle_epi8(v, mask));
+		}
+		return i;
+	}
+
+	__attribute__((target("avx2")))
+	static size_t swap_avx2(uint8_t* data, size_t len, const uint8_t* mask16){
+		__m128i half = _mm_loadu_si128((const __m128i*)mask16);
+		__m256i mask = _mm256_broadcastsi128_si256(half);
+		size_t i = 0;
+		for(; i + 64 <= len; i += 64){
+			__m256i v0 = _mm256_loadu_si256((__m256i*)(data + i));
+			__m256i v1 = _mm256_loadu_si256((__m256i*)(data + i + 32));
+			_mm256_storeu_si256((__m256i*)(data + i), _mm256_shuffle_epi8(v0, mask));
+			_mm256_storeu_si256((__m256i*)(data + i + 32), _mm256_shuffle_epi8(v1, mask));
+		}
+		for(; i + 32 <= len; i += 32){
+			__m256i v = _mm256_loadu_si256((__m256i*)(data + i));
+			_mm256_storeu_si256((__m256i*)(data + i), _mm256_shuffle_epi8(v, mask));
+		}
+		return i;
+	}
+#endif
+
+	/** Builds the byte shuffle swapping 16 bytes worth of elements, if elements fill them exactly. */
+	static bool build_swap_mask(unsigned int elem_size, const swap_field* plan, int fields, uint8_t* mask){
+		if(!elem_size || 16 % elem_size){
+			return false;
+		}
+		for(int i=0; i < 16; i++){ mask[i] = i; }
+		for(unsigned int base=0; base < 16; base += elem_size){
+			for(int f=0; f < fields; f++){
+				for(unsigned int c=0; c < plan[f].count; c++){
+					unsigned int pos = base + plan[f].offset + c * plan[f].width;
+					for(int b=0; b < plan[f].width; b++){
+						mask[pos + b] = pos + plan[f].width - 1 - b;
+					}
+				}
+			}
+		}
+		return true;
+	}
+
+	/** Swaps whole 16 byte groups of elements with the byte shuffle, if the cpu supports it.
+	 *  Returns the number of bytes swapped.
+	 */
+	static size_t swap_vector(uint8_t* data, size_t len, const uint8_t* mask){
+#ifdef DARX_X86_SIMD
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")){
+			size_t done = swap_avx2(data, len, mask);
+			return done + swap_ssse3(data + done, len - done, mask);
+		}
+		if(__builtin_cpu_supports("ssse3")){
+			return swap_ssse3(data, len, mask);
+		}
+#endif
+		return 0;
+	}
+
+	void plan_swap(ElementTypeStruct* type, element_layout* layout){
+		swap_field plan[64];
+		int fields = 0;
+		unsigned int elem_size = 0;
+		layout->swappable = build_swap_plan(type, plan, fields, 64, elem_size) && elem_size == layout->size;
+		layout->swap_fields = layout->swappable ? fields : 0;
+		layout->swap_plan = 0;
+		if(layout->swap_fields){
+			layout->swap_plan = new swap_field[fields];
+			memcpy(layout->swap_plan, plan, fields * sizeof(swap_field));
+		}
+		layout->vector_swap = layout->swap_fields && build_swap_mask(elem_size, plan, fields, layout->swap_mask);
+	}
+
+	bool swap_endianness(ElementTypeStruct* type, void* data, size_t data_size){
+		swap_field plan[64];
+		int fields = 0;
+		unsigned int elem_size = 0;
+		const swap_field* swap_plan = plan;
+		uint8_t mask[16];
+		const uint8_t* swap_mask = mask;
+		if(type && type->layout){
+			// interned types have their plan ready.
+			const element_layout* layout = type->layout;
+			if(!layout->swappable){
+				return false;
+			}
+			swap_plan = layout->swap_plan;
+			fields = layout->swap_fields;
+			elem_size = layout->size;
+			swap_mask = layout->vector_swap ? layout->swap_mask : 0;
+		} else if(!type || !build_swap_plan(type, plan, fields, 64, elem_size)){
+			return false;
+		} else if(!fields || !build_swap_mask(elem_size, plan, fields, mask)){
+			swap_mask = 0;
+		}
+		if(!elem_size || data_size % elem_size){
+			return false;
+		}
+		if(!fields){
+			return true; // nothing to swap (single byte values)
+		}
+		uint8_t* bytes = (uint8_t*)data;
+		size_t done = swap_mask ? swap_vector(bytes, data_size, swap_mask) : 0;
+		swap_scalar(bytes + done, (data_size - done) / elem_size, elem_size, swap_plan, fields);
+		return true;
+	}
+};
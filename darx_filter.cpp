@@ -0,0 +1,389 @@
+/**
+ * @file
+ * Filters transforming tensor data before it is compressed (see FilterType).
+ * Value filters replace each value by its difference (FILTER_DELTA) or XOR
+ * (FILTER_XOR) with the same component of the previous element, the first element
+ * being kept as is. Shuffles then split the values into planes of bytes (or bits)
+ * of the same significance, stored one after the other:
+ *   FILTER_SHUFFLE    - plane b holds byte b of every value.
+ *   FILTER_BITSHUFFLE - each byte plane holds 8 bit planes, bit plane k holding bit k
+ *                       of every byte of the plane, least significant bit first, for
+ *                       a multiple of 8 values. The bytes of the last values are kept.
+ * Filtered data is stored with the byte order of the system that wrote it.
+ *
+ * Shuffles and prefix sums are vectorized with SSE2/SSSE3 (when the cpu supports it),
+ * the other loops are left for the compiler to vectorize.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <iostream>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define DARX_X86_SIMD 1
+#endif
+
+namespace darx{
+
+	/** Size, in bytes, of the values shuffled by the filters for the given type. */
+	static unsigned int filter_value_size(ElementTypeStruct* type){
+		switch(type->type){
+			case TYPE_INT: case TYPE_UINT:
+				return value_size(type->bit_width);
+			case TYPE_FLOAT: case TYPE_CHAR:
+				if(!(type->bit_width % 8)){
+					return type->bit_width / 8;
+				}
+				return element_size(type);
+			default:
+				// whole elements
+				return element_size(type);
+		}
+	}
+
+	bool can_filter(datatensor& tensor){
+		uint8_t filters = tensor.filters;
+		if(!filters){
+			return true;
+		}
+		ElementTypeStruct* type = tensor.type;
+		if(!type || !element_size(type) || tensor.tile_lengths || tensor.bit_packed ||
+			(filters & ~(FILTER_SHUFFLE | FILTER_BITSHUFFLE | FILTER_DELTA | FILTER_XOR)) ||
+			((filters & FILTER_SHUFFLE) && (filters & FILTER_BITSHUFFLE))
+		){
+			return false;
+		}
+		unsigned int size = filter_value_size(type);
+		if((filters & FILTER_DELTA) &&
+			((type->type != TYPE_INT && type->type != TYPE_UINT) || (size != 1 && size != 2 && size != 4 && size != 8))
+		){
+			return false;
+		}
+		if((filters & FILTER_XOR) && (type->type != TYPE_FLOAT || (size != 4 && size != 8))){
+			return false;
+		}
+		return true;
+	}
+
+	static size_t filtered_data_size(datatensor& tensor){
+		size_t size = element_size(tensor.type);
+		for(int dim_idx=0; dim_idx < tensor.rank; dim_idx++){
+			size *= tensor.lengths[dim_idx];
+		}
+		return size;
+	}
+
+	/** Applies a value filter from in to out, count values of type T, stride values apart. */
+	template<typename T, bool XOR> static void encode_values(const uint8_t* in, uint8_t* out, size_t count, size_t stride){
+		size_t first = count < stride ? count : stride;
+		memcpy(out, in, first * sizeof(T));
+		for(size_t i=first; i < count; i++){
+			T value, previous;
+			memcpy(&value, in + i * sizeof(T), sizeof(T));
+			memcpy(&previous, in + (i - stride) * sizeof(T), sizeof(T));
+			value = XOR ? (T)(value ^ previous) : (T)(value - previous);
+			memcpy(out + i * sizeof(T), &value, sizeof(T));
+		}
+	}
+
+	/** Undoes a value filter in place (a running sum, or XOR, of every stride'th value),
+	 *  from value first on.
+	 */
+	template<typename T, bool XOR> static void decode_values(uint8_t* data, size_t first, size_t count, size_t stride){
+		for(size_t i=(first > stride ? first : stride); i < count; i++){
+			T value, previous;
+			memcpy(&value, data + i * sizeof(T), sizeof(T));
+			memcpy(&previous, data + (i - stride) * sizeof(T), sizeof(T));
+			value = XOR ? (T)(value ^ previous) : (T)(value + previous);
+			memcpy(data + i * sizeof(T), &value, sizeof(T));
+		}
+	}
+
+#ifdef DARX_X86_SIMD
+	template<unsigned int W, bool XOR> static inline __m128i combine(__m128i a, __m128i b){
+		return XOR ? _mm_xor_si128(a, b) : W == 4 ? _mm_add_epi32(a, b) : _mm_add_epi64(a, b);
+	}
+
+	/** Undoes a value filter in place, 16 bytes at a time, for elements of LANE bytes
+	 *  (4 or 8) made of values of W bytes. Each vector is scanned in log2(16/LANE) steps,
+	 *  then combined with the last element of the previous one.
+	 *  Returns the number of values decoded.
+	 */
+	template<unsigned int W, unsigned int LANE, bool XOR> static size_t decode_values_sse2(uint8_t* data, size_t count){
+		__m128i carry = _mm_setzero_si128();
+		size_t i = 0;
+		for(; (i + 16 / W) <= count; i += 16 / W){
+			__m128i x = _mm_loadu_si128((const __m128i*)(data + i * W));
+			x = combine<W, XOR>(x, _mm_slli_si128(x, LANE));
+			if(LANE == 4){
+				x = combine<W, XOR>(x, _mm_slli_si128(x, 2 * LANE));
+			}
+			x = combine<W, XOR>(x, carry);
+			_mm_storeu_si128((__m128i*)(data + i * W), x);
+			carry = LANE == 4 ? _mm_shuffle_epi32(x, 0xff) : _mm_shuffle_epi32(x, 0xee);
+		}
+		return i;
+	}
+#endif
+
+	template<typename T, bool XOR> static void decode_filtered_values(uint8_t* data, size_t count, size_t stride){
+		size_t done = 0;
+#ifdef DARX_X86_SIMD
+		if(sizeof(T) == 4 && stride == 1){
+			done = decode_values_sse2<4, 4, XOR>(data, count);
+		} else if(sizeof(T) == 4 && stride == 2){
+			done = decode_values_sse2<4, 8, XOR>(data, count);
+		} else if(sizeof(T) == 8 && stride == 1){
+			done = decode_values_sse2<8, 8, XOR>(data, count);
+		}
+#endif
+		decode_values<T, XOR>(data, done, count, stride);
+	}
+
+	static void apply_value_filter(datatensor& tensor, const uint8_t* in, uint8_t* out, size_t data_size, bool decode){
+		bool is_xor = (tensor.filters & FILTER_XOR) != 0;
+		unsigned int size = filter_value_size(tensor.type);
+		size_t count = data_size / size;
+		size_t stride = tensor.type->components;
+		#define DARX_VALUE_FILTER(T) \
+			if(decode){ \
+				if(is_xor){ decode_filtered_values<T, true>(out, count, stride); } else { decode_filtered_values<T, false>(out, count, stride); } \
+			} else { \
+				if(is_xor){ encode_values<T, true>(in, out, count, stride); } else { encode_values<T, false>(in, out, count, stride); } \
+			}
+		switch(size){
+			case 1: DARX_VALUE_FILTER(uint8_t) break;
+			case 2: DARX_VALUE_FILTER(uint16_t) break;
+			case 4: DARX_VALUE_FILTER(uint32_t) break;
+			case 8: DARX_VALUE_FILTER(uint64_t) break;
+		}
+		#undef DARX_VALUE_FILTER
+	}
+
+	static void shuffle_scalar(const uint8_t* in, uint8_t* out, size_t first, size_t count, unsigned int size, bool unshuffle){
+		for(size_t i=first; i < count; i++){
+			for(unsigned int b=0; b < size; b++){
+				if(unshuffle){
+					out[i * size + b] = in[b * count + i];
+				} else {
+					out[b * count + i] = in[i * size + b];
+				}
+			}
+		}
+	}
+
+#ifdef DARX_X86_SIMD
+	/** Transposes a W x W matrix of 16/W byte cells, held in W vectors (self inverse). */
+	template<unsigned int W> __attribute__((target("ssse3"))) static inline void transpose_cells(__m128i* r){
+		if(W == 2){
+			__m128i t0 = _mm_unpacklo_epi64(r[0], r[1]);
+			r[1] = _mm_unpackhi_epi64(r[0], r[1]);
+			r[0] = t0;
+		} else if(W == 4){
+			__m128i t0 = _mm_unpacklo_epi32(r[0], r[1]), t1 = _mm_unpacklo_epi32(r[2], r[3]);
+			__m128i t2 = _mm_unpackhi_epi32(r[0], r[1]), t3 = _mm_unpackhi_epi32(r[2], r[3]);
+			r[0] = _mm_unpacklo_epi64(t0, t1); r[1] = _mm_unpackhi_epi64(t0, t1);
+			r[2] = _mm_unpacklo_epi64(t2, t3); r[3] = _mm_unpackhi_epi64(t2, t3);
+		} else {
+			__m128i t[8], u[8];
+			for(int i=0; i < 4; i++){
+				t[2*i] = _mm_unpacklo_epi16(r[2*i], r[2*i+1]);
+				t[2*i+1] = _mm_unpackhi_epi16(r[2*i], r[2*i+1]);
+			}
+			for(int i=0; i < 2; i++){
+				u[4*i] = _mm_unpacklo_epi32(t[4*i], t[4*i+2]);
+				u[4*i+1] = _mm_unpackhi_epi32(t[4*i], t[4*i+2]);
+				u[4*i+2] = _mm_unpacklo_epi32(t[4*i+1], t[4*i+3]);
+				u[4*i+3] = _mm_unpackhi_epi32(t[4*i+1], t[4*i+3]);
+			}
+			for(int i=0; i < 4; i++){
+				r[2*i] = _mm_unpacklo_epi64(u[i], u[i+4]);
+				r[2*i+1] = _mm_unpackhi_epi64(u[i], u[i+4]);
+			}
+		}
+	}
+
+	/** Shuffles (or unshuffles) blocks of 16 values of W bytes (2, 4 or 8): the bytes of
+	 *  each vector are grouped by significance, then the W vectors' groups are transposed.
+	 *  Returns the number of values shuffled.
+	 */
+	template<unsigned int W> __attribute__((target("ssse3"))) static size_t shuffle_ssse3(const uint8_t* in, uint8_t* out, size_t count, bool unshuffle){
+		const unsigned int k = 16 / W;
+		uint8_t group[16], ungroup[16];
+		for(unsigned int j=0; j < 16; j++){
+			group[j] = (j % k) * W + j / k;
+			ungroup[(j % k) * W + j / k] = j;
+		}
+		__m128i group_mask = _mm_loadu_si128((const __m128i*)group);
+		__m128i ungroup_mask = _mm_loadu_si128((const __m128i*)ungroup);
+		__m128i r[8];
+		size_t i = 0;
+		for(; i + 16 <= count; i += 16){
+			for(unsigned int v=0; v < W; v++){
+				r[v] = unshuffle ?
+					_mm_loadu_si128((const __m128i*)(in + v * count + i)) :
+					_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i * W + v * 16)), group_mask);
+			}
+			transpose_cells<W>(r);
+			for(unsigned int v=0; v < W; v++){
+				if(unshuffle){
+					_mm_storeu_si128((__m128i*)(out + i * W + v * 16), _mm_shuffle_epi8(r[v], ungroup_mask));
+				} else {
+					_mm_storeu_si128((__m128i*)(out + v * count + i), r[v]);
+				}
+			}
+		}
+		return i;
+	}
+
+	/** Splits the bit planes of 2 groups of 8 bytes at a time: the top bit of each byte
+	 *  is gathered with movemask, then the bytes are shifted left by one bit.
+	 *  Returns the number of groups split.
+	 */
+	__attribute__((target("ssse3"))) static size_t split_bit_planes_sse2(const uint8_t* in, uint8_t* out, size_t groups){
+		size_t g = 0;
+		for(; g + 2 <= groups; g += 2){
+			__m128i x = _mm_loadu_si128((const __m128i*)(in + g * 8));
+			for(int bit=7; bit >= 0; bit--){
+				uint16_t planes = _mm_movemask_epi8(x);
+				memcpy(out + bit * groups + g, &planes, sizeof(uint16_t));
+				x = _mm_add_epi8(x, x);
+			}
+		}
+		return g;
+	}
+
+	/** Joins the bit planes of 2 groups of 8 bytes at a time: each plane's 2 bytes are
+	 *  spread over the 16 bytes, which keep the bit selected by their position.
+	 *  Returns the number of groups joined.
+	 */
+	__attribute__((target("ssse3"))) static size_t join_bit_planes_ssse3(const uint8_t* in, uint8_t* out, size_t groups){
+		__m128i spread = _mm_set_epi8(1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0);
+		__m128i select = _mm_set1_epi64x(0x8040201008040201ll);
+		size_t g = 0;
+		for(; g + 2 <= groups; g += 2){
+			__m128i bytes = _mm_setzero_si128();
+			for(int bit=0; bit < 8; bit++){
+				uint16_t planes;
+				memcpy(&planes, in + bit * groups + g, sizeof(uint16_t));
+				__m128i x = _mm_shuffle_epi8(_mm_cvtsi32_si128(planes), spread);
+				__m128i set = _mm_cmpeq_epi8(_mm_and_si128(x, select), select);
+				bytes = _mm_or_si128(bytes, _mm_and_si128(set, _mm_set1_epi8(1 << bit)));
+			}
+			_mm_storeu_si128((__m128i*)(out + g * 8), bytes);
+		}
+		return g;
+	}
+#endif
+
+	static void shuffle_bytes(const uint8_t* in, uint8_t* out, size_t count, unsigned int size, bool unshuffle){
+		size_t done = 0;
+#ifdef DARX_X86_SIMD
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("ssse3")){
+			switch(size){
+				case 2: done = shuffle_ssse3<2>(in, out, count, unshuffle); break;
+				case 4: done = shuffle_ssse3<4>(in, out, count, unshuffle); break;
+				case 8: done = shuffle_ssse3<8>(in, out, count, unshuffle); break;
+			}
+		}
+#endif
+		shuffle_scalar(in, out, done, count, size, unshuffle);
+	}
+
+	/** Splits (or joins) the bit planes of a plane of count bytes. */
+	static void shuffle_bits(const uint8_t* in, uint8_t* out, size_t count, bool unshuffle){
+		size_t groups = count / 8;
+		size_t g = 0;
+#ifdef DARX_X86_SIMD
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("ssse3")){
+			g = unshuffle ? join_bit_planes_ssse3(in, out, groups) : split_bit_planes_sse2(in, out, groups);
+		}
+#endif
+		for(; g < groups; g++){
+			for(int bit=0; bit < 8; bit++){
+				if(unshuffle){
+					uint8_t plane = in[bit * groups + g];
+					for(int i=0; i < 8; i++){
+						uint8_t& byte = out[g * 8 + i];
+						byte = (bit ? byte : 0) | (((plane >> i) & 1) << bit);
+					}
+				} else {
+					uint8_t plane = 0;
+					for(int i=0; i < 8; i++){
+						plane |= ((in[g * 8 + i] >> bit) & 1) << i;
+					}
+					out[bit * groups + g] = plane;
+				}
+			}
+		}
+		// the last bytes are kept as they are.
+		memcpy(out + groups * 8, in + groups * 8, count - groups * 8);
+	}
+
+	/** Shuffles (or unshuffles) the bytes or bits of data_size bytes of values. */
+	static void shuffle_data(datatensor& tensor, const uint8_t* in, uint8_t* out, size_t data_size, bool unshuffle){
+		unsigned int size = filter_value_size(tensor.type);
+		size_t count = data_size / size;
+		if(tensor.filters & FILTER_SHUFFLE){
+			shuffle_bytes(in, out, count, size, unshuffle);
+			return;
+		}
+		uint8_t* planes = new uint8_t[data_size];
+		if(unshuffle){
+			for(unsigned int b=0; b < size; b++){
+				shuffle_bits(in + b * count, planes + b * count, count, true);
+			}
+			shuffle_bytes(planes, out, count, size, true);
+		} else {
+			shuffle_bytes(in, planes, count, size, false);
+			for(unsigned int b=0; b < size; b++){
+				shuffle_bits(planes + b * count, out + b * count, count, false);
+			}
+		}
+		delete[] planes;
+	}
+
+	bool filter_tensor_data(datatensor& tensor, uint8_t* out, size_t out_len){
+		size_t data_size = filtered_data_size(tensor);
+		if(!tensor.data || !can_filter(tensor) || out_len != data_size){
+			return false;
+		}
+		bool shuffles = (tensor.filters & (FILTER_SHUFFLE | FILTER_BITSHUFFLE)) != 0;
+		const uint8_t* in = (const uint8_t*)tensor.data;
+		uint8_t* values = 0;
+		if(tensor.filters & (FILTER_DELTA | FILTER_XOR)){
+			values = shuffles ? new uint8_t[data_size] : out;
+			apply_value_filter(tensor, in, values, data_size, false);
+			in = values;
+		}
+		if(shuffles){
+			shuffle_data(tensor, in, out, data_size, false);
+		}
+		if(values && values != out){
+			delete[] values;
+		}
+DARX_TRACE("#    [filters " << ((int)tensor.filters) << "] " << data_size << " bytes");
+		return true;
+	}
+
+	bool unfilter_tensor_data(datatensor& tensor, const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len, bool swap){
+		if(!can_filter(tensor) || in_len != out_len || out_len != filtered_data_size(tensor)){
+			return false;
+		}
+		if(tensor.filters & (FILTER_SHUFFLE | FILTER_BITSHUFFLE)){
+			shuffle_data(tensor, in, out, out_len, true);
+		} else if(in != out){
+			memcpy(out, in, out_len);
+		}
+		if(tensor.filters & (FILTER_DELTA | FILTER_XOR)){
+			// the differences are swapped before they are summed up.
+			if(swap && !swap_endianness(tensor.type, out, out_len)){
+				return false;
+			}
+			apply_value_filter(tensor, 0, out, out_len, true);
+		}
+		return true;
+	}
+};
@@ -0,0 +1,142 @@
+/**
+ * @file
+ * Bounded thread pool running the jobs of run_parallel().
+ * A single pool of worker threads, one less than the number of hardware threads, is
+ * created on first use and shared by every load and save. Each call submits a batch of
+ * jobs, which the calling thread and up to THREADS-1 workers take from a shared counter.
+ * Jobs that call run_parallel() again run their inner jobs serially, so the number of
+ * threads stays bounded, whatever the nesting.
+ */
+#include "darx.h"
+#include "darx_parallel.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+namespace darx{
+	
+	/** A set of jobs submitted by one call to run_parallel(). */
+	typedef struct {
+		void (*job)(void*, unsigned int);
+		void* ctx;
+		unsigned int count;
+		std::atomic<unsigned int> next;
+		// number of pool threads allowed to help, and currently helping
+		unsigned int max_helpers;
+		unsigned int helpers;
+		unsigned int active_helpers;
+	} parallel_batch;
+	
+	// set on pool threads, so that nested calls run serially.
+	static thread_local bool in_pool_thread = false;
+	
+	static void work_on(parallel_batch* batch){
+		for(unsigned int i; (i = batch->next++) < batch->count; ){
+			batch->job(batch->ctx, i);
+		}
+	}
+	
+	/** Bounded pool of worker threads, one less than the number of hardware threads.
+	 */
+	class thread_pool{
+		public:
+		std::mutex mutex;
+		std::condition_variable work_cv;
+		std::condition_variable done_cv;
+		std::deque<parallel_batch*> batches;
+		std::vector<std::thread> workers;
+		bool stop;
+		
+		thread_pool(unsigned int size): stop(false){
+			for(unsigned int i=0; i < size; i++){
+				workers.push_back(std::thread(&thread_pool::worker_loop, this));
+			}
+		}
+		~thread_pool(){
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			work_cv.notify_all();
+			for(size_t i=0; i < workers.size(); i++){
+				workers[i].join();
+			}
+		}
+		
+		void worker_loop(){
+			in_pool_thread = true;
+			std::unique_lock<std::mutex> lock(mutex);
+			while(true){
+				work_cv.wait(lock, [this]{ return stop || !batches.empty(); });
+				if(stop){
+					return;
+				}
+				parallel_batch* batch = batches.front();
+				if(++batch->helpers >= batch->max_helpers){
+					batches.pop_front();
+				}
+				batch->active_helpers++;
+				lock.unlock();
+				work_on(batch);
+				lock.lock();
+				if(--batch->active_helpers == 0){
+					done_cv.notify_all();
+				}
+			}
+		}
+		
+		void run(parallel_batch* batch){
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				batches.push_back(batch);
+			}
+			if(batch->max_helpers == 1){
+				work_cv.notify_one();
+			} else {
+				work_cv.notify_all();
+			}
+			work_on(batch);
+			std::unique_lock<std::mutex> lock(mutex);
+			// withdraw the batch if not every helper slot was taken.
+			for(std::deque<parallel_batch*>::iterator it = batches.begin(); it != batches.end(); ++it){
+				if(*it == batch){
+					batches.erase(it);
+					break;
+				}
+			}
+			done_cv.wait(lock, [batch]{ return batch->active_helpers == 0; });
+		}
+	};
+	
+	static thread_pool& get_pool(){
+		unsigned int hw_threads = std::thread::hardware_concurrency();
+		static thread_pool pool(hw_threads > 1 ? hw_threads - 1 : 0);
+		return pool;
+	}
+	
+	void run_parallel(unsigned int count, void (*job)(void*, unsigned int), void* ctx){
+		unsigned int threads = THREADS > 0 ? THREADS : std::thread::hardware_concurrency();
+		if(threads > count){ threads = count; }
+		if(threads <= 1 || in_pool_thread){
+			for(unsigned int i=0; i < count; i++){ job(ctx, i); }
+			return;
+		}
+		thread_pool& pool = get_pool();
+		if(pool.workers.empty()){
+			for(unsigned int i=0; i < count; i++){ job(ctx, i); }
+			return;
+		}
+		parallel_batch batch;
+		batch.job = job;
+		batch.ctx = ctx;
+		batch.count = count;
+		batch.next = 0;
+		batch.max_helpers = threads - 1;
+		batch.helpers = 0;
+		batch.active_helpers = 0;
+		pool.run(&batch);
+	}
+};
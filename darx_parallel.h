@@ -0,0 +1,18 @@
+/**
+ * @file
+ * Internal thread pool used for processing tensors and tensor blocks in parallel.
+ * Not part of the public interface.
+ */
+#ifndef DARX_PARALLEL_H
+#define DARX_PARALLEL_H
+
+namespace darx{
+	/** Runs job(ctx, i) for each i in [0, count), on up to THREADS threads.
+	 * The calling thread takes part in the work, the remaining ones are taken from a
+	 * shared, bounded pool of worker threads. Returns once every job has finished.
+	 * Calls made from within a job run serially on the calling thread.
+	 */
+	void run_parallel(unsigned int count, void (*job)(void*, unsigned int), void* ctx);
+};
+
+#endif
@@ -0,0 +1,191 @@
+/**
+ * @file
+ * Background loading of the tensors of lazily loaded darx data archives.
+ * Tensors are read ahead in the order they are stored in the file, by a few threads
+ * of their own, using positional reads (or the file mapping), so that reading and
+ * decompressing the next tensors overlaps with the caller's work on the current one.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+namespace darx{
+
+	/** Loading state of each tensor of a prefetched archive. */
+	enum prefetch_state{
+		PREFETCH_IDLE=0,
+		PREFETCH_QUEUED,
+		PREFETCH_LOADING,
+		PREFETCH_DONE
+	};
+
+	struct darx_prefetcher {
+		darx* archive;
+		unsigned int depth;
+		/** tensor indices, in file order, and the position of each tensor in that order. */
+		int* order;
+		int* rank;
+		/** state and load result of each tensor. */
+		prefetch_state* states;
+		ErrorCode* results;
+		/** tensors (in file order) up to which loads have been scheduled. */
+		int scheduled;
+		std::deque<int> queue;
+		std::vector<std::thread> workers;
+		std::mutex mutex;
+		std::condition_variable work_cv;
+		std::condition_variable done_cv;
+		bool stop;
+	};
+
+	/** Orders tensor indices by the position of their data in the file. */
+	typedef struct {
+		const datatensor* tensors;
+		bool operator()(int a, int b) const { return tensors[a].data_offset < tensors[b].data_offset; }
+	} data_offset_order;
+
+	/** Queues the tensors up to depth places past the given position in file order.
+	 *  Must be called with the prefetcher's mutex held.
+	 */
+	static void schedule_loads(darx_prefetcher* prefetcher, int position){
+		int number_of_tensors = prefetcher->archive->number_of_tensors;
+		int end = position + prefetcher->depth;
+		if(end > number_of_tensors){
+			end = number_of_tensors;
+		}
+		if(prefetcher->scheduled < position){
+			// tensors skipped over by the caller are not read.
+			prefetcher->scheduled = position;
+		}
+		bool queued = false;
+		for(; prefetcher->scheduled < end; prefetcher->scheduled++){
+			int tensor_idx = prefetcher->order[prefetcher->scheduled];
+			if(prefetcher->states[tensor_idx] == PREFETCH_IDLE){
+				prefetcher->states[tensor_idx] = PREFETCH_QUEUED;
+				prefetcher->queue.push_back(tensor_idx);
+				queued = true;
+			}
+		}
+		if(queued){
+			prefetcher->work_cv.notify_all();
+		}
+	}
+
+	/** Loads a tensor whose state was set to PREFETCH_LOADING, with the mutex held by the given lock. */
+	static void load_prefetched(darx_prefetcher* prefetcher, int tensor_idx, std::unique_lock<std::mutex>& lock){
+		lock.unlock();
+		ErrorCode result = load_tensor(*prefetcher->archive, tensor_idx);
+		lock.lock();
+		prefetcher->results[tensor_idx] = result;
+		prefetcher->states[tensor_idx] = PREFETCH_DONE;
+		prefetcher->done_cv.notify_all();
+	}
+
+	static void prefetch_loop(darx_prefetcher* prefetcher){
+		std::unique_lock<std::mutex> lock(prefetcher->mutex);
+		while(true){
+			prefetcher->work_cv.wait(lock, [prefetcher]{ return prefetcher->stop || !prefetcher->queue.empty(); });
+			if(prefetcher->stop){
+				return;
+			}
+			int tensor_idx = prefetcher->queue.front();
+			prefetcher->queue.pop_front();
+			// the caller may have started loading it already.
+			if(prefetcher->states[tensor_idx] == PREFETCH_QUEUED){
+				prefetcher->states[tensor_idx] = PREFETCH_LOADING;
+DARX_TRACE("# prefetching tensor["<<tensor_idx<<"] @ file pos : " << prefetcher->archive->tensors[tensor_idx].data_offset);
+				load_prefetched(prefetcher, tensor_idx, lock);
+			}
+		}
+	}
+
+	darx_prefetcher* begin_prefetch(darx& darx, unsigned int depth){
+		if(!darx.valid || (!darx.mapping && (!darx.file || fileno(darx.file) < 0))){
+			return 0;
+		}
+		darx_prefetcher* prefetcher = new darx_prefetcher;
+		uint32_t number_of_tensors = darx.number_of_tensors;
+		prefetcher->archive = &darx;
+		prefetcher->depth = depth;
+		prefetcher->order = new int[number_of_tensors];
+		prefetcher->rank = new int[number_of_tensors];
+		prefetcher->states = new prefetch_state[number_of_tensors];
+		prefetcher->results = new ErrorCode[number_of_tensors];
+		prefetcher->scheduled = 0;
+		prefetcher->stop = false;
+		for(uint32_t tensor_idx=0; tensor_idx < number_of_tensors; tensor_idx++){
+			prefetcher->order[tensor_idx] = tensor_idx;
+			bool loaded = darx.tensors[tensor_idx].data != 0;
+			prefetcher->states[tensor_idx] = loaded ? PREFETCH_DONE : PREFETCH_IDLE;
+			prefetcher->results[tensor_idx] = SUCCESS;
+		}
+		data_offset_order order = { darx.tensors };
+		std::sort(prefetcher->order, prefetcher->order + number_of_tensors, order);
+		for(uint32_t position=0; position < number_of_tensors; position++){
+			prefetcher->rank[prefetcher->order[position]] = position;
+		}
+		// one thread per tensor read ahead, up to THREADS.
+		unsigned int threads = THREADS > 0 ? THREADS : std::thread::hardware_concurrency();
+		if(threads > depth){
+			threads = depth;
+		}
+DARX_TRACE("# prefetching " << depth << " tensors ahead, on " << threads << " threads.");
+		for(unsigned int i=0; i < threads; i++){
+			prefetcher->workers.push_back(std::thread(prefetch_loop, prefetcher));
+		}
+		std::lock_guard<std::mutex> lock(prefetcher->mutex);
+		schedule_loads(prefetcher, 0);
+		return prefetcher;
+	}
+
+	ErrorCode wait_tensor(darx_prefetcher* prefetcher, int tensor_idx){
+		if(!prefetcher || tensor_idx < 0 || (uint32_t)tensor_idx >= prefetcher->archive->number_of_tensors){
+			return INVALID_STRUCT;
+		}
+		std::unique_lock<std::mutex> lock(prefetcher->mutex);
+		schedule_loads(prefetcher, prefetcher->rank[tensor_idx] + 1);
+		prefetch_state state = prefetcher->states[tensor_idx];
+		if(state == PREFETCH_IDLE || state == PREFETCH_QUEUED){
+			// not started yet: loading it here is quicker than waiting for a thread.
+			prefetcher->states[tensor_idx] = PREFETCH_LOADING;
+			load_prefetched(prefetcher, tensor_idx, lock);
+		} else {
+			prefetcher->done_cv.wait(lock, [prefetcher, tensor_idx]{ return prefetcher->states[tensor_idx] == PREFETCH_DONE; });
+		}
+		return prefetcher->results[tensor_idx];
+	}
+
+	bool tensor_ready(darx_prefetcher* prefetcher, int tensor_idx){
+		if(!prefetcher || tensor_idx < 0 || (uint32_t)tensor_idx >= prefetcher->archive->number_of_tensors){
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(prefetcher->mutex);
+		return prefetcher->states[tensor_idx] == PREFETCH_DONE;
+	}
+
+	void end_prefetch(darx_prefetcher* prefetcher){
+		if(!prefetcher){
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(prefetcher->mutex);
+			prefetcher->stop = true;
+			prefetcher->queue.clear();
+		}
+		prefetcher->work_cv.notify_all();
+		for(size_t i=0; i < prefetcher->workers.size(); i++){
+			prefetcher->workers[i].join();
+		}
+		delete[] prefetcher->order;
+		delete[] prefetcher->rank;
+		delete[] prefetcher->states;
+		delete[] prefetcher->results;
+		delete prefetcher;
+	}
+};
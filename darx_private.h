@@ -0,0 +1,361 @@
+/**
+ * @file
+ * Internal functions shared between the library's source files.
+ * Not part of the public interface.
+ */
+#ifndef DARX_PRIVATE_H
+#define DARX_PRIVATE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "darx.h"
+#include <sys/types.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+
+// magic number for darx files
+#define DARX_MAGIC "DARX"
+#define DARX_MAGIC_LEN 4
+// endianness test "LIVE" is big endian, "EVIL" is little endian
+#define DARX_MAGIC_BE 0x4c495645
+// flag in a tensor's compression byte, set if the descriptor has a layout byte (and layout parameters).
+#define DARX_EXTENDED_DESCRIPTOR 0x80
+// number of tensors in the header of a streamed archive, whose index is in a footer instead.
+#define DARX_STREAMED_INDEX 0xffff
+// magic number ending a streamed archive, after the footer's file offset.
+#define DARX_TRAILER_MAGIC "XRAD"
+// integer size byte of versioned headers (format version 2 on), followed by the version,
+// the log2 of the payload alignment and a reserved byte, instead of the long size.
+#define DARX_VERSIONED_HEADER 0
+// file offset of the number of tensors, in the header of each format version.
+#define DARX_COUNT_OFFSET_V1 (DARX_MAGIC_LEN + sizeof(uint32_t) + 2 * sizeof(uint8_t))
+#define DARX_COUNT_OFFSET_V2 (DARX_MAGIC_LEN + sizeof(uint32_t) + 4 * sizeof(uint8_t))
+// largest payload alignment, a power of 2.
+#define DARX_MAX_PAYLOAD_ALIGNMENT (1u << 30)
+
+// trace points, printed when VERBOSE is set, and compiled out with DARX_NO_TRACE
+// (configure --disable-trace).
+#ifdef DARX_NO_TRACE
+#define DARX_TRACE(message) do{}while(0)
+#define DARX_TRACE_LIST(label, values, count) do{}while(0)
+#else
+#define DARX_TRACE(message) do{ \
+		if(__builtin_expect(VERBOSE, 0)){ std::cout << message << std::endl; } \
+	}while(0)
+#define DARX_TRACE_LIST(label, values, count) do{ \
+		if(__builtin_expect(VERBOSE, 0)){ \
+			std::cout << label; \
+			for(size_t trace_idx=0; trace_idx < (size_t)(count); trace_idx++){ std::cout << (values)[trace_idx] << "   "; } \
+			std::cout << std::endl; \
+		} \
+	}while(0)
+#endif
+
+namespace darx{
+	/** Layout of the integers of an archive's header, index and descriptors. */
+	typedef struct {
+		/** Wether the archive was stored with the other endianness. */
+		bool swapEndian;
+		/** Size of the stored lengths and data sizes. */
+		uint8_t int_size;
+		/** Size of the stored file offsets. */
+		uint8_t long_size;
+		/** Size of the stored number of tensors and metadata size. */
+		uint8_t count_size;
+		/** Format version (see FORMAT_VERSION). */
+		uint8_t version;
+		/** Alignment of the file offsets of the tensors' stored data (1 for version 1). */
+		unsigned int payload_alignment;
+	} data_type_info;
+	
+	/** Fills the layout archives of the given format version are written with, on this system.
+	 * 
+	 * @returns false if the version or the payload alignment are not supported.
+	 */
+	bool native_format(data_type_info& format, int version, unsigned int payload_alignment);
+	
+	/** Fills the layout of a loaded archive's file, for it to be written to. */
+	bool archive_format(data_type_info& format, darx& darx);
+	
+	/** Number of tensors stored in the header of a streamed archive, whose index is in a
+	 *  footer instead (DARX_STREAMED_INDEX, for version 1). It is also the limit on the
+	 *  number of tensors of an archive.
+	 */
+	inline uint64_t streamed_index(const data_type_info& format){
+		return format.count_size < 8 ? (1ull << (8 * format.count_size)) - 1 : ~0ull;
+	}
+	
+	/** File offset of the number of tensors, in the archive's header. */
+	inline long int count_offset(const data_type_info& format){
+		return format.version < 2 ? DARX_COUNT_OFFSET_V1 : DARX_COUNT_OFFSET_V2;
+	}
+	
+	/** First file offset, from position on, where a tensor's stored data may start. */
+	inline long int align_payload(const data_type_info& format, long int position){
+		long int alignment = format.payload_alignment;
+		return (position + alignment - 1) / alignment * alignment;
+	}
+	
+	/** Writes an unsigned integer in its size bytes, with the system's endianness.
+	 * 
+	 * @returns false if the value does not fit, or could not be written.
+	 */
+	bool write_uint(FILE* file, uint64_t value, uint8_t size);
+	
+	/** Writes a tensors index (the file offsets of the tensors), with a single write. */
+	bool write_index(FILE* file, const long int* positions, size_t count, const data_type_info& format);
+	
+	/** Compresses a tensor's data, in blocks, with the tensor's compression type.
+	 * cdata_is_temp is set if cdata was allocated, and must be deleted by the caller.
+	 */
+	bool compress_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp);
+	/** Decompresses stored data into the tensor's data.
+	 * swap is set if the block tables were stored with the other endianness (the data itself is not swapped).
+	 * The data is decompressed into out if given, which must hold exactly out_len bytes of
+	 * uncompressed data, into a new buffer otherwise. Uncompressed data is used as is.
+	 * cdata_is_temp is set if the tensor's data is not cdata, and cdata may be deleted.
+	 */
+	bool decompress_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp, bool swap,
+		uint8_t* out = 0, size_t out_len = 0);
+	
+	/** Receives len bytes of decompressed data, found at the given offset of the tensor's data.
+	 *  Called from several threads at once, for different blocks.
+	 */
+	typedef void (*block_sink)(void* context, size_t offset, const uint8_t* data, size_t len);
+	/** Size of the blocks compressed data is stored in (the last one may be shorter), or 0 if unreadable. */
+	unsigned int compressed_block_size(const uint8_t* cdata, size_t cdata_len, bool swap);
+	/** Decompresses stored data block by block, on several threads, handing each block to the
+	 *  sink instead of assembling the data, which must be raw_len bytes long.
+	 *  The tensor must be compressed.
+	 */
+	bool decompress_blocks(datatensor& tensor, const uint8_t* cdata, size_t cdata_len, bool swap, size_t raw_len,
+		block_sink sink, void* context);
+	
+	/** Wether the tensor is not tiled, or has no zero tile length (which can not be stored). */
+	bool valid_tile_lengths(datatensor& tensor);
+	/** Encodes a tiled tensor's data as a tile offset table, followed by each tile's compressed data. */
+	bool encode_tiled_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp);
+	/** Decodes the stored data of a tiled tensor into contiguous, row-major data. */
+	bool decode_tiled_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp, bool swap,
+		uint8_t* out = 0, size_t out_len = 0);
+	
+	/** Encodes a tensor's data as it is stored in the file (tiled and/or compressed). */
+	bool encode_tensor_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp);
+	/** Decodes a tensor's data from the way it is stored in the file, into out if given.
+	 *  The tensor's data is set to the decoded data.
+	 */
+	bool decode_tensor_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp, bool swap,
+		uint8_t* out, size_t out_len);
+	
+	/** Writes a tensor's descriptor, followed by its stored data, at the file's position. */
+	int write_tensor(datatensor& tensor, FILE* file, const data_type_info& format);
+	
+	/** Writes an element type, as stored in tensor descriptors. */
+	bool write_tensor_type(ElementTypeStruct* tensor_type, FILE* file);
+	
+	/** Reads an element type written by write_tensor_type(), from memory.
+	 * 
+	 * @returns the interned type, or 0 if it could not be read.
+	 */
+	ElementTypeStruct* decode_tensor_type(const uint8_t* data, size_t len);
+	
+	/** A run of values of the same width, inside a data element. */
+	typedef struct {
+		unsigned int offset;
+		uint8_t width;
+		unsigned int count;
+	} swap_field;
+	
+	/** Flattened layout of an interned element type (see intern_type()). */
+	struct element_layout {
+		/** Size of an element, in bytes (see element_size()). */
+		unsigned int size;
+		/** Alignment of the element's widest value. */
+		unsigned int alignment;
+		/** Offset of each field of a mixed type, followed by the element size, or 0. */
+		unsigned int* field_offsets;
+		/** Wether the values can be byte swapped, following swap_plan. */
+		bool swappable;
+		int swap_fields;
+		swap_field* swap_plan;
+		/** Wether the elements fill 16 bytes exactly, to be swapped with swap_mask. */
+		bool vector_swap;
+		uint8_t swap_mask[16];
+	};
+	
+	/** Appends the encoding of an element type, as in tensor descriptors, to the key. */
+	bool append_type_key(ElementTypeStruct* type, std::string& key);
+	
+	/** Interns the element type encoded (as in tensor descriptors) in key[0, len).
+	 * 
+	 * @returns the interned type, or 0 if the encoding is malformed.
+	 */
+	ElementTypeStruct* intern_type_key(const uint8_t* key, size_t len);
+	
+	/** Fills the byte swapping plan of an element type's layout. */
+	void plan_swap(ElementTypeStruct* type, element_layout* layout);
+	
+	/** Writes a tensor's descriptor, up to the size of its stored data. */
+	int write_tensor_descriptor(datatensor& tensor, FILE* file, size_t cdata_length, const data_type_info& format);
+	
+	/** Serializes a tensor's descriptor in memory, for it to be written at once, at the
+	 * given file offset. The descriptor is padded for the stored data that follows it to
+	 * start at an aligned offset.
+	 * 
+	 * @returns the descriptor, to be released with free(), or 0 if it could not be serialized.
+	 */
+	char* serialize_tensor_descriptor(datatensor& tensor, size_t cdata_length, long int position,
+		const data_type_info& format, size_t* descriptor_length);
+	
+	/** Writes the archive's header, up to the tensors index. Streamed archives' headers
+	 * hold streamed_index() instead of the number of tensors.
+	 * 
+	 * @returns the file offset of the tensors index, or -1 if the header could not be written.
+	 */
+	long int write_header(darx& darx, FILE* file, const data_type_info& format, bool streamed = false);
+	
+	/** Returns a pointer to len bytes of a tensor's stored data, starting at offset.
+	 * The pointer either lies in the archive's file mapping, or is a new buffer, in which
+	 * case is_temp is set and the caller must delete it.
+	 * 
+	 * @returns the data, or 0 if it could not be read.
+	 */
+	uint8_t* read_stored_data(darx& darx, datatensor& tensor, size_t offset, size_t len, bool* is_temp);
+	
+	/** Wether a tensor's stored data is its data, as is. */
+	inline bool is_stored_raw(datatensor& tensor){
+		return tensor.compression == UNCOMPRESSED && !tensor.tile_lengths && !tensor.bit_packed && !tensor.filters;
+	}
+	
+	/** Copies a box of the given shape between two row-major arrays.
+	 * 
+	 * @param[in] rank - number of dimmensions of both arrays
+	 * @param[in] shape - lengths of the copied box
+	 * @param[in] elem_size - size of each element, in bytes
+	 * @param[in] src, src_lengths, src_start - source array, its lengths, and the box's origin in it
+	 * @param[in] dst, dst_lengths, dst_start - destination array, its lengths, and the box's origin in it
+	 */
+	void copy_box(int rank, const unsigned int* shape, size_t elem_size,
+		const uint8_t* src, const unsigned int* src_lengths, const unsigned int* src_start,
+		uint8_t* dst, const unsigned int* dst_lengths, const unsigned int* dst_start);
+	
+	/** Copies the elements of a strided region of row-major data, packed, into dst.
+	 * 
+	 * @param[in] src, lengths - source array and its lengths
+	 * @param[in] start, count, stride - the region's origin, number of elements and step, in each dimmension
+	 */
+	void copy_strided_region(int rank, size_t elem_size, const uint8_t* src, const unsigned int* lengths,
+		const unsigned int* start, const unsigned int* count, const unsigned int* stride, uint8_t* dst);
+	
+	/** Reads a region of a tensor stored raw, whose data is not loaded, into the buffer,
+	 *  from the file mapping or with positional reads of the region's runs only.
+	 *  The region must lie within the tensor.
+	 */
+	ErrorCode read_raw_region(darx& darx, datatensor& tensor, const unsigned int* start, const unsigned int* count,
+		const unsigned int* stride, void* buffer);
+	
+	/** Wether this system is big endian. */
+	bool system_is_big_endian();
+	
+	/** Wether the archive was stored with the other endianness. */
+	bool needs_swap(darx& darx);
+	
+	/** Size, in bytes, of integer values of the given bit width, in memory: the smallest
+	 *  native integer holding them, if the bit width is not a multiple of 8.
+	 */
+	unsigned int value_size(uint8_t bit_width);
+	
+	/** Wether values of the given type may be bit-packed (integers of up to 64 bits). */
+	bool can_bit_pack(ElementTypeStruct* type);
+	
+	/** Size of a tensor's values, once bit-packed. */
+	size_t bit_packed_size(datatensor& tensor);
+	
+	/** Packs a tensor's values in bit_width bits each, into a new buffer. */
+	bool pack_tensor_data(datatensor& tensor, uint8_t** packed, size_t* packed_len);
+	
+	/** Widens a tensor's bit-packed values into out, which must hold out_len bytes of native integers. */
+	bool unpack_tensor_data(datatensor& tensor, const uint8_t* packed, size_t packed_len, uint8_t* out, size_t out_len);
+	
+	/** Wether a tensor's filters are valid for its type and layout (see FilterType). */
+	bool can_filter(datatensor& tensor);
+	
+	/** Applies a tensor's filters to its data, into out, which must be as large as the data. */
+	bool filter_tensor_data(datatensor& tensor, uint8_t* out, size_t out_len);
+	
+	/** Undoes a tensor's filters, from in to out (of the same size), swapping the values'
+	 *  byte order first if needed by the value filters.
+	 */
+	bool unfilter_tensor_data(datatensor& tensor, const uint8_t* in, size_t in_len, uint8_t* out, size_t out_len, bool swap);
+	
+	/** Swaps the byte order of a tensor's data, laid out as the tensor's layout says. */
+	bool swap_tensor_data(datatensor& tensor, void* data, size_t data_size);
+	
+	/** Loads an unsigned int stored in a table, swapping its bytes if needed. */
+	inline unsigned int load_stored_uint(const uint8_t* p, bool swap){
+		unsigned int value;
+		memcpy(&value, p, sizeof(unsigned int));
+		return swap ? __builtin_bswap32(value) : value;
+	}
+	
+	/** Allocates len bytes from an arena, aligned for any tensor data.
+	 *  May be called from several threads at once.
+	 */
+	void* arena_alloc(darx_arena* arena, size_t len);
+	/** Makes all of an arena's memory available again, keeping it allocated. */
+	void reset_arena(darx_arena* arena);
+	
+	/** Detaches an archive from the shared memory segment mapped at the given address, if
+	 *  it was loaded with load_shared_image(), releasing its reference to the segment.
+	 *  The segment is left mapped, for the caller to unmap.
+	 * 
+	 * @returns false if no segment is mapped at that address
+	 */
+	bool detach_shared_image(void* mapping);
+	
+	/** Counters of the load or save running on the calling thread, if any. */
+	extern thread_local io_stats* thread_stats;
+	
+	/** Adds to an I/O counter, both of the calling thread's load or save, and of the process. */
+	void count_stat(uint64_t io_stats::* counter, uint64_t value);
+	
+	/** Monotonic clock, in nanoseconds, used for timing the phases of loads and saves. */
+	uint64_t stats_clock();
+	
+	/** fread(), counting the call and the bytes read. */
+	inline size_t read_file(void* buffer, size_t size, size_t count, FILE* file){
+		size_t done = fread(buffer, size, count, file);
+		count_stat(&io_stats::read_calls, 1);
+		count_stat(&io_stats::bytes_read, done * size);
+		return done;
+	}
+	
+	/** fwrite(), counting the call and the bytes written. */
+	inline size_t write_file(const void* data, size_t size, size_t count, FILE* file){
+		size_t done = fwrite(data, size, count, file);
+		count_stat(&io_stats::write_calls, 1);
+		count_stat(&io_stats::bytes_written, done * size);
+		return done;
+	}
+	
+	/** fseek(), counting the call. */
+	inline int seek_file(FILE* file, long int offset, int whence){
+		count_stat(&io_stats::seeks, 1);
+		return fseek(file, offset, whence);
+	}
+	
+	/** Sets the calling thread's counters, for the lifetime of the scope. */
+	class stats_scope{
+		io_stats* previous;
+		public:
+		inline stats_scope(io_stats* stats): previous(thread_stats){ thread_stats = stats; }
+		inline ~stats_scope(){ thread_stats = previous; }
+	};
+	
+	bool pread_all(int fd, void* buffer, size_t len, off_t offset);
+	bool pwrite_all(int fd, const void* buffer, size_t len, off_t offset);
+};
+
+#endif
@@ -0,0 +1,209 @@
+/**
+ * @file
+ * Strided regions (hyperslabs) of contiguous tensors, read without loading the tensors.
+ * A region of a row-major tensor is a set of runs of contiguous bytes: the innermost
+ * dimmensions it spans entirely (with a stride of 1) are merged into each run. Runs are
+ * copied from the file mapping, or read from the file with preadv(), straight into the
+ * caller's buffer. Runs separated by small gaps are read together in a single call, the
+ * gaps going to a scratch buffer, so that the file is read in as few calls as possible.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// largest gap between two runs read by the same call (larger gaps are skipped by starting a new call).
+#define REGION_MAX_GAP (16 << 10)
+// largest number of buffers read into by a single call.
+#ifdef IOV_MAX
+#define REGION_MAX_IOVECS IOV_MAX
+#else
+#define REGION_MAX_IOVECS 1024
+#endif
+
+namespace darx{
+
+	/** Walks the runs of a region, in row-major order: their offsets in the tensor's data
+	 *  increase, and they are packed one after the other in the region's buffer.
+	 */
+	typedef struct {
+		/** number of outer dimmensions walked (the others are merged into each run). */
+		int rank;
+		/** size of each run, in bytes. */
+		size_t run_len;
+		/** offset of the current run in the tensor's data. */
+		uint64_t offset;
+		/** distance between consecutive runs along each walked dimmension, in bytes. */
+		uint64_t steps[256];
+		unsigned int idx[256];
+		const unsigned int* count;
+	} region_cursor;
+
+	/** Sets the cursor on the first run of a region, returns the number of runs. */
+	static size_t begin_runs(region_cursor& cursor, int rank, size_t elem_size, const unsigned int* lengths,
+		const unsigned int* start, const unsigned int* count, const unsigned int* stride
+	){
+		uint64_t pitch = elem_size;
+		cursor.offset = 0;
+		for(int d=rank-1; d >= 0; d--){
+			cursor.offset += start[d] * pitch;
+			cursor.steps[d] = stride[d] * pitch;
+			pitch *= lengths[d];
+		}
+		// merge the inner dimmensions that are contiguous.
+		cursor.run_len = elem_size;
+		cursor.rank = rank;
+		while(cursor.rank > 0 && stride[cursor.rank-1] == 1){
+			cursor.rank--;
+			cursor.run_len *= count[cursor.rank];
+			if(count[cursor.rank] != lengths[cursor.rank]){
+				break;
+			}
+		}
+		size_t number_of_runs = 1;
+		for(int d=0; d < cursor.rank; d++){
+			cursor.idx[d] = 0;
+			number_of_runs *= count[d];
+		}
+		cursor.count = count;
+		return number_of_runs;
+	}
+
+	/** Moves the cursor to the next run. */
+	static inline void next_run(region_cursor& cursor){
+		for(int d=cursor.rank-1; d >= 0; d--){
+			cursor.offset += cursor.steps[d];
+			if(++cursor.idx[d] < cursor.count[d]){
+				return;
+			}
+			cursor.offset -= cursor.steps[d] * cursor.count[d];
+			cursor.idx[d] = 0;
+		}
+	}
+
+	void copy_strided_region(int rank, size_t elem_size, const uint8_t* src, const unsigned int* lengths,
+		const unsigned int* start, const unsigned int* count, const unsigned int* stride, uint8_t* dst
+	){
+		region_cursor cursor;
+		size_t number_of_runs = begin_runs(cursor, rank, elem_size, lengths, start, count, stride);
+		for(size_t run_idx=0; run_idx < number_of_runs; run_idx++, next_run(cursor)){
+			memcpy(dst, src + cursor.offset, cursor.run_len);
+			dst += cursor.run_len;
+		}
+	}
+
+	/** Reads a range of the file into the buffers, returns false on a short read. */
+	static bool preadv_all(int fd, struct iovec* iov, int iovcnt, off_t offset){
+		while(iovcnt > 0){
+			ssize_t count = preadv(fd, iov, iovcnt, offset);
+			count_stat(&io_stats::read_calls, 1);
+			if(count <= 0){
+				if(count < 0 && errno == EINTR){ continue; }
+				return false;
+			}
+			count_stat(&io_stats::bytes_read, count);
+			offset += count;
+			// skip the buffers filled, and the part of the last one that was.
+			while(iovcnt > 0 && (size_t)count >= iov->iov_len){
+				count -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+			if(iovcnt > 0){
+				iov->iov_base = (uint8_t*)iov->iov_base + count;
+				iov->iov_len -= count;
+			}
+		}
+		return true;
+	}
+
+	/** Reads a region's runs from the file, coalescing the runs separated by small gaps. */
+	static bool read_region_runs(int fd, long int data_offset, region_cursor& cursor, size_t number_of_runs, uint8_t* dst){
+		struct iovec* iov = new struct iovec[REGION_MAX_IOVECS];
+		uint8_t* gap = new uint8_t[REGION_MAX_GAP];
+		int iovcnt = 0;
+		uint64_t range_begin = 0;
+		uint64_t range_end = 0;
+		bool success = true;
+		for(size_t run_idx=0; success && run_idx < number_of_runs; run_idx++, next_run(cursor)){
+			uint64_t gap_len = cursor.offset - range_end;
+			if(iovcnt && !gap_len){
+				// contiguous with the previous run, in the file and in the buffer.
+				iov[iovcnt-1].iov_len += cursor.run_len;
+			} else if(iovcnt && gap_len <= REGION_MAX_GAP && iovcnt + 2 <= REGION_MAX_IOVECS){
+				iov[iovcnt].iov_base = gap;
+				iov[iovcnt].iov_len = gap_len;
+				iov[iovcnt+1].iov_base = dst;
+				iov[iovcnt+1].iov_len = cursor.run_len;
+				iovcnt += 2;
+			} else {
+				if(iovcnt){
+					success = preadv_all(fd, iov, iovcnt, data_offset + range_begin);
+				}
+				range_begin = cursor.offset;
+				iov[0].iov_base = dst;
+				iov[0].iov_len = cursor.run_len;
+				iovcnt = 1;
+			}
+			range_end = cursor.offset + cursor.run_len;
+			dst += cursor.run_len;
+		}
+		if(success && iovcnt){
+			success = preadv_all(fd, iov, iovcnt, data_offset + range_begin);
+		}
+		delete[] iov;
+		delete[] gap;
+		return success;
+	}
+
+	ErrorCode read_raw_region(darx& darx, datatensor& tensor, const unsigned int* start, const unsigned int* count,
+		const unsigned int* stride, void* buffer
+	){
+		size_t elem_size = element_size(tensor.type);
+		size_t data_size = elem_size;
+		size_t region_size = elem_size;
+		for(int d=0; d < tensor.rank; d++){
+			data_size *= tensor.lengths[d];
+			region_size *= count[d];
+		}
+		if(tensor.data_size != data_size || tensor.data_offset < 0){
+			return INVALID_STRUCT;
+		}
+		int fd = darx.file ? fileno(darx.file) : -1;
+		if(!darx.mapping && fd < 0){
+			// the file can only be read sequentially: the tensor is loaded as a whole.
+			ErrorCode result = load_tensor(darx, &tensor - darx.tensors);
+			if(result == SUCCESS){
+				copy_strided_region(tensor.rank, elem_size, (const uint8_t*)tensor.data, tensor.lengths, start, count, stride, (uint8_t*)buffer);
+			}
+			return result;
+		}
+		if(darx.mapping){
+			if((size_t)tensor.data_offset + data_size > darx.mapping_size){
+				return INVALID_STRUCT;
+			}
+			copy_strided_region(tensor.rank, elem_size, (const uint8_t*)darx.mapping + tensor.data_offset, tensor.lengths,
+				start, count, stride, (uint8_t*)buffer);
+		} else {
+			region_cursor cursor;
+			size_t number_of_runs = begin_runs(cursor, tensor.rank, elem_size, tensor.lengths, start, count, stride);
+DARX_TRACE("# reading " << number_of_runs << " runs of " << cursor.run_len << " bytes @ file pos : " << tensor.data_offset);
+			if(!read_region_runs(fd, tensor.data_offset, cursor, number_of_runs, (uint8_t*)buffer)){
+				return INVALID_STRUCT;
+			}
+		}
+		if(needs_swap(darx)){
+			uint64_t clock = stats_clock();
+			bool swapped = swap_endianness(tensor.type, buffer, region_size);
+			count_stat(&io_stats::swap_time, stats_clock() - clock);
+			if(!swapped){
+				return UNSUPPORTED_ELEMENT_TYPE;
+			}
+		}
+		return SUCCESS;
+	}
+};
@@ -0,0 +1,399 @@
+/**
+ * @file
+ * Archives shared by the processes of a host, through named POSIX shared memory segments.
+ * The first process loading an archive with load_shared_image() decodes it into a segment
+ * named after the archive file's identity (device, inode, size and modification time).
+ * Other processes attach to the segment instead of reading and decoding the archive again:
+ * their tensors' names, lengths and data point straight into its read-only mapping.
+ * A segment holds, in this system's endianness and integer sizes:
+ *   shared_header
+ *   shared_tensor tensors[number_of_tensors]
+ *   names, lengths, tile lengths and element types (as in tensor descriptors)
+ *   metadata
+ *   the tensors' decoded data, each aligned to SHARED_DATA_ALIGNMENT
+ * Offsets in the segment are relative to its start, as each process maps it elsewhere.
+ *
+ * Processes building, attaching to and detaching from a segment hold an exclusive flock()
+ * on it, under which the header's reference count is read and written with pread/pwrite.
+ * The segment's name is unlinked (the segment evicted) when its last reference is released,
+ * or by evict_shared_image(). Processes attached to an evicted segment keep using it, while
+ * later loads build a new one.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <iostream>
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace darx{
+	#define SHARED_MAGIC "DRXS"
+	#define SHARED_VERSION 1
+	// alignment of the tensors' data in a segment.
+	#define SHARED_DATA_ALIGNMENT 64
+	// number of times a load retries with a segment evicted while it was waiting for it.
+	#define SHARED_MAX_RETRIES 8
+
+	typedef struct {
+		char magic[DARX_MAGIC_LEN];
+		uint32_t int_magic;
+		uint32_t version;
+		/** Wether the segment was filled completely (segments left half built by a process that died are rebuilt). */
+		uint32_t ready;
+		/** Number of processes' archives attached to the segment. */
+		uint32_t references;
+		/** Wether the segment's name was unlinked: no process attaches to it anymore. */
+		uint32_t evicted;
+		uint64_t number_of_tensors;
+		uint64_t tensors_offset;
+		uint64_t metadata_offset;
+		uint64_t size;
+		uint32_t metadata_size;
+		uint32_t payload_alignment;
+		uint8_t format_version;
+		uint8_t reserved[7];
+	} shared_header;
+
+	/** A tensor of a segment. Offsets of its name, lengths, type and data are from the segment's start. */
+	typedef struct {
+		uint64_t name;
+		uint64_t lengths;
+		uint64_t tile_lengths;
+		uint64_t type;
+		uint64_t data;
+		uint64_t data_size;
+		int64_t descriptor_offset;
+		uint32_t type_size;
+		uint8_t rank;
+		uint8_t compression;
+		uint8_t layout;
+		uint8_t filters;
+	} shared_tensor;
+
+	/** A segment attached to by an archive of this process. */
+	typedef struct {
+		int fd;
+		std::string name;
+	} shared_attachment;
+
+	typedef std::map<void*, shared_attachment> attachment_table;
+
+	static std::mutex attachments_mutex;
+
+	/** The segments attached to, by the address they are mapped at. */
+	static attachment_table& attachments(){
+		static attachment_table* table = new attachment_table;
+		return *table;
+	}
+
+	/** Name of the segment of the archive file, which changes whenever the file does. */
+	static std::string segment_name(const struct stat& file_stat){
+		// FNV-1a over the file's identity.
+		uint64_t identity[] = {
+			(uint64_t)file_stat.st_dev, (uint64_t)file_stat.st_ino, (uint64_t)file_stat.st_size,
+			(uint64_t)file_stat.st_mtim.tv_sec, (uint64_t)file_stat.st_mtim.tv_nsec
+		};
+		const uint8_t* bytes = (const uint8_t*)identity;
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for(size_t i=0; i < sizeof(identity); i++){
+			hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "/darx-%016llx", (unsigned long long)hash);
+		return name;
+	}
+
+	/** Reserves len bytes at the end of the segment being laid out, returning their offset. */
+	static inline uint64_t reserve(uint64_t& size, size_t len, size_t alignment){
+		uint64_t offset = (size + alignment - 1) / alignment * alignment;
+		size = offset + len;
+		return offset;
+	}
+
+	static inline bool read_header(int fd, shared_header& header){
+		return pread(fd, &header, sizeof(shared_header), 0) == (ssize_t)sizeof(shared_header);
+	}
+
+	static inline bool write_header(int fd, const shared_header& header){
+		return pwrite(fd, &header, sizeof(shared_header), 0) == (ssize_t)sizeof(shared_header);
+	}
+
+	/** Wether the header is that of a segment built by this library, for this system. */
+	static bool is_valid_header(const shared_header& header, size_t size){
+		return !memcmp(header.magic, SHARED_MAGIC, DARX_MAGIC_LEN) && header.int_magic == DARX_MAGIC_BE &&
+			header.version == SHARED_VERSION && header.size == size &&
+			header.tensors_offset + header.number_of_tensors * sizeof(shared_tensor) <= size &&
+			header.metadata_offset + header.metadata_size <= size;
+	}
+
+	/** Decodes the archive into the segment, which must be locked exclusively by the caller. */
+	static bool build_segment(int fd, const char* path){
+		FILE* file = fopen(path, "rb");
+		if(!file){
+			return false;
+		}
+		darx archive;
+		memset(&archive, 0, sizeof(darx));
+		// raw tensors are copied from the file's mapping, the others decoded one at a time.
+		if(load_image_from(archive, file, LOAD_MMAP | LOAD_LAZY) != SUCCESS){
+			fclose(file);
+			return false;
+		}
+		shared_header header;
+		memset(&header, 0, sizeof(shared_header));
+		memcpy(header.magic, SHARED_MAGIC, DARX_MAGIC_LEN);
+		header.int_magic = DARX_MAGIC_BE;
+		header.version = SHARED_VERSION;
+		header.number_of_tensors = archive.number_of_tensors;
+		header.metadata_size = archive.metadata_size;
+		header.payload_alignment = archive.payload_alignment;
+		header.format_version = archive.format_version;
+		// lay out the segment.
+		uint64_t size = sizeof(shared_header);
+		header.tensors_offset = reserve(size, archive.number_of_tensors * sizeof(shared_tensor), 8);
+		shared_tensor* tensors = new shared_tensor[archive.number_of_tensors];
+		std::string* types = new std::string[archive.number_of_tensors];
+		bool success = true;
+		for(uint32_t tensor_idx=0; success && tensor_idx < archive.number_of_tensors; tensor_idx++){
+			datatensor& tensor = archive.tensors[tensor_idx];
+			shared_tensor& entry = tensors[tensor_idx];
+			memset(&entry, 0, sizeof(shared_tensor));
+			success = append_type_key(tensor.type, types[tensor_idx]) && load_tensor(archive, tensor_idx) == SUCCESS;
+			entry.name = reserve(size, strlen(tensor.name) + 1, 1);
+			entry.lengths = reserve(size, tensor.rank * sizeof(unsigned int), sizeof(unsigned int));
+			entry.tile_lengths = tensor.tile_lengths ? reserve(size, tensor.rank * sizeof(unsigned int), sizeof(unsigned int)) : 0;
+			entry.type = reserve(size, types[tensor_idx].size(), 1);
+			entry.type_size = types[tensor_idx].size();
+			entry.data_size = tensor.data_size;
+			entry.descriptor_offset = tensor.descriptor_offset;
+			entry.rank = tensor.rank;
+			entry.compression = tensor.compression;
+			entry.layout = (tensor.tile_lengths ? LAYOUT_TILED : 0) | (tensor.columnar ? LAYOUT_COLUMNAR : 0) |
+				(tensor.bit_packed ? LAYOUT_BITPACKED : 0) | (tensor.filters ? LAYOUT_FILTERED : 0);
+			entry.filters = tensor.filters;
+		}
+		header.metadata_offset = reserve(size, archive.metadata_size, 1);
+		for(uint32_t tensor_idx=0; success && tensor_idx < archive.number_of_tensors; tensor_idx++){
+			tensors[tensor_idx].data = reserve(size, tensors[tensor_idx].data_size, SHARED_DATA_ALIGNMENT);
+		}
+		header.size = size;
+		void* mapping = MAP_FAILED;
+		if(success && !ftruncate(fd, size)){
+			mapping = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		if(mapping != MAP_FAILED){
+			uint8_t* segment = (uint8_t*)mapping;
+			memcpy(segment + header.tensors_offset, tensors, archive.number_of_tensors * sizeof(shared_tensor));
+			for(uint32_t tensor_idx=0; tensor_idx < archive.number_of_tensors; tensor_idx++){
+				datatensor& tensor = archive.tensors[tensor_idx];
+				shared_tensor& entry = tensors[tensor_idx];
+				memcpy(segment + entry.name, tensor.name, strlen(tensor.name) + 1);
+				memcpy(segment + entry.lengths, tensor.lengths, tensor.rank * sizeof(unsigned int));
+				if(tensor.tile_lengths){
+					memcpy(segment + entry.tile_lengths, tensor.tile_lengths, tensor.rank * sizeof(unsigned int));
+				}
+				memcpy(segment + entry.type, types[tensor_idx].data(), entry.type_size);
+				memcpy(segment + entry.data, tensor.data, entry.data_size);
+			}
+			memcpy(segment + header.metadata_offset, archive.metadata, archive.metadata_size);
+			// the segment is only ready once it is filled.
+			header.ready = 1;
+			memcpy(segment, &header, sizeof(shared_header));
+			munmap(mapping, size);
+DARX_TRACE("# shared : built segment of " << path << " (" << size << " bytes, " << archive.number_of_tensors << " tensors)");
+		}
+		delete[] tensors;
+		delete[] types;
+		release_image(archive);
+		fclose(file);
+		return mapping != MAP_FAILED;
+	}
+
+	/** Maps a ready segment, which must be locked exclusively by the caller, and sets the
+	 *  archive's tensors into it.
+	 */
+	static ErrorCode attach_segment(darx& darx, int fd, const shared_header& header){
+		void* mapping = mmap(0, header.size, PROT_READ, MAP_SHARED, fd, 0);
+		if(mapping == MAP_FAILED){
+			return INVALID_STRUCT;
+		}
+		const uint8_t* segment = (const uint8_t*)mapping;
+		const shared_tensor* entries = (const shared_tensor*)(segment + header.tensors_offset);
+		memset(&darx, 0, sizeof(darx));
+		// only the tensors array is private to the process: it holds the mapping's addresses.
+		darx.arena = create_arena(header.number_of_tensors * sizeof(datatensor));
+		darx.owns_arena = true;
+		darx.tensors = (datatensor*)arena_alloc(darx.arena, header.number_of_tensors * sizeof(datatensor));
+		darx.number_of_tensors = header.number_of_tensors;
+		darx.metadata = (char*)segment + header.metadata_offset;
+		darx.metadata_size = header.metadata_size;
+		// the data was swapped to this system's endianness when the segment was built.
+		darx.isBigEndian = system_is_big_endian();
+		darx.format_version = header.format_version;
+		darx.payload_alignment = header.payload_alignment;
+		darx.mapping = mapping;
+		darx.mapping_size = header.size;
+		darx.valid = true;
+		for(uint32_t tensor_idx=0; tensor_idx < header.number_of_tensors; tensor_idx++){
+			const shared_tensor& entry = entries[tensor_idx];
+			datatensor& tensor = darx.tensors[tensor_idx];
+			memset(&tensor, 0, sizeof(datatensor));
+			if(entry.data + entry.data_size > header.size || entry.type + entry.type_size > header.size){
+				darx.valid = false;
+				break;
+			}
+			tensor.name = (const char*)segment + entry.name;
+			tensor.rank = entry.rank;
+			tensor.lengths = (unsigned int*)(segment + entry.lengths);
+			tensor.tile_lengths = entry.tile_lengths ? (unsigned int*)(segment + entry.tile_lengths) : 0;
+			tensor.type = decode_tensor_type(segment + entry.type, entry.type_size);
+			tensor.compression = (CompressionType)entry.compression;
+			tensor.data_size = entry.data_size;
+			tensor.data = (void*)(segment + entry.data);
+			tensor.owns_data = false;
+			// data offsets are into the segment, for advise_tensor().
+			tensor.data_offset = entry.data;
+			tensor.descriptor_offset = entry.descriptor_offset;
+			tensor.columnar = entry.layout & LAYOUT_COLUMNAR;
+			tensor.bit_packed = entry.layout & LAYOUT_BITPACKED;
+			tensor.filters = entry.filters;
+			if(!tensor.type){
+				darx.valid = false;
+				break;
+			}
+		}
+		if(!darx.valid){
+			destroy_arena(darx.arena);
+			munmap(mapping, header.size);
+			memset(&darx, 0, sizeof(darx));
+			return INVALID_STRUCT;
+		}
+		return SUCCESS;
+	}
+
+	ErrorCode load_shared_image(darx& darx, const char* path){
+		struct stat file_stat;
+		if(!path || stat(path, &file_stat) || !S_ISREG(file_stat.st_mode)){
+			return INVALID_STRUCT;
+		}
+		std::string name = segment_name(file_stat);
+		for(int attempt=0; attempt < SHARED_MAX_RETRIES; attempt++){
+			int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+			if(fd < 0){
+				break;
+			}
+			if(flock(fd, LOCK_EX)){
+				close(fd);
+				break;
+			}
+			struct stat segment_stat;
+			shared_header header;
+			bool valid = !fstat(fd, &segment_stat) && read_header(fd, header) && is_valid_header(header, segment_stat.st_size);
+			if(valid && header.evicted){
+				// evicted while this process was waiting for the lock: the name is another segment's by now.
+				flock(fd, LOCK_UN);
+				close(fd);
+				continue;
+			}
+			if(!valid || !header.ready){
+				if(ftruncate(fd, 0) || !build_segment(fd, path)){
+					shm_unlink(name.c_str());
+					flock(fd, LOCK_UN);
+					close(fd);
+					return INVALID_STRUCT;
+				}
+				fstat(fd, &segment_stat);
+				read_header(fd, header);
+			} else {
+DARX_TRACE("# shared : attaching to segment of " << path << " (" << header.references << " references)");
+			}
+			ErrorCode status = attach_segment(darx, fd, header);
+			if(status == SUCCESS){
+				header.references++;
+				write_header(fd, header);
+				std::lock_guard<std::mutex> lock(attachments_mutex);
+				shared_attachment& attachment = attachments()[darx.mapping];
+				attachment.fd = fd;
+				attachment.name = name;
+			}
+			flock(fd, LOCK_UN);
+			if(status != SUCCESS){
+				close(fd);
+			}
+			return status;
+		}
+		// shared memory is not available: the archive is loaded privately.
+DARX_TRACE("# shared : loading " << path << " privately");
+		FILE* file = fopen(path, "rb");
+		if(!file){
+			return INVALID_STRUCT;
+		}
+		ErrorCode status = load_image_from(darx, file);
+		fclose(file);
+		return status;
+	}
+
+	bool detach_shared_image(void* mapping){
+		shared_attachment attachment;
+		{
+			std::lock_guard<std::mutex> lock(attachments_mutex);
+			attachment_table::iterator it = attachments().find(mapping);
+			if(it == attachments().end()){
+				return false;
+			}
+			attachment = it->second;
+			attachments().erase(it);
+		}
+		shared_header header;
+		if(!flock(attachment.fd, LOCK_EX) && read_header(attachment.fd, header)){
+			if(header.references){
+				header.references--;
+			}
+			if(!header.references && !header.evicted){
+DARX_TRACE("# shared : evicting segment " << attachment.name);
+				header.evicted = 1;
+				shm_unlink(attachment.name.c_str());
+			}
+			write_header(attachment.fd, header);
+			flock(attachment.fd, LOCK_UN);
+		}
+		close(attachment.fd);
+		return true;
+	}
+
+	bool evict_shared_image(const char* path){
+		struct stat file_stat;
+		if(!path || stat(path, &file_stat)){
+			return false;
+		}
+		std::string name = segment_name(file_stat);
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if(fd < 0){
+			return false;
+		}
+		bool evicted = false;
+		shared_header header;
+		if(!flock(fd, LOCK_EX)){
+			bool valid = read_header(fd, header);
+			if(!valid || !header.evicted){
+				// segments left empty by a failed build are unlinked as well.
+				if(valid){
+					header.evicted = 1;
+					write_header(fd, header);
+				}
+				shm_unlink(name.c_str());
+				evicted = true;
+			}
+			flock(fd, LOCK_UN);
+		}
+		close(fd);
+		return evicted;
+	}
+};
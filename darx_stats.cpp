@@ -0,0 +1,49 @@
+/**
+ * @file
+ * Input/output counters of archive loads and saves.
+ * Each counted event is added to the counters of the load or save running on the
+ * calling thread (an archive's stats), and to the process' counters.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <time.h>
+
+namespace darx{
+	thread_local io_stats* thread_stats = 0;
+
+	static io_stats process_stats;
+
+	void count_stat(uint64_t io_stats::* counter, uint64_t value){
+		// loads may count from several threads at once.
+		if(thread_stats){
+			__atomic_fetch_add(&(thread_stats->*counter), value, __ATOMIC_RELAXED);
+		}
+		__atomic_fetch_add(&(process_stats.*counter), value, __ATOMIC_RELAXED);
+	}
+
+	uint64_t stats_clock(){
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+	}
+
+	/** Every counter of io_stats. */
+	static uint64_t io_stats::* const counters[] = {
+		&io_stats::bytes_read, &io_stats::bytes_written, &io_stats::read_calls, &io_stats::write_calls,
+		&io_stats::seeks, &io_stats::header_time, &io_stats::compress_time, &io_stats::decompress_time,
+		&io_stats::swap_time
+	};
+
+	void get_io_stats(io_stats& stats){
+		for(size_t i=0; i < sizeof(counters) / sizeof(counters[0]); i++){
+			stats.*counters[i] = __atomic_load_n(&(process_stats.*counters[i]), __ATOMIC_RELAXED);
+		}
+	}
+
+	void reset_io_stats(){
+		// counters may be updated by loads running on other threads.
+		for(size_t i=0; i < sizeof(counters) / sizeof(counters[0]); i++){
+			__atomic_store_n(&(process_stats.*counters[i]), 0, __ATOMIC_RELAXED);
+		}
+	}
+};
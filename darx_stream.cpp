@@ -0,0 +1,177 @@
+/**
+ * @file
+ * Streaming writer for darx data archives.
+ * The archive is written strictly sequentially, so that it can be sent to pipes,
+ * sockets or other non-seekable outputs, one tensor at a time.
+ *
+ * A streamed archive's header holds streamed_index() (DARX_STREAMED_INDEX, in format
+ * version 1) instead of the number of tensors, and no index. The index is written in
+ * a footer instead:
+ *   uint16_t number_of_tensors                    (uint64_t in version 2)
+ *   long int tensor_positions[number_of_tensors]  (uint64_t in version 2)
+ * followed by a fixed-size trailer:
+ *   long int footer_position                      (uint64_t in version 2)
+ *   char magic[4] = "XRAD"
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+
+namespace darx{
+	// size of the chunks handed to a tensor producer.
+	#define STREAM_CHUNK_SIZE (1 << 20)
+
+	/** Writes len bytes to the writer's file, keeping track of the position. */
+	static bool stream_write(stream_writer& writer, const void* data, size_t len){
+		if(writer.failed || (len > 0 && write_file(data, 1, len, writer.file) != len)){
+			writer.failed = true;
+			return false;
+		}
+		writer.position += len;
+		return true;
+	}
+
+	/** Layout of the integers the archive is written with. */
+	static data_type_info writer_format(stream_writer& writer){
+		data_type_info format;
+		native_format(format, writer.format_version, writer.payload_alignment);
+		return format;
+	}
+
+	/** Records the position of the next tensor in the index. */
+	static bool add_tensor_position(stream_writer& writer){
+		if(writer.number_of_tensors >= streamed_index(writer_format(writer)) - 1 || writer.number_of_tensors == UINT32_MAX){
+			writer.failed = true;
+			return false;
+		}
+		if(writer.number_of_tensors == writer.capacity){
+			unsigned int capacity = writer.capacity ? writer.capacity * 2 : 16;
+			long int* positions = new long int[capacity];
+			for(unsigned int i=0; i < writer.number_of_tensors; i++){
+				positions[i] = writer.tensor_positions[i];
+			}
+			delete[] writer.tensor_positions;
+			writer.tensor_positions = positions;
+			writer.capacity = capacity;
+		}
+DARX_TRACE("# tensor["<<writer.number_of_tensors<<"] @ file pos : " << writer.position);
+		writer.tensor_positions[writer.number_of_tensors++] = writer.position;
+		return true;
+	}
+
+	/** Writes a tensor's descriptor, given the size of its stored data. */
+	static bool stream_descriptor(stream_writer& writer, datatensor& tensor, size_t cdata_length){
+		size_t descriptor_length = 0;
+		// serialize the descriptor in memory, so its size (and padding) is known.
+		char* descriptor = serialize_tensor_descriptor(tensor, cdata_length, writer.position, writer_format(writer), &descriptor_length);
+		bool success = descriptor && stream_write(writer, descriptor, descriptor_length);
+		free(descriptor);
+		writer.failed = writer.failed || !success;
+		return success;
+	}
+
+	bool begin_archive(stream_writer& writer, FILE* file, const char* metadata, uint16_t metadata_size){
+		writer.file = file;
+		writer.position = 0;
+		writer.number_of_tensors = 0;
+		writer.tensor_positions = 0;
+		writer.capacity = 0;
+		writer.format_version = FORMAT_VERSION;
+		writer.payload_alignment = PAYLOAD_ALIGNMENT;
+		data_type_info format;
+		writer.failed = !native_format(format, writer.format_version, writer.payload_alignment);
+		if(writer.failed){
+			return false;
+		}
+		darx header;
+		memset(&header, 0, sizeof(darx));
+		long int metadata_pos = write_header(header, file, format, true);
+		if(metadata_pos < 0){
+			writer.failed = true;
+			return false;
+		}
+		writer.position = metadata_pos;
+		// the metadata directly follows the header.
+		writer.failed = !write_uint(file, metadata_size, format.count_size);
+		writer.position += format.count_size;
+		return stream_write(writer, metadata, metadata_size);
+	}
+
+	bool append_tensor(stream_writer& writer, datatensor& tensor){
+		if(writer.failed || !tensor.data || !valid_tile_lengths(tensor)){
+			return false;
+		}
+		bool cdata_is_temp=false;
+		size_t cdata_length=0;
+		uint8_t* cdata=0;
+		if(!encode_tensor_data(tensor, &cdata, &cdata_length, &cdata_is_temp)){
+			writer.failed = true;
+			return false;
+		}
+		bool success = add_tensor_position(writer) &&
+			stream_descriptor(writer, tensor, cdata_length) &&
+			stream_write(writer, cdata, cdata_length);
+		if(cdata_is_temp){
+			delete[] cdata;
+		}
+		return success;
+	}
+
+	bool append_tensor(stream_writer& writer, datatensor& tensor, tensor_producer producer, void* ctx){
+		if(writer.failed || !producer){
+			return false;
+		}
+		if(tensor.compression != UNCOMPRESSED || tensor.tile_lengths || tensor.bit_packed || tensor.filters){
+			// encoded tensors need all of their data, gather it first.
+			uint8_t* data = new uint8_t[tensor.data_size];
+			size_t filled = 0;
+			while(filled < tensor.data_size){
+				size_t count = producer(ctx, data + filled, tensor.data_size - filled);
+				if(!count){ break; }
+				filled += count;
+			}
+			void* tensor_data = tensor.data;
+			tensor.data = data;
+			bool success = filled == tensor.data_size && append_tensor(writer, tensor);
+			tensor.data = tensor_data;
+			delete[] data;
+			writer.failed = writer.failed || !success;
+			return success;
+		}
+		if(!add_tensor_position(writer) || !stream_descriptor(writer, tensor, tensor.data_size)){
+			return false;
+		}
+		// stream the data straight through, chunk by chunk.
+		size_t chunk_size = tensor.data_size < STREAM_CHUNK_SIZE ? tensor.data_size : STREAM_CHUNK_SIZE;
+		uint8_t* chunk = new uint8_t[chunk_size];
+		size_t remaining = tensor.data_size;
+		while(remaining > 0){
+			size_t count = producer(ctx, chunk, remaining < chunk_size ? remaining : chunk_size);
+			if(!count || count > remaining || !stream_write(writer, chunk, count)){
+				writer.failed = true;
+				break;
+			}
+			remaining -= count;
+		}
+		delete[] chunk;
+		return !writer.failed;
+	}
+
+	bool finish_archive(stream_writer& writer){
+		long int index_pos = writer.position;
+		data_type_info format = writer_format(writer);
+DARX_TRACE("# tensors : " << writer.number_of_tensors << ", index @ file pos : " << index_pos);
+		bool success = !writer.failed &&
+			write_uint(writer.file, writer.number_of_tensors, format.count_size) &&
+			write_index(writer.file, writer.tensor_positions, writer.number_of_tensors, format) &&
+			write_index(writer.file, &index_pos, 1, format) &&
+			stream_write(writer, DARX_TRAILER_MAGIC, DARX_MAGIC_LEN) &&
+			!fflush(writer.file);
+		delete[] writer.tensor_positions;
+		writer.tensor_positions = 0;
+		writer.capacity = 0;
+		return success;
+	}
+};
@@ -0,0 +1,481 @@
+/**
+ * @file
+ * Tiled storage of tensor data in darx data archives.
+ * A tiled tensor is split in tiles of tile_lengths elements, each stored row-major
+ * and compressed on its own, so that a region of the tensor can be read by reading
+ * only the tiles that intersect it.
+ *
+ * Layout of the stored data of a tiled tensor:
+ *   unsigned int number_of_tiles
+ *   unsigned int tile_offsets[number_of_tiles+1] - offsets of each tile's stored data,
+ *                                  relative to the end of this table.
+ *   each tile's (compressed) data, in row-major tile order...
+ * Tiles on the tensor's edges are clipped to the tensor's lengths.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include "darx_parallel.h"
+#include <iostream>
+#include <string.h>
+#include <atomic>
+#include <limits.h>
+
+namespace darx{
+
+	void copy_box(int rank, const unsigned int* shape, size_t elem_size,
+		const uint8_t* src, const unsigned int* src_lengths, const unsigned int* src_start,
+		uint8_t* dst, const unsigned int* dst_lengths, const unsigned int* dst_start
+	){
+		if(rank == 0){
+			memcpy(dst, src, elem_size);
+			return;
+		}
+		size_t src_strides[256], dst_strides[256];
+		unsigned int idx[256];
+		src_strides[rank-1] = dst_strides[rank-1] = elem_size;
+		for(int d=rank-1; d > 0; d--){
+			src_strides[d-1] = src_strides[d] * src_lengths[d];
+			dst_strides[d-1] = dst_strides[d] * dst_lengths[d];
+		}
+		for(int d=0; d < rank; d++){
+			if(!shape[d]){ return; }
+			idx[d] = 0;
+		}
+		size_t row_len = shape[rank-1] * elem_size;
+		// walk all rows of the box, the last dimmension being contiguous.
+		while(true){
+			size_t src_off = 0, dst_off = 0;
+			for(int d=0; d < rank; d++){
+				src_off += (src_start[d] + idx[d]) * src_strides[d];
+				dst_off += (dst_start[d] + idx[d]) * dst_strides[d];
+			}
+			memcpy(dst + dst_off, src + src_off, row_len);
+			int d = rank - 2;
+			for(; d >= 0; d--){
+				if(++idx[d] < shape[d]){ break; }
+				idx[d] = 0;
+			}
+			if(d < 0){ break; }
+		}
+	}
+
+	/** Computes the number of tiles along each dimmension, returns the total number of tiles. */
+	static size_t tile_grid(datatensor& tensor, unsigned int* grid){
+		size_t number_of_tiles = 1;
+		for(int d=0; d < tensor.rank; d++){
+			grid[d] = (tensor.lengths[d] + tensor.tile_lengths[d] - 1) / tensor.tile_lengths[d];
+			number_of_tiles *= grid[d];
+		}
+		return number_of_tiles;
+	}
+
+	/** Computes the origin and (clipped) shape of a tile, given its row-major index. */
+	static size_t tile_box(datatensor& tensor, const unsigned int* grid, size_t tile_idx, unsigned int* origin, unsigned int* shape){
+		size_t number_of_elements = 1;
+		for(int d=tensor.rank-1; d >= 0; d--){
+			origin[d] = (tile_idx % grid[d]) * tensor.tile_lengths[d];
+			tile_idx /= grid[d];
+			shape[d] = tensor.lengths[d] - origin[d] < tensor.tile_lengths[d] ? tensor.lengths[d] - origin[d] : tensor.tile_lengths[d];
+			number_of_elements *= shape[d];
+		}
+		return number_of_elements;
+	}
+
+	static size_t number_of_elements(datatensor& tensor){
+		size_t count = 1;
+		for(int d=0; d < tensor.rank; d++){
+			count *= tensor.lengths[d];
+		}
+		return count;
+	}
+
+	/** Decompresses a tile's stored data, returns the tile's data or 0 on failure.
+	 *  is_temp is set if the returned data must be deleted.
+	 */
+	static uint8_t* decompress_tile(CompressionType compression, uint8_t* cdata, size_t cdata_len, size_t tile_size, bool* is_temp, bool swap){
+		datatensor tile;
+		memset(&tile, 0, sizeof(datatensor));
+		tile.compression = compression;
+		(*is_temp) = false;
+		if(!decompress_data(tile, &cdata, &cdata_len, is_temp, swap) || tile.data_size != tile_size){
+			if(*is_temp){
+				delete[] (uint8_t*)tile.data;
+			}
+			return 0;
+		}
+		return (uint8_t*)tile.data;
+	}
+
+	typedef struct {
+		datatensor* tensor;
+		unsigned int* grid;
+		size_t elem_size;
+		// per tile stored data (encoding)
+		uint8_t** blobs;
+		size_t* blob_lengths;
+		// tile offset table and tiles (decoding)
+		const unsigned int* offsets;
+		uint8_t* ctiles;
+		bool swap;
+		std::atomic<bool> failed;
+	} tile_job;
+
+	static void encode_tile_job(void* ctx, unsigned int tile_idx){
+		tile_job& job = *(tile_job*)ctx;
+		datatensor& tensor = *job.tensor;
+		unsigned int origin[256], shape[256], zero[256] = {0};
+		size_t tile_size = tile_box(tensor, job.grid, tile_idx, origin, shape) * job.elem_size;
+		uint8_t* tile_data = new uint8_t[tile_size];
+		copy_box(tensor.rank, shape, job.elem_size, (uint8_t*)tensor.data, tensor.lengths, origin, tile_data, shape, zero);
+		datatensor tile;
+		memset(&tile, 0, sizeof(datatensor));
+		tile.compression = tensor.compression;
+		tile.data = tile_data;
+		tile.data_size = tile_size;
+		bool cdata_is_temp = false;
+		uint8_t* cdata = 0;
+		size_t cdata_len = 0;
+		if(!compress_data(tile, &cdata, &cdata_len, &cdata_is_temp)){
+			delete[] tile_data;
+			job.blobs[tile_idx] = 0;
+			job.blob_lengths[tile_idx] = 0;
+			job.failed = true;
+			return;
+		}
+		if(cdata_is_temp){
+			delete[] tile_data;
+		}
+		job.blobs[tile_idx] = cdata;
+		job.blob_lengths[tile_idx] = cdata_len;
+	}
+
+	static void decode_tile_job(void* ctx, unsigned int tile_idx){
+		tile_job& job = *(tile_job*)ctx;
+		datatensor& tensor = *job.tensor;
+		unsigned int origin[256], shape[256], zero[256] = {0};
+		size_t tile_size = tile_box(tensor, job.grid, tile_idx, origin, shape) * job.elem_size;
+		bool is_temp;
+		uint8_t* tile_data = decompress_tile(tensor.compression, job.ctiles + job.offsets[tile_idx],
+			job.offsets[tile_idx+1] - job.offsets[tile_idx], tile_size, &is_temp, job.swap);
+		if(!tile_data){
+			job.failed = true;
+			return;
+		}
+		copy_box(tensor.rank, shape, job.elem_size, tile_data, shape, zero, (uint8_t*)tensor.data, tensor.lengths, origin);
+		if(is_temp){
+			delete[] tile_data;
+		}
+	}
+
+	bool valid_tile_lengths(datatensor& tensor){
+		for(int d=0; tensor.tile_lengths && d < tensor.rank; d++){
+			if(!tensor.tile_lengths[d]){
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool encode_tiled_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp){
+		size_t elem_size = element_size(tensor.type);
+		if(!elem_size || !valid_tile_lengths(tensor) || tensor.data_size != number_of_elements(tensor) * elem_size){
+			return false;
+		}
+		unsigned int grid[256];
+		size_t number_of_tiles = tile_grid(tensor, grid);
+DARX_TRACE("#    [tiled] tiles : " << number_of_tiles);
+		tile_job job;
+		job.tensor = &tensor;
+		job.grid = grid;
+		job.elem_size = elem_size;
+		job.blobs = new uint8_t*[number_of_tiles];
+		job.blob_lengths = new size_t[number_of_tiles];
+		job.failed = false;
+		run_parallel(number_of_tiles, encode_tile_job, &job);
+
+		size_t table_len = (number_of_tiles + 2) * sizeof(unsigned int);
+		size_t total_len = table_len;
+		for(size_t i=0; i < number_of_tiles; i++){ total_len += job.blob_lengths[i]; }
+		// the tile table holds unsigned ints.
+		uint8_t* out = job.failed || total_len - table_len > UINT_MAX ? 0 : new uint8_t[total_len];
+		if(out){
+			unsigned int* header = (unsigned int*)out;
+			header[0] = number_of_tiles;
+			unsigned int* offsets = header + 1;
+			offsets[0] = 0;
+			for(size_t i=0; i < number_of_tiles; i++){
+				offsets[i+1] = offsets[i] + job.blob_lengths[i];
+				memcpy(out + table_len + offsets[i], job.blobs[i], job.blob_lengths[i]);
+			}
+		}
+		for(size_t i=0; i < number_of_tiles; i++){ delete[] job.blobs[i]; }
+		delete[] job.blobs;
+		delete[] job.blob_lengths;
+		if(!out){
+			return false;
+		}
+		(*cdata) = out;
+		(*cdata_len) = total_len;
+		(*cdata_is_temp) = true;
+		return true;
+	}
+
+	/** Reads and checks a tiled tensor's tile offset table. Returns 0 on failure. */
+	static unsigned int* parse_tile_table(const uint8_t* table, size_t table_len, size_t number_of_tiles, size_t cdata_len, bool swap){
+		unsigned int stored_number_of_tiles = load_stored_uint(table, swap);
+		if(stored_number_of_tiles != number_of_tiles || (number_of_tiles + 2) * sizeof(unsigned int) != table_len){
+			return 0;
+		}
+		// the table may be unaligned in a file mapping, so copy it out.
+		unsigned int* offsets = new unsigned int[number_of_tiles + 1];
+		for(size_t i=0; i <= number_of_tiles; i++){
+			offsets[i] = load_stored_uint(table + (i + 1) * sizeof(unsigned int), swap);
+		}
+		bool valid = offsets[0] == 0 && offsets[number_of_tiles] <= cdata_len - table_len;
+		for(size_t i=0; valid && i < number_of_tiles; i++){
+			valid = offsets[i] <= offsets[i+1];
+		}
+		if(!valid){
+			delete[] offsets;
+			return 0;
+		}
+		return offsets;
+	}
+
+	bool decode_tiled_data(datatensor& tensor, uint8_t** cdata, size_t* cdata_len, bool* cdata_is_temp, bool swap,
+		uint8_t* out, size_t out_len
+	){
+		size_t elem_size = element_size(tensor.type);
+		unsigned int grid[256];
+		size_t number_of_tiles = tile_grid(tensor, grid);
+		size_t table_len = (number_of_tiles + 2) * sizeof(unsigned int);
+		size_t data_size = number_of_elements(tensor) * elem_size;
+		if(!elem_size || (*cdata_len) < table_len || (out && data_size != out_len)){
+			return false;
+		}
+		unsigned int* offsets = parse_tile_table(*cdata, table_len, number_of_tiles, *cdata_len, swap);
+		if(!offsets){
+			return false;
+		}
+DARX_TRACE("#    [tiled] tiles : " << number_of_tiles);
+		tensor.data = out ? out : new uint8_t[data_size];
+		tensor.data_size = data_size;
+		tile_job job;
+		job.tensor = &tensor;
+		job.grid = grid;
+		job.elem_size = elem_size;
+		job.offsets = offsets;
+		job.ctiles = (*cdata) + table_len;
+		job.swap = swap;
+		job.failed = false;
+		run_parallel(number_of_tiles, decode_tile_job, &job);
+		delete[] offsets;
+		if(job.failed){
+			if(!out){
+				delete[] (uint8_t*)tensor.data;
+			}
+			tensor.data = 0;
+			return false;
+		}
+		(*cdata_is_temp) = true;
+		return true;
+	}
+
+	typedef struct {
+		darx* archive;
+		datatensor* tensor;
+		unsigned int* grid;
+		size_t elem_size;
+		size_t table_len;
+		const unsigned int* offsets;
+		const size_t* tiles;
+		const unsigned int* start;
+		const unsigned int* count;
+		uint8_t* buffer;
+		bool swap;
+		std::atomic<bool> failed;
+	} region_job;
+
+	static void read_region_tile_job(void* ctx, unsigned int i){
+		region_job& job = *(region_job*)ctx;
+		datatensor& tensor = *job.tensor;
+		size_t tile_idx = job.tiles[i];
+		unsigned int origin[256], shape[256], lo[256], box[256], dst_start[256];
+		size_t tile_size = tile_box(tensor, job.grid, tile_idx, origin, shape) * job.elem_size;
+		bool cdata_is_temp, is_temp;
+		size_t cdata_len = job.offsets[tile_idx+1] - job.offsets[tile_idx];
+		uint8_t* cdata = read_stored_data(*job.archive, tensor, job.table_len + job.offsets[tile_idx], cdata_len, &cdata_is_temp);
+		if(!cdata){
+			job.failed = true;
+			return;
+		}
+		uint8_t* tile_data = decompress_tile(tensor.compression, cdata, cdata_len, tile_size, &is_temp, job.swap);
+		if(tile_data){
+			// copy the intersection of the tile and the region
+			for(int d=0; d < tensor.rank; d++){
+				lo[d] = origin[d] > job.start[d] ? origin[d] : job.start[d];
+				unsigned int tile_end = origin[d] + shape[d], region_end = job.start[d] + job.count[d];
+				box[d] = (tile_end < region_end ? tile_end : region_end) - lo[d];
+				dst_start[d] = lo[d] - job.start[d];
+				lo[d] -= origin[d];
+			}
+			copy_box(tensor.rank, box, job.elem_size, tile_data, shape, lo, job.buffer, job.count, dst_start);
+			if(is_temp){
+				delete[] tile_data;
+			}
+		} else {
+			job.failed = true;
+		}
+		if(cdata_is_temp){
+			delete[] cdata;
+		}
+	}
+
+	ErrorCode read_tensor_region(darx& darx, int tensor_idx, const unsigned int* start, const unsigned int* count, void* buffer){
+		unsigned int stride[256];
+		for(int d=0; d < 256; d++){
+			stride[d] = 1;
+		}
+		return read_tensor_region(darx, tensor_idx, start, count, stride, buffer);
+	}
+
+	ErrorCode read_tensor_region(darx& darx, int tensor_idx, const unsigned int* start, const unsigned int* count,
+		const unsigned int* stride, void* buffer
+	){
+		if(!darx.valid || tensor_idx < 0 || (uint32_t)tensor_idx >= darx.number_of_tensors){
+			return INVALID_STRUCT;
+		}
+		stats_scope scope(&darx.stats);
+		datatensor& tensor = darx.tensors[tensor_idx];
+		size_t elem_size = element_size(tensor.type);
+		if(!elem_size){
+			return UNSUPPORTED_ELEMENT_TYPE;
+		}
+		bool strided = false;
+		for(int d=0; d < tensor.rank; d++){
+			if(!stride[d] || start[d] > tensor.lengths[d] ||
+				(count[d] && (uint64_t)(count[d] - 1) * stride[d] >= tensor.lengths[d] - start[d])
+			){
+				return INVALID_STRUCT;
+			}
+			strided = strided || (stride[d] != 1 && count[d] > 1);
+		}
+		for(int d=0; d < tensor.rank; d++){
+			if(!count[d]){
+				return SUCCESS;
+			}
+		}
+		if(tensor.columnar){
+			// regions are made of whole elements, which columnar tensors do not store together.
+			return INVALID_STRUCT;
+		}
+		unsigned int zero[256] = {0};
+		if(!tensor.data && is_stored_raw(tensor)){
+			// only the region's runs are read.
+			return read_raw_region(darx, tensor, start, count, stride, buffer);
+		}
+		if(!tensor.data && !tensor.tile_lengths){
+			// compressed contiguous tensors are loaded as a whole.
+			ErrorCode result = load_tensor(darx, tensor_idx);
+			if(result != SUCCESS){
+				return result;
+			}
+		}
+		if(tensor.data){
+			if(strided){
+				copy_strided_region(tensor.rank, elem_size, (const uint8_t*)tensor.data, tensor.lengths, start, count, stride, (uint8_t*)buffer);
+			} else {
+				copy_box(tensor.rank, count, elem_size, (uint8_t*)tensor.data, tensor.lengths, start, (uint8_t*)buffer, count, zero);
+			}
+			return SUCCESS;
+		}
+		if(strided){
+			// the tiles spanning the region are read as a box, and its elements picked from it.
+			unsigned int box[256];
+			size_t box_size = elem_size;
+			for(int d=0; d < tensor.rank; d++){
+				box[d] = (count[d] - 1) * stride[d] + 1;
+				box_size *= box[d];
+			}
+			uint8_t* box_data = new uint8_t[box_size];
+			ErrorCode result = read_tensor_region(darx, tensor_idx, start, box, box_data);
+			if(result == SUCCESS){
+				copy_strided_region(tensor.rank, elem_size, box_data, box, zero, count, stride, (uint8_t*)buffer);
+			}
+			delete[] box_data;
+			return result;
+		}
+
+		// read the tile table, then only the tiles intersecting the region.
+		unsigned int grid[256], first[256], last[256], idx[256];
+		size_t number_of_tiles = tile_grid(tensor, grid);
+		size_t table_len = (number_of_tiles + 2) * sizeof(unsigned int);
+		if(tensor.data_size < table_len){
+			return INVALID_STRUCT;
+		}
+		bool table_is_temp;
+		uint8_t* table = read_stored_data(darx, tensor, 0, table_len, &table_is_temp);
+		if(!table){
+			return INVALID_STRUCT;
+		}
+		bool swap = needs_swap(darx);
+		unsigned int* offsets = parse_tile_table(table, table_len, number_of_tiles, tensor.data_size, swap);
+		if(table_is_temp){
+			delete[] table;
+		}
+		if(!offsets){
+			return INVALID_STRUCT;
+		}
+		size_t number_of_region_tiles = 1;
+		for(int d=0; d < tensor.rank; d++){
+			first[d] = start[d] / tensor.tile_lengths[d];
+			last[d] = (start[d] + count[d] - 1) / tensor.tile_lengths[d];
+			idx[d] = first[d];
+			number_of_region_tiles *= last[d] - first[d] + 1;
+		}
+		size_t* tiles = new size_t[number_of_region_tiles];
+		for(size_t i=0; i < number_of_region_tiles; i++){
+			size_t tile_idx = 0;
+			for(int d=0; d < tensor.rank; d++){
+				tile_idx = tile_idx * grid[d] + idx[d];
+			}
+			tiles[i] = tile_idx;
+			for(int d=tensor.rank-1; d >= 0; d--){
+				if(++idx[d] <= last[d]){ break; }
+				idx[d] = first[d];
+			}
+		}
+DARX_TRACE("# reading " << number_of_region_tiles << " of " << number_of_tiles << " tiles of tensor["<<tensor_idx<<"]");
+		region_job job;
+		job.archive = &darx;
+		job.tensor = &tensor;
+		job.grid = grid;
+		job.elem_size = elem_size;
+		job.table_len = table_len;
+		job.offsets = offsets;
+		job.tiles = tiles;
+		job.start = start;
+		job.count = count;
+		job.buffer = (uint8_t*)buffer;
+		job.swap = swap;
+		job.failed = false;
+		run_parallel(number_of_region_tiles, read_region_tile_job, &job);
+		delete[] tiles;
+		delete[] offsets;
+		if(job.failed){
+			return UNSUPPORTED_COMPRESS_TYPE;
+		}
+		if(swap){
+			// the tiles' data is left as stored, only the copied region is swapped.
+			size_t region_size = elem_size;
+			for(int d=0; d < tensor.rank; d++){ region_size *= count[d]; }
+			uint64_t start = stats_clock();
+			bool swapped = swap_endianness(tensor.type, buffer, region_size);
+			count_stat(&io_stats::swap_time, stats_clock() - start);
+			if(!swapped){
+				return UNSUPPORTED_ELEMENT_TYPE;
+			}
+		}
+		return SUCCESS;
+	}
+};
@@ -0,0 +1,217 @@
+/**
+ * @file
+ * Interned element types.
+ * Element types are hash-consed on their encoding in tensor descriptors: every
+ * tensor of every archive loaded by the process, whose type has the same encoding,
+ * shares one immutable type struct. Each interned type carries its flattened layout
+ * (element size, field offsets, alignment and byte swapping plan), computed once,
+ * so that none of them walks the type's tree when it is used.
+ *
+ * Interned types are never released: there are only as many of them as distinct
+ * element types seen by the process.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <iostream>
+#include <string.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace darx{
+
+	typedef std::unordered_map<std::string, ElementTypeStruct*> type_table;
+
+	static std::mutex interned_mutex;
+
+	/** The table of interned types, by encoding (never destroyed, as the types outlive it). */
+	static type_table& interned_types(){
+		static type_table* table = new type_table;
+		return *table;
+	}
+
+	/** Returns the end of the type encoded at key, or 0 if the encoding is malformed. */
+	static const uint8_t* skip_type_key(const uint8_t* key, const uint8_t* end){
+		if(end - key < 3){
+			return 0;
+		}
+		uint8_t tag = key[0];
+		uint8_t components = key[1];
+		key += 3;
+		switch(tag){
+			case TYPE_INT: case TYPE_UINT: case TYPE_FLOAT: case TYPE_CHAR:
+				return key;
+			case TYPE_MIXED:
+				for(int comp_idx=0; comp_idx < components && key; comp_idx++){
+					key = skip_type_key(key, end);
+				}
+				return key;
+			case TYPE_CUSTOM:
+				if(key == end || end - key - 1 < key[0]){
+					return 0;
+				}
+				return key + 1 + key[0];
+			default:
+				return 0;
+		}
+	}
+
+	bool append_type_key(ElementTypeStruct* type, std::string& key){
+		if(!type){
+			return false;
+		}
+		key.push_back((char)type->type);
+		key.push_back((char)type->components);
+		key.push_back((char)type->bit_width);
+		switch(type->type){
+			case TYPE_INT: case TYPE_UINT: case TYPE_FLOAT: case TYPE_CHAR:
+				return true;
+			case TYPE_MIXED:{
+				MixedElementTypeStruct* mixedtype = (MixedElementTypeStruct*)type;
+				for(int comp_idx=0; comp_idx < mixedtype->components; comp_idx++){
+					if(!append_type_key(mixedtype->subtypes[comp_idx], key)){
+						return false;
+					}
+				}
+				return true;
+			}
+			case TYPE_CUSTOM:{
+				CustomElementTypeStruct* customtype = (CustomElementTypeStruct*)type;
+				const char* type_name = customtype->type_name ? customtype->type_name : "Unknown";
+				uint8_t namelen = strlen(type_name);
+				key.push_back((char)namelen);
+				key.append(type_name, namelen);
+				return true;
+			}
+			default:
+				return false;
+		}
+	}
+
+	/** Natural alignment of values of the given size: the largest power of 2 dividing it, up to 16. */
+	static unsigned int value_alignment(unsigned int size){
+		unsigned int alignment = 1;
+		while(alignment < 16 && size && !(size % (alignment * 2))){
+			alignment *= 2;
+		}
+		return alignment;
+	}
+
+	/** Computes the layout of a type whose subtypes are interned already. */
+	static element_layout* build_layout(ElementTypeStruct* type){
+		element_layout* layout = new element_layout;
+		layout->field_offsets = 0;
+		switch(type->type){
+			case TYPE_MIXED:{
+				MixedElementTypeStruct* mixedtype = (MixedElementTypeStruct*)type;
+				layout->field_offsets = new unsigned int[mixedtype->components + 1];
+				layout->size = 0;
+				layout->alignment = 1;
+				for(int comp_idx=0; comp_idx < mixedtype->components; comp_idx++){
+					const element_layout* field = mixedtype->subtypes[comp_idx]->layout;
+					layout->field_offsets[comp_idx] = layout->size;
+					layout->size += field->size;
+					if(field->alignment > layout->alignment){
+						layout->alignment = field->alignment;
+					}
+				}
+				layout->field_offsets[mixedtype->components] = layout->size;
+			} break;
+			case TYPE_INT: case TYPE_UINT:
+				layout->size = type->components * value_size(type->bit_width);
+				layout->alignment = value_alignment(value_size(type->bit_width));
+				break;
+			case TYPE_FLOAT:
+				layout->size = (type->components * type->bit_width + 7) / 8;
+				layout->alignment = type->bit_width % 8 ? 1 : value_alignment(type->bit_width / 8);
+				break;
+			default:
+				layout->size = (type->components * type->bit_width + 7) / 8;
+				layout->alignment = 1;
+		}
+		plan_swap(type, layout);
+		return layout;
+	}
+
+	/** Interns the type encoded in key[0, len), building it if it was not seen before.
+	 *  Must be called with interned_mutex held.
+	 */
+	static ElementTypeStruct* intern_locked(const uint8_t* key, size_t len){
+		type_table& table = interned_types();
+		std::string encoding((const char*)key, len);
+		type_table::iterator it = table.find(encoding);
+		if(it != table.end()){
+			return it->second;
+		}
+		if(skip_type_key(key, key + len) != key + len){
+			return 0;
+		}
+		ElementType tag = (ElementType)key[0];
+		uint8_t components = key[1];
+		uint8_t bit_width = key[2];
+		ElementTypeStruct* type;
+		switch(tag){
+			case TYPE_MIXED:{
+				MixedElementTypeStruct* mixedtype = new MixedElementTypeStruct(tag, components, bit_width);
+				const uint8_t* subkey = key + 3;
+				for(int comp_idx=0; comp_idx < components; comp_idx++){
+					const uint8_t* next = skip_type_key(subkey, key + len);
+					mixedtype->subtypes[comp_idx] = intern_locked(subkey, next - subkey);
+					subkey = next;
+				}
+				type = mixedtype;
+			} break;
+			case TYPE_CUSTOM:{
+				std::string type_name((const char*)key + 4, key[3]);
+				type = new CustomElementTypeStruct(tag, components, bit_width, type_name.c_str());
+			} break;
+			default:
+				type = new ElementTypeStruct(tag, components, bit_width);
+		}
+		type->layout = build_layout(type);
+DARX_TRACE("# interned element type " << ((int)tag) << " (" << type->layout->size << " bytes), " << (table.size() + 1) << " types");
+		table[encoding] = type;
+		return type;
+	}
+
+	ElementTypeStruct* intern_type_key(const uint8_t* key, size_t len){
+		std::lock_guard<std::mutex> lock(interned_mutex);
+		return intern_locked(key, len);
+	}
+
+	ElementTypeStruct* intern_type(ElementTypeStruct* type){
+		if(!type || type->layout){
+			// interned already
+			return type;
+		}
+		std::string key;
+		if(!append_type_key(type, key)){
+			return 0;
+		}
+		return intern_type_key((const uint8_t*)key.data(), key.size());
+	}
+
+	unsigned int element_alignment(ElementTypeStruct* type){
+		ElementTypeStruct* interned = intern_type(type);
+		return interned ? interned->layout->alignment : 0;
+	}
+
+	unsigned int field_offset(ElementTypeStruct* type, int field){
+		if(!type || field < 0 || field >= type->components){
+			return 0;
+		}
+		if(type->layout && type->layout->field_offsets){
+			return type->layout->field_offsets[field];
+		}
+		if(type->type != TYPE_MIXED){
+			// components of the same size
+			return field * (element_size(type) / type->components);
+		}
+		MixedElementTypeStruct* mixedtype = (MixedElementTypeStruct*)type;
+		unsigned int offset = 0;
+		for(int comp_idx=0; comp_idx < field; comp_idx++){
+			offset += element_size(mixedtype->subtypes[comp_idx]);
+		}
+		return offset;
+	}
+};
@@ -0,0 +1,233 @@
+/**
+ * @file
+ * In-place updates of darx data archives.
+ * Updated tensors are appended at the end of the file, and a new index is written
+ * after them, in a footer, as in streamed archives (see darx_stream.cpp). The header
+ * of an archive that had its index in the header is then rewritten to point to the
+ * footer, moving the metadata over the old index. The existing tensors are never
+ * moved, and replaced ones are left as dead space, until the archive is compacted.
+ */
+#include "darx.h"
+#include "darx_private.h"
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace darx{
+	// size of the chunks tensors are copied in when compacting an archive.
+	#define COMPACT_CHUNK_SIZE (1 << 20)
+
+	/** Wether the archive in the file was stored with this system's endianness (and, in
+	 *  format version 1, integer sizes), so that its descriptors and index may be written as is.
+	 */
+	static bool is_native_archive(FILE* file){
+		uint8_t header[DARX_COUNT_OFFSET_V1];
+		uint32_t int_magic2 = DARX_MAGIC_BE;
+		if(seek_file(file, 0, SEEK_SET) || read_file(header, 1, DARX_COUNT_OFFSET_V1, file) != DARX_COUNT_OFFSET_V1){
+			return false;
+		}
+		seek_file(file, 0, SEEK_SET);
+		uint8_t int_size = header[DARX_MAGIC_LEN + sizeof(uint32_t)];
+		uint8_t long_size = header[DARX_MAGIC_LEN + sizeof(uint32_t) + 1];
+		return !memcmp(header, DARX_MAGIC, DARX_MAGIC_LEN) &&
+			!memcmp(header + DARX_MAGIC_LEN, &int_magic2, sizeof(uint32_t)) &&
+			(int_size == DARX_VERSIONED_HEADER || (int_size == sizeof(unsigned int) && long_size == sizeof(long int)));
+	}
+
+	/** Adds a tensor to the updated archive's index. */
+	static bool add_tensor_position(archive_updater& updater, long int position, const char* name){
+		data_type_info format;
+		if(!archive_format(format, updater.archive) ||
+			updater.number_of_tensors >= streamed_index(format) - 1 || updater.number_of_tensors == UINT32_MAX
+		){
+			return false;
+		}
+		if(updater.number_of_tensors == updater.capacity){
+			unsigned int capacity = updater.capacity ? updater.capacity * 2 : 16;
+			long int* positions = new long int[capacity];
+			char** names = new char*[capacity];
+			for(unsigned int i=0; i < updater.number_of_tensors; i++){
+				positions[i] = updater.tensor_positions[i];
+				names[i] = updater.tensor_names[i];
+			}
+			delete[] updater.tensor_positions;
+			delete[] updater.tensor_names;
+			updater.tensor_positions = positions;
+			updater.tensor_names = names;
+			updater.capacity = capacity;
+		}
+		char* name_copy = 0;
+		if(name){
+			name_copy = new char[strlen(name) + 1];
+			strcpy(name_copy, name);
+		}
+		updater.tensor_positions[updater.number_of_tensors] = position;
+		updater.tensor_names[updater.number_of_tensors] = name_copy;
+		updater.number_of_tensors++;
+		return true;
+	}
+
+	static void release_updater(archive_updater& updater){
+		for(unsigned int i=0; i < updater.number_of_tensors; i++){
+			delete[] updater.tensor_names[i];
+		}
+		delete[] updater.tensor_names;
+		delete[] updater.tensor_positions;
+		updater.tensor_names = 0;
+		updater.tensor_positions = 0;
+		updater.number_of_tensors = 0;
+		updater.capacity = 0;
+		release_image(updater.archive);
+	}
+
+	bool begin_update(archive_updater& updater, FILE* file){
+		updater.file = file;
+		updater.number_of_tensors = 0;
+		updater.tensor_positions = 0;
+		updater.tensor_names = 0;
+		updater.capacity = 0;
+		updater.failed = true;
+		memset(&updater.archive, 0, sizeof(darx));
+		if(!is_native_archive(file) || load_image_from(updater.archive, file, LOAD_LAZY) != SUCCESS){
+			return false;
+		}
+		darx& archive = updater.archive;
+		for(uint32_t tensor_idx=0; tensor_idx < archive.number_of_tensors; tensor_idx++){
+			datatensor& tensor = archive.tensors[tensor_idx];
+			if(!add_tensor_position(updater, tensor.descriptor_offset, tensor.name)){
+				release_updater(updater);
+				return false;
+			}
+		}
+DARX_TRACE("# updating archive with " << updater.number_of_tensors << " tensors.");
+		updater.failed = false;
+		return true;
+	}
+
+	bool update_tensor(archive_updater& updater, datatensor& tensor){
+		FILE* file = updater.file;
+		if(updater.failed || seek_file(file, 0, SEEK_END)){
+			updater.failed = true;
+			return false;
+		}
+		// the tensor is written with the archive's format.
+		data_type_info format;
+		long int position = ftell(file);
+		if(!archive_format(format, updater.archive) || write_tensor(tensor, file, format) != SUCCESS || ferror(file)){
+			updater.failed = true;
+			return false;
+		}
+		// a tensor with the same name is replaced, others are added.
+		for(unsigned int i=0; tensor.name && i < updater.number_of_tensors; i++){
+			if(updater.tensor_names[i] && !strcmp(updater.tensor_names[i], tensor.name)){
+DARX_TRACE("# tensor["<<i<<"] '" << tensor.name << "' replaced @ file pos : " << position);
+				updater.tensor_positions[i] = position;
+				return true;
+			}
+		}
+DARX_TRACE("# tensor["<<updater.number_of_tensors<<"] appended @ file pos : " << position);
+		if(!add_tensor_position(updater, position, tensor.name)){
+			updater.failed = true;
+			return false;
+		}
+		return true;
+	}
+
+	bool finish_update(archive_updater& updater){
+		FILE* file = updater.file;
+		darx& archive = updater.archive;
+		data_type_info format;
+		bool success = !updater.failed && archive_format(format, archive) && !seek_file(file, 0, SEEK_END);
+		// the new index goes in a footer, after the appended tensors.
+		long int index_pos = ftell(file);
+DARX_TRACE("# tensors : " << updater.number_of_tensors << ", index @ file pos : " << index_pos);
+		success = success &&
+			write_uint(file, updater.number_of_tensors, format.count_size) &&
+			write_index(file, updater.tensor_positions, updater.number_of_tensors, format) &&
+			write_index(file, &index_pos, 1, format) &&
+			write_file(DARX_TRAILER_MAGIC, 1, DARX_MAGIC_LEN, file) == DARX_MAGIC_LEN &&
+			!fflush(file);
+		// the header's number of tensors is all ones in streamed archives.
+		uint8_t number_of_tensors[8];
+		success = success && !seek_file(file, count_offset(format), SEEK_SET) &&
+			read_file(number_of_tensors, 1, format.count_size, file) == format.count_size;
+		if(success && memcmp(number_of_tensors, "\xff\xff\xff\xff\xff\xff\xff\xff", format.count_size)){
+			// the footer is synced before the header is rewritten, but the rewrite itself is not
+			// atomic: a crash while the count and metadata are written leaves a corrupt header.
+			int fd = fileno(file);
+			success = fd < 0 || !fsync(fd);
+DARX_TRACE("# moving metadata over the header's index.");
+			success = success && !seek_file(file, count_offset(format), SEEK_SET) &&
+				write_uint(file, streamed_index(format), format.count_size) &&
+				write_uint(file, archive.metadata_size, format.count_size) &&
+				(!archive.metadata_size || write_file(archive.metadata, 1, archive.metadata_size, file) == archive.metadata_size);
+		}
+		success = success && !fflush(file);
+		release_updater(updater);
+		return success;
+	}
+
+	/** Copies len bytes at the given offset of one file to the end of another. */
+	static bool copy_stored_bytes(FILE* src, long int offset, size_t len, FILE* dst, uint8_t* chunk){
+		if(seek_file(src, offset, SEEK_SET)){
+			return false;
+		}
+		while(len > 0){
+			size_t count = len < COMPACT_CHUNK_SIZE ? len : COMPACT_CHUNK_SIZE;
+			if(read_file(chunk, 1, count, src) != count || write_file(chunk, 1, count, dst) != count){
+				return false;
+			}
+			len -= count;
+		}
+		return true;
+	}
+
+	bool compact_archive(FILE* src, FILE* dst){
+		darx archive;
+		memset(&archive, 0, sizeof(darx));
+		data_type_info format;
+		if(!is_native_archive(src) || load_image_from(archive, src, LOAD_LAZY) != SUCCESS){
+			return false;
+		}
+		// the compacted archive keeps the archive's format.
+		long int index_pos = archive_format(format, archive) ? write_header(archive, dst, format) : -1;
+		bool success = index_pos >= 0;
+		// the tensors follow the index and the metadata, in the order of the index. Their
+		// descriptors are written again, padded for the stored data to stay aligned.
+		long int position = index_pos + archive.number_of_tensors * format.long_size +
+			format.count_size + archive.metadata_size;
+		long int* positions = new long int[archive.number_of_tensors];
+		char** descriptors = new char*[archive.number_of_tensors];
+		size_t* descriptor_lengths = new size_t[archive.number_of_tensors];
+		memset(descriptors, 0, archive.number_of_tensors * sizeof(char*));
+		for(uint32_t tensor_idx=0; tensor_idx < archive.number_of_tensors && success; tensor_idx++){
+			datatensor& tensor = archive.tensors[tensor_idx];
+			positions[tensor_idx] = position;
+			descriptors[tensor_idx] = serialize_tensor_descriptor(tensor, tensor.data_size, position, format, &descriptor_lengths[tensor_idx]);
+			success = descriptors[tensor_idx] != 0;
+			position += descriptor_lengths[tensor_idx] + tensor.data_size;
+		}
+		success = success &&
+			write_index(dst, positions, archive.number_of_tensors, format) &&
+			write_uint(dst, archive.metadata_size, format.count_size) &&
+			(!archive.metadata_size || write_file(archive.metadata, 1, archive.metadata_size, dst) == archive.metadata_size);
+		uint8_t* chunk = new uint8_t[COMPACT_CHUNK_SIZE];
+		for(uint32_t tensor_idx=0; tensor_idx < archive.number_of_tensors && success; tensor_idx++){
+			// stored data is copied as is.
+			datatensor& tensor = archive.tensors[tensor_idx];
+			success = write_file(descriptors[tensor_idx], 1, descriptor_lengths[tensor_idx], dst) == descriptor_lengths[tensor_idx] &&
+				copy_stored_bytes(src, tensor.data_offset, tensor.data_size, dst, chunk);
+		}
+		for(uint32_t tensor_idx=0; tensor_idx < archive.number_of_tensors; tensor_idx++){
+			free(descriptors[tensor_idx]);
+		}
+		delete[] chunk;
+		delete[] positions;
+		delete[] descriptors;
+		delete[] descriptor_lengths;
+		release_image(archive);
+DARX_TRACE("# archive compacted to " << position << " bytes.");
+		return success && !fflush(dst);
+	}
+};
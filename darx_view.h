@@ -0,0 +1,262 @@
+/**
+ * @file
+ * Typed, strided views over the data of darx data tensors.
+ * A tensor_view checks a tensor's element type against its C++ element type once,
+ * when it is created, and then indexes the data without any further checks or casts.
+ * Views may be sliced along any dimmension, and may view a single field of the
+ * elements of a mixed type tensor.
+ *
+ *     darx::tensor_view<float, 2> image(tensor);
+ *     if(image.valid()){
+ *         for(size_t y=0; y < image.length(0); y++){
+ *             darx::tensor_view<float, 1> row = image[y];
+ *             for(size_t x=0; x < row.length(0); x++){ row(x) *= 2; }
+ *         }
+ *     }
+ *
+ * Strides are in bytes, so that fields of mixed elements can be viewed as well.
+ * Views over contiguous data may be handed to loops as plain pointers, see data().
+ */
+#ifndef DARX_VIEW_H
+#define DARX_VIEW_H
+
+#include "darx.h"
+#include <stddef.h>
+
+namespace darx{
+	/** Describes the element type of a tensor that a C++ type may view.
+	 *  Specialized for the integer, floating point and character types, and for arrays
+	 *  of them (as multi-component elements). Applications may specialize it for their
+	 *  own types, giving the type, number of components and bit width they are stored with.
+	 */
+	template<typename T> struct element_traits{
+		/** Wether the C++ type may view tensor elements at all. */
+		static const bool viewable = false;
+	};
+
+	#define DARX_ELEMENT_TRAITS(cpp_type, element_type) \
+	template<> struct element_traits<cpp_type>{ \
+		static const bool viewable = true; \
+		static const ElementType type = element_type; \
+		static const uint8_t components = 1; \
+		static const uint8_t bit_width = 8 * sizeof(cpp_type); \
+	}
+	DARX_ELEMENT_TRAITS(int8_t, TYPE_INT);
+	DARX_ELEMENT_TRAITS(int16_t, TYPE_INT);
+	DARX_ELEMENT_TRAITS(int32_t, TYPE_INT);
+	DARX_ELEMENT_TRAITS(int64_t, TYPE_INT);
+	DARX_ELEMENT_TRAITS(uint8_t, TYPE_UINT);
+	DARX_ELEMENT_TRAITS(uint16_t, TYPE_UINT);
+	DARX_ELEMENT_TRAITS(uint32_t, TYPE_UINT);
+	DARX_ELEMENT_TRAITS(uint64_t, TYPE_UINT);
+	DARX_ELEMENT_TRAITS(float, TYPE_FLOAT);
+	DARX_ELEMENT_TRAITS(double, TYPE_FLOAT);
+	DARX_ELEMENT_TRAITS(char, TYPE_CHAR);
+	#undef DARX_ELEMENT_TRAITS
+
+	/** Arrays view elements with several components (e.g. uint8_t[3] for RGB pixels). */
+	template<typename T, size_t N> struct element_traits<T[N]>{
+		static const bool viewable = element_traits<T>::viewable && element_traits<T>::components == 1;
+		static const ElementType type = element_traits<T>::type;
+		static const uint8_t components = N;
+		static const uint8_t bit_width = element_traits<T>::bit_width;
+	};
+
+	/** Wether data of the given element type may be viewed as T. */
+	template<typename T> inline bool element_type_matches(ElementTypeStruct* type){
+		return element_traits<T>::viewable && type &&
+			type->type == element_traits<T>::type &&
+			type->components == element_traits<T>::components &&
+			(type->bit_width == element_traits<T>::bit_width ||
+				// integers of other bit widths are held in the next native integer type.
+				((type->type == TYPE_INT || type->type == TYPE_UINT) && type->bit_width % 8 && type->bit_width < element_traits<T>::bit_width)) &&
+			element_size(type) == sizeof(T);
+	}
+
+	/** Random access iterator over the elements of a strided, one-dimmensional view. */
+	template<typename T> class strided_iterator{
+		char* ptr;
+		ptrdiff_t stride;
+		public:
+		inline strided_iterator(char* _ptr, ptrdiff_t _stride): ptr(_ptr), stride(_stride){}
+		inline T& operator*() const { return *(T*)ptr; }
+		inline T& operator[](ptrdiff_t n) const { return *(T*)(ptr + n * stride); }
+		inline strided_iterator& operator++(){ ptr += stride; return *this; }
+		inline strided_iterator& operator--(){ ptr -= stride; return *this; }
+		inline strided_iterator& operator+=(ptrdiff_t n){ ptr += n * stride; return *this; }
+		inline strided_iterator operator+(ptrdiff_t n) const { return strided_iterator(ptr + n * stride, stride); }
+		inline ptrdiff_t operator-(const strided_iterator& other) const { return (ptr - other.ptr) / stride; }
+		inline bool operator==(const strided_iterator& other) const { return ptr == other.ptr; }
+		inline bool operator!=(const strided_iterator& other) const { return ptr != other.ptr; }
+		inline bool operator<(const strided_iterator& other) const { return stride > 0 ? ptr < other.ptr : ptr > other.ptr; }
+	};
+
+	template<typename T, int Rank> class tensor_view;
+
+	/** Indexes the first dimmension of a view: gives a view of rank Rank-1, or an element. */
+	template<typename T, int Rank> struct view_subscript{
+		typedef tensor_view<T, Rank-1> result;
+		static inline result at(char* base, const size_t* lengths, const ptrdiff_t* strides, size_t idx){
+			return result(base + idx * strides[0], lengths + 1, strides + 1);
+		}
+	};
+	template<typename T> struct view_subscript<T, 1>{
+		typedef T& result;
+		static inline result at(char* base, const size_t*, const ptrdiff_t* strides, size_t idx){
+			return *(T*)(base + idx * strides[0]);
+		}
+	};
+
+	/** Typed view over a tensor's data, with Rank dimmensions of elements of type T.
+	 *  The view does not own the data: it stays valid as long as the tensor's data does.
+	 */
+	template<typename T, int Rank> class tensor_view{
+		static_assert(element_traits<T>::viewable, "tensor_view: T is not an element type (see element_traits)");
+		char* base;
+		size_t lengths[Rank];
+		ptrdiff_t strides[Rank];
+
+		/** Sets the view over the tensor's data, with elements of elem_size bytes, starting
+		 *  field_offset bytes into each of them, if the tensor is loaded and has Rank dimmensions.
+		 */
+		inline void init(datatensor& tensor, size_t elem_size, size_t field_offset){
+			base = 0;
+			if(tensor.rank != Rank || !tensor.data || ((uintptr_t)tensor.data + field_offset) % alignof(T) || elem_size % alignof(T)){
+				return;
+			}
+			ptrdiff_t stride = elem_size;
+			for(int d=Rank-1; d >= 0; d--){
+				lengths[d] = tensor.lengths[d];
+				strides[d] = stride;
+				stride *= tensor.lengths[d];
+			}
+			base = (char*)tensor.data + field_offset;
+		}
+
+		public:
+		/** Constructs an invalid view. */
+		inline tensor_view(): base(0){
+			for(int d=0; d < Rank; d++){ lengths[d] = 0; strides[d] = 0; }
+		}
+
+		/** Constructs a view over a tensor's data.
+		 *  The view is invalid if the tensor is not loaded, does not have Rank dimmensions,
+		 *  or its element type does not match T (see element_traits).
+		 */
+		explicit inline tensor_view(datatensor& tensor){
+			init(tensor, element_size(tensor.type), 0);
+			if(!element_type_matches<T>(tensor.type)){
+				base = 0;
+			}
+		}
+
+		/** Constructs a view over one field of the elements of a mixed type tensor.
+		 *  The view is invalid if the tensor's type is not mixed, if the field's type does
+		 *  not match T, or if the field is not aligned for T within the elements.
+		 *  Fields of columnar tensors (see set_columnar()) are viewed as contiguous columns.
+		 *
+		 * @param[in] tensor - the mixed type tensor
+		 * @param[in] field - index of the field in the tensor's element type (its subtypes)
+		 */
+		inline tensor_view(datatensor& tensor, int field){
+			base = 0;
+			if(!tensor.type || tensor.type->type != TYPE_MIXED){
+				return;
+			}
+			MixedElementTypeStruct* mixedtype = (MixedElementTypeStruct*)tensor.type;
+			if(field < 0 || field >= mixedtype->components || !element_type_matches<T>(mixedtype->subtypes[field])){
+				return;
+			}
+			// the field follows the previous ones in each element, or their columns in columnar tensors.
+			size_t number_of_elements = 1;
+			for(int d=0; tensor.columnar && d < tensor.rank; d++){
+				number_of_elements *= tensor.lengths[d];
+			}
+			init(tensor, tensor.columnar ? sizeof(T) : element_size(tensor.type), number_of_elements * ::darx::field_offset(tensor.type, field));
+		}
+
+		/** Constructs a view over raw data (e.g. a buffer filled by read_tensor_region()).
+		 *
+		 * @param[in] data - address of the first element
+		 * @param[in] _lengths - number of elements in each dimmension
+		 * @param[in] _strides - distance, in bytes, between consecutive elements in each dimmension
+		 */
+		inline tensor_view(void* data, const size_t* _lengths, const ptrdiff_t* _strides): base((char*)data){
+			for(int d=0; d < Rank; d++){ lengths[d] = _lengths[d]; strides[d] = _strides[d]; }
+		}
+
+		/** Wether the view could be set over the tensor's data. */
+		inline bool valid() const { return base != 0; }
+
+		/** Number of elements in the given dimmension. */
+		inline size_t length(int dim) const { return lengths[dim]; }
+
+		/** Distance, in bytes, between consecutive elements in the given dimmension. */
+		inline ptrdiff_t stride(int dim) const { return strides[dim]; }
+
+		/** Number of elements in the view. */
+		inline size_t size() const {
+			size_t count = 1;
+			for(int d=0; d < Rank; d++){ count *= lengths[d]; }
+			return count;
+		}
+
+		/** Wether the view's elements are packed one after the other, row-major.
+		 *  This is the case for views over whole tensors, but not over fields or slices.
+		 */
+		inline bool contiguous() const {
+			ptrdiff_t stride = sizeof(T);
+			for(int d=Rank-1; d >= 0; d--){
+				if(lengths[d] > 1 && strides[d] != stride){
+					return false;
+				}
+				stride *= lengths[d];
+			}
+			return true;
+		}
+
+		/** Address of the view's first element.
+		 *  If the view is contiguous(), its size() elements can be accessed through it directly.
+		 */
+		inline T* data() const { return (T*)base; }
+
+		/** Element at the given indices, one per dimmension (unchecked). */
+		template<typename... Indices> inline T& operator()(Indices... indices) const {
+			static_assert(sizeof...(Indices) == Rank, "tensor_view indexed with the wrong number of indices");
+			const size_t idx[Rank] = { (size_t)indices... };
+			char* ptr = base;
+			for(int d=0; d < Rank; d++){ ptr += idx[d] * strides[d]; }
+			return *(T*)ptr;
+		}
+
+		/** View of rank Rank-1 at the given index of the first dimmension,
+		 *  or element at the given index, for one-dimmensional views (unchecked).
+		 */
+		inline typename view_subscript<T, Rank>::result operator[](size_t idx) const {
+			return view_subscript<T, Rank>::at(base, lengths, strides, idx);
+		}
+
+		/** View of a range of the given dimmension, of count elements from start,
+		 *  taking every step'th one (unchecked).
+		 */
+		inline tensor_view slice(int dim, size_t start, size_t count, size_t step=1) const {
+			tensor_view view(*this);
+			view.base += start * strides[dim];
+			view.lengths[dim] = count;
+			view.strides[dim] *= step;
+			return view;
+		}
+
+		/** Iterators over the elements of one-dimmensional views. */
+		inline strided_iterator<T> begin() const {
+			static_assert(Rank == 1, "only one-dimmensional tensor_views can be iterated over");
+			return strided_iterator<T>(base, strides[0]);
+		}
+		inline strided_iterator<T> end() const {
+			static_assert(Rank == 1, "only one-dimmensional tensor_views can be iterated over");
+			return strided_iterator<T>(base + lengths[0] * strides[0], strides[0]);
+		}
+	};
+};
+
+#endif